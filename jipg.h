@@ -18,10 +18,6 @@
 #define JIPG_DEFAULT_FLOAT_TYPE "double"
 #endif
 
-#ifndef JIPG_PARSER_CAP
-#define JIPG_PARSER_CAP 8
-#endif
-
 #ifndef JIPG_REALLOC
 #include <stdlib.h>
 #define JIPG_REALLOC realloc
@@ -37,8 +33,8 @@
 #define JIPG_ASSERT assert
 #endif
 
-#ifndef JIPG_VALUE_ARENA_CAP
-#define JIPG_VALUE_ARENA_CAP 1024
+#ifndef JIPG_VALUE_CHUNK_CAP
+#define JIPG_VALUE_CHUNK_CAP 1024
 #endif
 
 #ifndef JIPG_INIT_LIST_CAP
@@ -47,6 +43,57 @@
 
 static_assert((JIPG_INIT_LIST_CAP & (JIPG_INIT_LIST_CAP - 1)) == 0, "JIPG_INIT_LIST_CAP must be power of two");
 
+// Largest initial array capacity --profile picks.
+#ifndef JIPG_PROFILE_MAX_INIT_CAP
+#define JIPG_PROFILE_MAX_INIT_CAP 4096
+#endif
+
+// Frames validate_<Head>() has for JIPG_REF nesting; it never allocates more.
+#ifndef JIPG_VALIDATE_MAX_DEPTH
+#define JIPG_VALIDATE_MAX_DEPTH 1024
+#endif
+
+// First block of a --arena Jipg_Arena, a multiple of 2 MB huge pages.
+#ifndef JIPG_ARENA_BLOCK_SIZE
+#define JIPG_ARENA_BLOCK_SIZE (8 << 20)
+#endif
+
+static_assert(JIPG_ARENA_BLOCK_SIZE % (2 << 20) == 0, "JIPG_ARENA_BLOCK_SIZE must be a multiple of 2 MB");
+
+#ifndef JIPG_NODE_CHUNK_SIZE
+#define JIPG_NODE_CHUNK_SIZE 65536
+#endif
+
+// parse_<Head>_batch() prefetches the document this many ahead of the one it
+// parses, up to JIPG_BATCH_PREFETCH_BYTES of it.
+#ifndef JIPG_BATCH_PREFETCH_DISTANCE
+#define JIPG_BATCH_PREFETCH_DISTANCE 4
+#endif
+
+#ifndef JIPG_BATCH_PREFETCH_BYTES
+#define JIPG_BATCH_PREFETCH_BYTES 1024
+#endif
+
+// Reads parse_<Head>_files() keeps in flight, and the zeroed bytes after the
+// content of every read buffer.
+#ifndef JIPG_PIPELINE_DEPTH
+#define JIPG_PIPELINE_DEPTH 64
+#endif
+
+#ifndef JIPG_PIPELINE_PADDING
+#define JIPG_PIPELINE_PADDING 64
+#endif
+
+// parse_<Head>_gzip_each() inflates into blocks of JIPG_GZIP_BLOCK_SIZE bytes,
+// at most JIPG_GZIP_DEPTH of them ahead of the parser.
+#ifndef JIPG_GZIP_BLOCK_SIZE
+#define JIPG_GZIP_BLOCK_SIZE (256 << 10)
+#endif
+
+#ifndef JIPG_GZIP_DEPTH
+#define JIPG_GZIP_DEPTH 4
+#endif
+
 #define UNREACHABLE()                                                                               \
     do {                                                                                            \
         fprintf(stderr, "UNREACHABLE CODE REACHED: %s:%d in %s()\n", __FILE__, __LINE__, __func__); \
@@ -66,15 +113,42 @@ typedef enum {
     JIPG_KIND_INT,
     JIPG_KIND_FLOAT,
     JIPG_KIND_BOOL,
+    JIPG_KIND_UNION,
+    JIPG_KIND_UNION_CASE,
+    JIPG_KIND_MAP,
+    JIPG_KIND_ENUM,
+    JIPG_KIND_STRING_INTERNED,
+    JIPG_KIND_REF,
+    JIPG_KIND_NUMBER_RAW,
     JIPG_KIND_VALUE_COUNT,
 } Jipg_Value_Kind;
 
 typedef struct Jipg_Value Jipg_Value;
+typedef struct Jipg_Profile Jipg_Profile;
 
 struct Jipg_Value {
     Jipg_Value_Kind kind;
     const char *head;
 
+    // Structural hash, used to hash-cons identical subtrees.
+    uint64_t shape_hash;
+    // Type and parser are emitted by an earlier, structurally identical value,
+    // the canonical one.
+    bool shared;
+    Jipg_Value *canonical;
+
+    // Set by --profile on canonical values the samples reached.
+    Jipg_Profile *profile;
+
+    // Only meaningful on object member values: the key may be missing, or the
+    // value may be null. Either way the object gets a presence bit for it.
+    bool optional;
+    bool nullable;
+
+    // With --instrument: the struct parser's timer slot on object, array,
+    // union and map values, the member's parse counter on object members.
+    size_t stats_index;
+
     union {
         struct {
             char *struct_name;
@@ -92,29 +166,169 @@ struct Jipg_Value {
             size_t cap;
             Jipg_Value *internal;
         } as_array;
+
+        struct {
+            char *struct_name;
+            const char *discriminator;
+            Jipg_Value *case_head;
+        } as_union;
+
+        struct {
+            const char *tag;
+            // tag as the identifier of its member and enumerator.
+            char *name;
+            Jipg_Value *value;
+            Jipg_Value *next;
+        } as_union_case;
+
+        struct {
+            char *struct_name;
+            Jipg_Value *internal;
+        } as_map;
+
+        struct {
+            char *struct_name;
+            size_t count;
+            const char **names;
+        } as_enum;
+
+        // Another head by name, resolved to its value once all heads exist.
+        struct {
+            const char *head;
+            Jipg_Value *target;
+        } as_ref;
     };
 };
 
 typedef struct {
     const char *head_struct_name;
+    const char *schema_file;
     Jipg_Value *(*value_gen)(void);
 } Jipg_Parser;
 
+// Values live in fixed size chunks so pointers into the arena stay valid as it grows.
+typedef struct Jipg_Value_Chunk Jipg_Value_Chunk;
+struct Jipg_Value_Chunk {
+    Jipg_Value_Chunk *prev;
+    size_t size;
+    Jipg_Value values[JIPG_VALUE_CHUNK_CAP];
+};
+
 typedef struct {
-    size_t arena_size;
-    Jipg_Value arena[JIPG_VALUE_ARENA_CAP];
+    Jipg_Value_Chunk *arena;
 
     size_t parser_count;
-    Jipg_Parser parsers[JIPG_PARSER_CAP];
+    size_t parser_cap;
+    Jipg_Parser *parsers;
 
     size_t name_alloc;
+
+    // Open-addressing table of canonical (first seen) objects and arrays.
+    size_t shape_count;
+    size_t shape_cap;
+    Jipg_Value **shapes;
+
+    // Set by --instrument; counters are numbered across all heads of the output.
+    bool instrument;
+    size_t stats_field_count;
+    size_t stats_struct_count;
+
+    // Set by --snapshot.
+    bool snapshot;
+
+    // Set by --pipeline.
+    bool pipeline;
+
+    // Set by --arena.
+    bool result_arena;
+
+    // Set by --gzip.
+    bool gzip;
+
+    // Sample documents given with --profile.
+    size_t profile_count;
+    const char **profiles;
 } Jipg_Context;
 
 static Jipg_Context jipg_global_context = {0};
 
+// Parse results are allocated with these, which with --arena go to the
+// thread's Jipg_Arena when one is set. Generated code calls the allocator
+// through JIPG_REALLOC and JIPG_FREE, see jipg_emit_allocator_macros().
+static const char *jipg_result_realloc(void) {
+    return jipg_global_context.result_arena ? "mem_realloc" : "JIPG_REALLOC";
+}
+
+static const char *jipg_result_free(void) {
+    return jipg_global_context.result_arena ? "mem_free" : "JIPG_FREE";
+}
+
+static inline void jipg_register_parser(Jipg_Parser parser) {
+    Jipg_Context *ctx = &jipg_global_context;
+    if (ctx->parser_count == ctx->parser_cap) {
+        ctx->parser_cap = ctx->parser_cap ? ctx->parser_cap * 2 : 8;
+        ctx->parsers = JIPG_REALLOC(ctx->parsers, ctx->parser_cap * sizeof(*ctx->parsers));
+        JIPG_ASSERT(ctx->parsers);
+    }
+    ctx->parsers[ctx->parser_count++] = parser;
+}
+
+static inline Jipg_Value *jipg_value_set_optional(Jipg_Value *value) {
+    value->optional = true;
+    return value;
+}
+
+static inline Jipg_Value *jipg_value_set_nullable(Jipg_Value *value) {
+    value->nullable = true;
+    return value;
+}
+
+// Words that cannot name a member or enumerator in the C or C++ output.
+static const char *jipg_reserved_words[] = {
+    "_Alignas", "_Alignof", "_Atomic", "_Bool", "_Complex", "_Generic", "_Imaginary", "_Noreturn",
+    "_Static_assert", "_Thread_local", "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand",
+    "bitor", "bool", "break", "case", "catch", "char", "char16_t", "char32_t", "char8_t", "class",
+    "compl", "concept", "const", "const_cast", "consteval", "constexpr", "constinit", "continue",
+    "co_await", "co_return", "co_yield", "decltype", "default", "delete", "do", "double",
+    "dynamic_cast", "else", "enum", "explicit", "export", "extern", "false", "float", "for", "friend",
+    "goto", "if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept", "not", "not_eq",
+    "nullptr", "operator", "or", "or_eq", "private", "protected", "public", "register",
+    "reinterpret_cast", "requires", "restrict", "return", "short", "signed", "sizeof", "static",
+    "static_assert", "static_cast", "struct", "switch", "template", "this", "thread_local", "throw",
+    "true", "try", "typedef", "typeid", "typename", "union", "unsigned", "using", "virtual", "void",
+    "volatile", "wchar_t", "while", "xor", "xor_eq",
+};
+
+// name with every character that cannot appear in an identifier replaced by
+// '_', a '_' prepended if it would start with a digit or be empty, and one
+// appended if it is a reserved word.
+static char *jipg_identifier(const char *name) {
+    size_t len = strlen(name);
+    char *res = JIPG_REALLOC(NULL, len + 3);
+    JIPG_ASSERT(res);
+    char *p = res;
+    if (!isalpha((unsigned char)*name) && *name != '_') *p++ = '_';
+    for (const char *c = name; *c; ++c) *p++ = isalnum((unsigned char)*c) ? *c : '_';
+    *p = '\0';
+    for (size_t i = 0; i < ARRAY_SIZE(jipg_reserved_words); ++i) {
+        if (strcmp(res, jipg_reserved_words[i]) != 0) continue;
+        *p++ = '_';
+        *p = '\0';
+        break;
+    }
+    return res;
+}
+
 static inline Jipg_Value *new_jipg_value(Jipg_Value_Kind kind, ...) {
-    JIPG_ASSERT(jipg_global_context.arena_size < JIPG_VALUE_ARENA_CAP);
-    Jipg_Value *value = jipg_global_context.arena + jipg_global_context.arena_size++;
+    Jipg_Value_Chunk *chunk = jipg_global_context.arena;
+    if (chunk == NULL || chunk->size == JIPG_VALUE_CHUNK_CAP) {
+        chunk = JIPG_REALLOC(NULL, sizeof(*chunk));
+        JIPG_ASSERT(chunk);
+        chunk->prev = jipg_global_context.arena;
+        chunk->size = 0;
+        jipg_global_context.arena = chunk;
+    }
+    Jipg_Value *value = chunk->values + chunk->size++;
     *value = (Jipg_Value){.kind = kind};
 
     va_list args;
@@ -145,10 +359,60 @@ static inline Jipg_Value *new_jipg_value(Jipg_Value_Kind kind, ...) {
             value->as_array.internal = va_arg(args, Jipg_Value *);
         } break;
 
+        case JIPG_KIND_UNION: {
+            value->as_union.discriminator = va_arg(args, char *);
+            size_t count = va_arg(args, size_t);
+
+            Jipg_Value **last_next = &value->as_union.case_head;
+            for (size_t i = 0; i < count; ++i) {
+                Jipg_Value *c = va_arg(args, Jipg_Value *);
+                // Case members share the scope of the discriminator member.
+                JIPG_ASSERT(strcmp(c->as_union_case.name, value->as_union.discriminator) != 0 &&
+                            "union case tag clashes with the discriminator member");
+                // The discriminator is consumed before the case object is
+                // parsed, and its value is the tag.
+                for (Jipg_Value *kv = c->as_union_case.value->as_object.kv_head; kv; kv = kv->as_object_kv.next)
+                    JIPG_ASSERT(strcmp(kv->as_object_kv.key, value->as_union.discriminator) != 0 &&
+                                "union case objects must not declare the discriminator");
+                for (Jipg_Value *d = value->as_union.case_head; d != c && d; d = d->as_union_case.next)
+                    JIPG_ASSERT(strcmp(c->as_union_case.name, d->as_union_case.name) != 0 &&
+                                "union case tags must map to distinct identifiers");
+                *last_next = c;
+                last_next = &c->as_union_case.next;
+            }
+        } break;
+
+        case JIPG_KIND_UNION_CASE: {
+            value->as_union_case.tag = va_arg(args, char *);
+            value->as_union_case.name = jipg_identifier(value->as_union_case.tag);
+            value->as_union_case.value = va_arg(args, Jipg_Value *);
+            // The discriminator is a key of the case object.
+            JIPG_ASSERT(value->as_union_case.value->kind == JIPG_KIND_OBJECT);
+        } break;
+
+        case JIPG_KIND_MAP: {
+            value->as_map.internal = va_arg(args, Jipg_Value *);
+        } break;
+
+        case JIPG_KIND_ENUM: {
+            size_t count = va_arg(args, size_t);
+            value->as_enum.count = count;
+            value->as_enum.names = JIPG_REALLOC(NULL, count * sizeof(*value->as_enum.names));
+            JIPG_ASSERT(value->as_enum.names);
+            for (size_t i = 0; i < count; ++i)
+                value->as_enum.names[i] = va_arg(args, char *);
+        } break;
+
+        case JIPG_KIND_REF: {
+            value->as_ref.head = va_arg(args, char *);
+        } break;
+
         case JIPG_KIND_STRING:
         case JIPG_KIND_INT:
         case JIPG_KIND_FLOAT:
         case JIPG_KIND_BOOL:
+        case JIPG_KIND_STRING_INTERNED:
+        case JIPG_KIND_NUMBER_RAW:
             break;
     }
 
@@ -186,6 +450,53 @@ static inline Jipg_Value *new_jipg_value(Jipg_Value_Kind kind, ...) {
     new_jipg_value(JIPG_KIND_BOOL)
 #define JIPG_BOOL() JIPG_BOOL_IMPL()
 
+// The DISCRIMINATOR member selects the JIPG_CASE whose object holds the other
+// members; case objects must not declare DISCRIMINATOR themselves.
+#define JIPG_UNION_IMPL(DISCRIMINATOR, ...)                                                           \
+    new_jipg_value(JIPG_KIND_UNION, DISCRIMINATOR, sizeof((Jipg_Value *[]){__VA_ARGS__}) / sizeof(Jipg_Value *), \
+                   __VA_ARGS__)
+#define JIPG_UNION(DISCRIMINATOR, ...) JIPG_UNION_IMPL(DISCRIMINATOR, __VA_ARGS__)
+
+#define JIPG_CASE_IMPL(TAG, VALUE) \
+    new_jipg_value(JIPG_KIND_UNION_CASE, TAG, VALUE)
+#define JIPG_CASE(TAG, VALUE) JIPG_CASE_IMPL(TAG, VALUE)
+
+#define JIPG_MAP_IMPL(INTERNAL) \
+    new_jipg_value(JIPG_KIND_MAP, INTERNAL)
+#define JIPG_MAP(INTERNAL) JIPG_MAP_IMPL(INTERNAL)
+
+#define JIPG_ENUM_IMPL(...) \
+    new_jipg_value(JIPG_KIND_ENUM, sizeof((const char *[]){__VA_ARGS__}) / sizeof(const char *), __VA_ARGS__)
+#define JIPG_ENUM(...) JIPG_ENUM_IMPL(__VA_ARGS__)
+
+#define JIPG_STRING_INTERNED_IMPL() \
+    new_jipg_value(JIPG_KIND_STRING_INTERNED)
+#define JIPG_STRING_INTERNED() JIPG_STRING_INTERNED_IMPL()
+
+// A number kept as the offset and length of its text in the input, converted
+// on demand by the generated _as_i64/_as_f64 accessors, which take that input
+// again. After merge_<Head>() the offsets of merged members are into the patch;
+// the buffers of _files and _gzip_each are gone once the callback returns, and
+// snapshots keep only the offsets.
+#define JIPG_NUMBER_RAW_IMPL() \
+    new_jipg_value(JIPG_KIND_NUMBER_RAW)
+#define JIPG_NUMBER_RAW() JIPG_NUMBER_RAW_IMPL()
+
+// Refers to the value of the JIPG_PARSER head named HEAD, which may be the
+// head being defined. Members become pointers to nodes, array items become the
+// nodes themselves.
+#define JIPG_REF_IMPL(HEAD) \
+    new_jipg_value(JIPG_KIND_REF, HEAD)
+#define JIPG_REF(HEAD) JIPG_REF_IMPL(HEAD)
+
+#define JIPG_OPTIONAL_IMPL(VALUE) \
+    jipg_value_set_optional(VALUE)
+#define JIPG_OPTIONAL(VALUE) JIPG_OPTIONAL_IMPL(VALUE)
+
+#define JIPG_NULLABLE_IMPL(VALUE) \
+    jipg_value_set_nullable(VALUE)
+#define JIPG_NULLABLE(VALUE) JIPG_NULLABLE_IMPL(VALUE)
+
 #define JIPG_PARSER(STRUCT_NAME, VALUE)                                         \
     static Jipg_Value *jipg_##STRUCT_NAME##_gen(void) {                         \
         return VALUE;                                                           \
@@ -193,11 +504,10 @@ static inline Jipg_Value *new_jipg_value(Jipg_Value_Kind kind, ...) {
                                                                                 \
     static void jipg_register_##STRUCT_NAME(void) __attribute__((constructor)); \
     static void jipg_register_##STRUCT_NAME(void) {                             \
-        JIPG_ASSERT(jipg_global_context.parser_count < JIPG_PARSER_CAP);        \
-        size_t idx = jipg_global_context.parser_count++;                        \
-        jipg_global_context.parsers[idx] =                                      \
+        jipg_register_parser(                                                   \
             (Jipg_Parser){.head_struct_name = #STRUCT_NAME,                     \
-                          .value_gen = jipg_##STRUCT_NAME##_gen};               \
+                          .schema_file = __FILE__,                              \
+                          .value_gen = jipg_##STRUCT_NAME##_gen});              \
     }
 
 #ifdef JIPG_STRIP_PREFIX
@@ -209,298 +519,187 @@ static inline Jipg_Value *new_jipg_value(Jipg_Value_Kind kind, ...) {
 #define INT JIPG_INT
 #define FLOAT JIPG_FLOAT
 #define BOOL JIPG_BOOL
+#define UNION JIPG_UNION
+#define CASE JIPG_CASE
+#define MAP JIPG_MAP
+#define ENUM JIPG_ENUM
+#define STRING_INTERNED JIPG_STRING_INTERNED
+#define NUMBER_RAW JIPG_NUMBER_RAW
+#define REF JIPG_REF
+#define OPTIONAL JIPG_OPTIONAL
+#define NULLABLE JIPG_NULLABLE
 #define PARSER JIPG_PARSER
 #endif
 
-static uint64_t sbox_lut[256] = {
-    4319792334712819669llu,
-    11788048577503494824llu,
-    4192769064029443593llu,
-    2513787319205155662llu,
-    2134567472807851094llu,
-    1735254072534978428llu,
-    10598951352238613536llu,
-    6878563960102566144llu,
-    13600800192354800053llu,
-    11046179386901516386llu,
-    17980805327672283720llu,
-    8985440510998354245llu,
-    6183111496651652315llu,
-    6452449828796159277llu,
-    15247151809474287309llu,
-    628930027092821547llu,
-    4211374611712381237llu,
-    8281039959893252210llu,
-    17390767703283089698llu,
-    16873412698214365220llu,
-    5026511325615183432llu,
-    2754439531571637074llu,
-    10844283540583983130llu,
-    16374963750459844554llu,
-    2654745661507182789llu,
-    16336963449664068247llu,
-    9014946178090130474llu,
-    9843414387061402607llu,
-    14259680413192756630llu,
-    2260059874028813140llu,
-    13745877420346827559llu,
-    5972285565579831383llu,
-    13852939945820309002llu,
-    14837314206658177788llu,
-    17402143655000940783llu,
-    1708604567626761540llu,
-    4971097370218678035llu,
-    7674742225009642846llu,
-    13155675349293154075llu,
-    18326272682222133568llu,
-    5298809203106154964llu,
-    10321967684452856755llu,
-    9904615985190967285llu,
-    9017917336912873721llu,
-    14740931612662927227llu,
-    11200519612596959265llu,
-    9554698661026540077llu,
-    11018450097963108256llu,
-    12305895460640548825llu,
-    10438989659195208381llu,
-    8015438448961043528llu,
-    17136452634472530012llu,
-    16835094323228825799llu,
-    2931420695595796890llu,
-    9267616329121027312llu,
-    10026743574507445845llu,
-    18362789087893070577llu,
-    10974710480031330365llu,
-    11419262694613242363llu,
-    7568953912120267979llu,
-    15887571027615820885llu,
-    8775471937118169068llu,
-    15195899463999599281llu,
-    9747648019597706196llu,
-    8201586468252878983llu,
-    5719011471609942381llu,
-    13161946082177172418llu,
-    9643816490275617805llu,
-    6730682062675188990llu,
-    14089583241851970809llu,
-    5635197312546352421llu,
-    12655462067761187474llu,
-    13449440608602046021llu,
-    6644636282855459766llu,
-    3050467116415598703llu,
-    3684536428532129555llu,
-    12028965273189028973llu,
-    14643909474857509060llu,
-    11361797772764692215llu,
-    17277487187655181768llu,
-    6415102370970183924llu,
-    5524091569279524857llu,
-    5068062803131918708llu,
-    7109967286375589665llu,
-    11593927233023144500llu,
-    2558289301845890764llu,
-    11523058457548473969llu,
-    7863147243172846153llu,
-    9163551553006898156llu,
-    11306257618139311415llu,
-    1091573458739121057llu,
-    6769139033989907147llu,
-    13564598501354656307llu,
-    11284935533708579323llu,
-    11521065115140151397llu,
-    1444550222897899060llu,
-    13662499872620805028llu,
-    4245035599922404824llu,
-    9067794782920689701llu,
-    16507826654309833394llu,
-    3691186535829678736llu,
-    14320171767955027621llu,
-    1705144956923856113llu,
-    1833347130189032787llu,
-    9400322860645968606llu,
-    16598016380617033567llu,
-    12773246362538168504llu,
-    2346890632840894497llu,
-    13284161663367897779llu,
-    11156056256940801702llu,
-    6566438270435079793llu,
-    14184426567501892882llu,
-    1693157918753510477llu,
-    18378075785519122098llu,
-    7204465313303453675llu,
-    11941213939911013851llu,
-    15352752417848660924llu,
-    4139201040660667366llu,
-    5909127669011412127llu,
-    1766864564625658187llu,
-    16892202770840929564llu,
-    12228148462877517818llu,
-    5407581766005195250llu,
-    10393550889445925046llu,
-    15256151015114260953llu,
-    2353447696693151925llu,
-    9710412925974416421llu,
-    12743525087182496020llu,
-    15105473404528537499llu,
-    10889357871637817063llu,
-    1474346148541527469llu,
-    1917876497304447223llu,
-    14609042902951154655llu,
-    2134607030903574787llu,
-    15770058668595058971llu,
-    491218943873080365llu,
-    4900270299576406967llu,
-    1292099914962507676llu,
-    14875850326639549802llu,
-    11622712433991736902llu,
-    8168170408415742480llu,
-    12651352620691196346llu,
-    11670412535230076013llu,
-    5689074268401770601llu,
-    12395942360559016504llu,
-    13698981439924777122llu,
-    3022290795689847035llu,
-    6652749801995951047llu,
-    17180084454509305085llu,
-    7387193433063974682llu,
-    11628907454178133268llu,
-    9532358457880247002llu,
-    12388837363011885658llu,
-    13314773417382220648llu,
-    9255963573622641440llu,
-    9644072662424383990llu,
-    7328950323976250927llu,
-    14604503762832768879llu,
-    3460848478746553427llu,
-    11756520680566867444llu,
-    10228646956711648526llu,
-    1498319470492480755llu,
-    13912900895468874853llu,
-    7977243703868154757llu,
-    8730092574978919811llu,
-    4015964408900624350llu,
-    7171236051813229128llu,
-    18276241805241254269llu,
-    2140743450950054296llu,
-    11233125218774969325llu,
-    8895381570282353483llu,
-    12737923117724585870llu,
-    8347198033509902173llu,
-    13101468282174137783llu,
-    5331670031567708380llu,
-    9941446125369432390llu,
-    6811306828184863563llu,
-    16907006339194758401llu,
-    8655596796607110507llu,
-    6483948371237476292llu,
-    4167424907297969719llu,
-    7920519602557499627llu,
-    14531642921202149660llu,
-    13258987673360713llu,
-    6467609713031142714llu,
-    5010049225410484655llu,
-    15514283798534139378llu,
-    2059836957055789216llu,
-    14708287984452760943llu,
-    7535258690393535422llu,
-    16388904321402024647llu,
-    6203261491251237737llu,
-    975838946655649106llu,
-    4998134504284488305llu,
-    16837050324560415195llu,
-    11666423454290084314llu,
-    7516705248621185019llu,
-    15508954692014489101llu,
-    1862610367258030004llu,
-    9838818531799331815llu,
-    16204719013375924404llu,
-    2999112553610745537llu,
-    16789972537408997378llu,
-    8396049629559291046llu,
-    3143880835529166843llu,
-    10402797171161811909llu,
-    7904118188430433842llu,
-    5967276514064706584llu,
-    1898989867942402000llu,
-    3584701738153559995llu,
-    14354476367859229218llu,
-    16218552616112798093llu,
-    8193391465707397554llu,
-    14966801352791404391llu,
-    15217520260583216837llu,
-    3195377995422721604llu,
-    2925353982122579135llu,
-    16559652876595655381llu,
-    3888455958671764989llu,
-    17558526478372576919llu,
-    7858177113633778887llu,
-    11386798032920516188llu,
-    15630723010864551520llu,
-    2382795051889734418llu,
-    11312546213314097891llu,
-    14415980522082086403llu,
-    2985758652673726372llu,
-    12638527984265041327llu,
-    15598397787008652528llu,
-    6629363358464932203llu,
-    6010360761383048377llu,
-    17085558173212054345llu,
-    11034086578976379926llu,
-    7894618991144381370llu,
-    8692562567562402969llu,
-    7790874974804249978llu,
-    11664943172575271568llu,
-    1579272764917527478llu,
-    15516260931218054255llu,
-    7839395787036447128llu,
-    15249406189344775469llu,
-    6791182396147619394llu,
-    17166851829350597035llu,
-    4346208168030650664llu,
-    11671380077830021326llu,
-    16764016049878832982llu,
-    4253245639498694995llu,
-    15981415790128254689llu,
-    14831301216167549422llu,
-    7570532686478098418llu,
-    10433655379636705433llu,
-    11586733253399237367llu,
-    17043373472347412192llu,
-    13357506643414941308llu,
-    5258160458685301505llu,
-    3346984812667980496llu,
-};
+// The key hash emitted as hash(), which case labels are compared against.
+#define JIPG_KEY_HASH_SEED 0x9E3779B97F4A7C15llu
+#define JIPG_KEY_HASH_MUL 0xBF58476D1CE4E5B9llu
+static inline uint64_t jipg_key_hash(const char *key);
+
+static const char *jipg_value_struct_name(const Jipg_Value *value);
+static const char *jipg_value_name(const Jipg_Value *value);
+
+static uint64_t jipg_shape_mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15llu + (h << 6) + (h >> 2);
+    return h;
+}
+
+// Children must already be canonical, so they are compared by type name only.
+static bool jipg_value_same_shape(const Jipg_Value *a, const Jipg_Value *b) {
+    if (a->kind != b->kind) return false;
+    switch (a->kind) {
+        case JIPG_KIND_OBJECT: {
+            const Jipg_Value *x = a->as_object.kv_head;
+            const Jipg_Value *y = b->as_object.kv_head;
+            for (; x && y; x = x->as_object_kv.next, y = y->as_object_kv.next) {
+                const Jipg_Value *xv = x->as_object_kv.value;
+                const Jipg_Value *yv = y->as_object_kv.value;
+                if (strcmp(x->as_object_kv.key, y->as_object_kv.key) != 0) return false;
+                if (strcmp(jipg_value_name(xv), jipg_value_name(yv)) != 0) return false;
+                if (xv->optional != yv->optional || xv->nullable != yv->nullable) return false;
+            }
+            return !x && !y;
+        }
+        case JIPG_KIND_ARRAY:
+            return a->as_array.cap == b->as_array.cap &&
+                   strcmp(jipg_value_name(a->as_array.internal), jipg_value_name(b->as_array.internal)) == 0;
+        case JIPG_KIND_UNION: {
+            if (strcmp(a->as_union.discriminator, b->as_union.discriminator) != 0) return false;
+            const Jipg_Value *x = a->as_union.case_head;
+            const Jipg_Value *y = b->as_union.case_head;
+            for (; x && y; x = x->as_union_case.next, y = y->as_union_case.next) {
+                if (strcmp(x->as_union_case.tag, y->as_union_case.tag) != 0) return false;
+                if (strcmp(jipg_value_name(x->as_union_case.value), jipg_value_name(y->as_union_case.value)) != 0)
+                    return false;
+            }
+            return !x && !y;
+        }
+        case JIPG_KIND_MAP:
+            return strcmp(jipg_value_name(a->as_map.internal), jipg_value_name(b->as_map.internal)) == 0;
+        case JIPG_KIND_ENUM: {
+            if (a->as_enum.count != b->as_enum.count) return false;
+            for (size_t i = 0; i < a->as_enum.count; ++i)
+                if (strcmp(a->as_enum.names[i], b->as_enum.names[i]) != 0) return false;
+            return true;
+        }
+        case JIPG_KIND_REF:
+            return strcmp(a->as_ref.head, b->as_ref.head) == 0;
+        default:
+            return true;
+    }
+}
+
+// Returns the canonical value with the same shape, inserting value if it is the first.
+static Jipg_Value *jipg_intern_shape(Jipg_Value *value) {
+    Jipg_Context *ctx = &jipg_global_context;
+    if (2 * (ctx->shape_count + 1) > ctx->shape_cap) {
+        size_t old_cap = ctx->shape_cap;
+        Jipg_Value **old = ctx->shapes;
+        ctx->shape_cap = old_cap ? old_cap * 2 : 64;
+        ctx->shapes = JIPG_REALLOC(NULL, ctx->shape_cap * sizeof(*ctx->shapes));
+        JIPG_ASSERT(ctx->shapes);
+        memset(ctx->shapes, 0, ctx->shape_cap * sizeof(*ctx->shapes));
+        for (size_t i = 0; i < old_cap; ++i) {
+            if (!old[i]) continue;
+            size_t j = old[i]->shape_hash & (ctx->shape_cap - 1);
+            while (ctx->shapes[j]) j = (j + 1) & (ctx->shape_cap - 1);
+            ctx->shapes[j] = old[i];
+        }
+        JIPG_FREE(old);
+    }
 
-static inline uint64_t sbox_hash(const char *key);
+    size_t j = value->shape_hash & (ctx->shape_cap - 1);
+    for (; ctx->shapes[j]; j = (j + 1) & (ctx->shape_cap - 1)) {
+        if (ctx->shapes[j]->shape_hash == value->shape_hash && jipg_value_same_shape(ctx->shapes[j], value))
+            return ctx->shapes[j];
+    }
+    ctx->shapes[j] = value;
+    ++ctx->shape_count;
+    return value;
+}
 
+// Names are assigned bottom-up so structurally identical subtrees, including
+// ones under different heads, share a single type and parser.
 static void jipg_generate_struct_names(Jipg_Value *value, const char *head_struct_name) {
     const char *fmt = NULL;
     char **name = NULL;
-    size_t struct_num;
+    uint64_t h = jipg_shape_mix(0, value->kind);
 
     switch (value->kind) {
         case JIPG_KIND_OBJECT: {
-            struct_num = jipg_global_context.name_alloc++;
             fmt = "%s_object%zu";
             name = &value->as_object.struct_name;
 
             Jipg_Value *kv = value->as_object.kv_head;
-            for (; kv; kv = kv->as_object_kv.next)
-                jipg_generate_struct_names(kv->as_object_kv.value, head_struct_name);
+            for (; kv; kv = kv->as_object_kv.next) {
+                Jipg_Value *child = kv->as_object_kv.value;
+                jipg_generate_struct_names(child, head_struct_name);
+                h = jipg_shape_mix(h, jipg_key_hash(kv->as_object_kv.key));
+                h = jipg_shape_mix(h, child->shape_hash);
+                h = jipg_shape_mix(h, child->optional | child->nullable << 1);
+            }
         } break;
         case JIPG_KIND_ARRAY: {
-            struct_num = jipg_global_context.name_alloc++;
             fmt = "%s_array%zu";
             name = &value->as_array.struct_name;
 
-            jipg_generate_struct_names(value->as_array.internal, head_struct_name);
+            Jipg_Value *internal = value->as_array.internal;
+            jipg_generate_struct_names(internal, head_struct_name);
+            h = jipg_shape_mix(h, value->as_array.cap);
+            h = jipg_shape_mix(h, internal->shape_hash);
+        } break;
+        case JIPG_KIND_UNION: {
+            fmt = "%s_union%zu";
+            name = &value->as_union.struct_name;
+
+            h = jipg_shape_mix(h, jipg_key_hash(value->as_union.discriminator));
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next) {
+                Jipg_Value *child = c->as_union_case.value;
+                jipg_generate_struct_names(child, head_struct_name);
+                h = jipg_shape_mix(h, jipg_key_hash(c->as_union_case.tag));
+                h = jipg_shape_mix(h, child->shape_hash);
+            }
+        } break;
+        case JIPG_KIND_MAP: {
+            fmt = "%s_map%zu";
+            name = &value->as_map.struct_name;
+
+            Jipg_Value *internal = value->as_map.internal;
+            jipg_generate_struct_names(internal, head_struct_name);
+            h = jipg_shape_mix(h, internal->shape_hash);
+        } break;
+        case JIPG_KIND_ENUM: {
+            fmt = "%s_enum%zu";
+            name = &value->as_enum.struct_name;
+
+            for (size_t i = 0; i < value->as_enum.count; ++i) {
+                uint64_t name_hash = jipg_key_hash(value->as_enum.names[i]);
+                // Dispatch switches on the full key hash, which must be perfect.
+                for (size_t j = 0; j < i; ++j)
+                    JIPG_ASSERT(name_hash != jipg_key_hash(value->as_enum.names[j]));
+                h = jipg_shape_mix(h, name_hash);
+            }
+        } break;
+        case JIPG_KIND_REF: {
+            h = jipg_shape_mix(h, jipg_key_hash(value->as_ref.head));
         } break;
         default: {
         }
     }
+    value->shape_hash = h;
 
     if (name) {
         JIPG_ASSERT(fmt);
+        Jipg_Value *canonical = jipg_intern_shape(value);
+        if (canonical != value) {
+            value->shared = true;
+            value->canonical = canonical;
+            *name = (char *)jipg_value_struct_name(canonical);
+            return;
+        }
+
+        size_t struct_num = jipg_global_context.name_alloc++;
         int n = snprintf(NULL, 0, fmt, head_struct_name, struct_num);
         *name = JIPG_REALLOC(NULL, n + 1);
         JIPG_ASSERT(*name);
@@ -508,12 +707,409 @@ static void jipg_generate_struct_names(Jipg_Value *value, const char *head_struc
     }
 }
 
+// Points every JIPG_REF at the value of the head it names. References are
+// parsed in a frame of the target, so the target has to be a struct kind.
+static void jipg_resolve_refs(Jipg_Value *value, Jipg_Value **values, size_t value_count) {
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                jipg_resolve_refs(kv->as_object_kv.value, values, value_count);
+        } break;
+        case JIPG_KIND_ARRAY: {
+            jipg_resolve_refs(value->as_array.internal, values, value_count);
+        } break;
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_resolve_refs(c->as_union_case.value, values, value_count);
+        } break;
+        case JIPG_KIND_MAP: {
+            jipg_resolve_refs(value->as_map.internal, values, value_count);
+        } break;
+        case JIPG_KIND_REF: {
+            for (size_t i = 0; i < value_count && !value->as_ref.target; ++i)
+                if (strcmp(values[i]->head, value->as_ref.head) == 0) value->as_ref.target = values[i];
+            Jipg_Value *target = value->as_ref.target;
+            JIPG_ASSERT(target && "JIPG_REF names an unknown head");
+            JIPG_ASSERT((target->kind == JIPG_KIND_OBJECT || target->kind == JIPG_KIND_ARRAY ||
+                         target->kind == JIPG_KIND_UNION || target->kind == JIPG_KIND_MAP) &&
+                        "JIPG_REF target must be an object, array, union or map");
+        } break;
+        default: {
+        }
+    }
+}
+
+// Numbers the counters of every emitted (non-shared) parser, in emission order.
+static void jipg_assign_stats_indices(Jipg_Value *value) {
+    Jipg_Context *ctx = &jipg_global_context;
+    if (value->shared) return;
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next) {
+                jipg_assign_stats_indices(kv->as_object_kv.value);
+                kv->stats_index = ctx->stats_field_count++;
+            }
+        } break;
+        case JIPG_KIND_ARRAY: {
+            jipg_assign_stats_indices(value->as_array.internal);
+        } break;
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_assign_stats_indices(c->as_union_case.value);
+        } break;
+        case JIPG_KIND_MAP: {
+            jipg_assign_stats_indices(value->as_map.internal);
+        } break;
+        default:
+            return;
+    }
+    value->stats_index = ctx->stats_struct_count++;
+}
+
+// --profile walks sample documents along the schema and counts, on the
+// canonical value of each type, how its members follow each other and how
+// long its arrays and strings get. The counts only steer code layout: the
+// order of dispatch, which key is tried first after each member, the initial
+// capacity of arrays and hot or cold marks, so the output parses the same.
+struct Jipg_Profile {
+    // Times the value was parsed.
+    size_t count;
+    // Objects with n members: present[i] counts member i, follows[a * n + b]
+    // how often member b came right after member a, where a == n is '{'.
+    size_t members;
+    size_t *present;
+    size_t *follows;
+    // Arrays: item counts, strings: byte lengths. Bucket b counts lengths at
+    // most 2^b and above 2^(b - 1).
+    size_t lengths[65];
+};
+
+static size_t jipg_object_member_count(const Jipg_Value *object) {
+    size_t n = 0;
+    const Jipg_Value *kv = object->as_object.kv_head;
+    for (; kv; kv = kv->as_object_kv.next) ++n;
+    return n;
+}
+
+static Jipg_Profile *jipg_value_profile(Jipg_Value *value) {
+    if (value->shared) value = value->canonical;
+    if (value->profile) return value->profile;
+
+    Jipg_Profile *profile = JIPG_REALLOC(NULL, sizeof(*profile));
+    JIPG_ASSERT(profile);
+    memset(profile, 0, sizeof(*profile));
+    if (value->kind == JIPG_KIND_OBJECT) {
+        size_t n = jipg_object_member_count(value);
+        profile->members = n;
+        profile->present = JIPG_REALLOC(NULL, (n ? n : 1) * sizeof(size_t));
+        profile->follows = JIPG_REALLOC(NULL, (n + 1) * (n ? n : 1) * sizeof(size_t));
+        JIPG_ASSERT(profile->present && profile->follows);
+        memset(profile->present, 0, (n ? n : 1) * sizeof(size_t));
+        memset(profile->follows, 0, (n + 1) * (n ? n : 1) * sizeof(size_t));
+    }
+    value->profile = profile;
+    return profile;
+}
+
+static const Jipg_Profile *jipg_value_profile_if_any(const Jipg_Value *value) {
+    if (value->shared) value = value->canonical;
+    return value->profile;
+}
+
+static void jipg_profile_length(Jipg_Profile *profile, size_t len) {
+    size_t b = 0;
+    while (b < 64 && ((size_t)1 << b) < len) ++b;
+    ++profile->lengths[b];
+}
+
+// Smallest power of two that holds at least pct percent of the lengths.
+static size_t jipg_profile_length_at(const Jipg_Profile *profile, size_t pct) {
+    size_t total = 0, sum = 0;
+    for (size_t b = 0; b < 65; ++b) total += profile->lengths[b];
+    for (size_t b = 0; b < 64; ++b) {
+        sum += profile->lengths[b];
+        if (sum * 100 >= total * pct) return (size_t)1 << b;
+    }
+    return (size_t)1 << 63;
+}
+
+typedef struct {
+    const char *p;
+    const char *end;
+    // Counts are only taken once the document is known to match.
+    bool record;
+    size_t depth;
+} Jipg_Sample;
+
+static void jipg_sample_ws(Jipg_Sample *s) {
+    while (s->p < s->end && (*s->p == ' ' || *s->p == '\n' || *s->p == '\r' || *s->p == '\t')) ++s->p;
+}
+
+static bool jipg_sample_char(Jipg_Sample *s, char c) {
+    jipg_sample_ws(s);
+    if (s->p == s->end || *s->p != c) return false;
+    ++s->p;
+    return true;
+}
+
+static bool jipg_sample_word(Jipg_Sample *s, const char *word) {
+    jipg_sample_ws(s);
+    size_t n = strlen(word);
+    if ((size_t)(s->end - s->p) < n || memcmp(s->p, word, n) != 0) return false;
+    s->p += n;
+    return true;
+}
+
+// The raw bytes between the quotes, escapes left in place.
+static bool jipg_sample_string(Jipg_Sample *s, const char **str, size_t *len) {
+    if (!jipg_sample_char(s, '"')) return false;
+    const char *start = s->p;
+    while (s->p < s->end && *s->p != '"') s->p += *s->p == '\\' ? 2 : 1;
+    if (s->p >= s->end) return false;
+    *str = start;
+    *len = s->p++ - start;
+    return true;
+}
+
+static bool jipg_sample_number(Jipg_Sample *s, bool integer) {
+    jipg_sample_ws(s);
+    const char *start = s->p;
+    bool fraction = false;
+    for (; s->p < s->end && strchr("+-0123456789.eE", *s->p); ++s->p) fraction |= strchr(".eE", *s->p) != NULL;
+    return s->p > start && !(integer && fraction);
+}
+
+static bool jipg_sample_skip(Jipg_Sample *s) {
+    jipg_sample_ws(s);
+    if (s->p == s->end || ++s->depth > 4096) return false;
+    bool ok = true;
+    const char *str;
+    size_t len;
+    if (*s->p == '{' || *s->p == '[') {
+        char close = *s->p++ == '{' ? '}' : ']';
+        if (!jipg_sample_char(s, close)) {
+            do {
+                if (close == '}' && !(jipg_sample_string(s, &str, &len) && jipg_sample_char(s, ':'))) ok = false;
+                if (ok && !jipg_sample_skip(s)) ok = false;
+            } while (ok && jipg_sample_char(s, ','));
+            ok = ok && jipg_sample_char(s, close);
+        }
+    } else if (*s->p == '"') {
+        ok = jipg_sample_string(s, &str, &len);
+    } else if (!jipg_sample_word(s, "true") && !jipg_sample_word(s, "false") && !jipg_sample_word(s, "null")) {
+        ok = jipg_sample_number(s, false);
+    }
+    --s->depth;
+    return ok;
+}
+
+static bool jipg_sample_value(Jipg_Sample *s, Jipg_Value *value);
+
+static bool jipg_sample_object(Jipg_Sample *s, Jipg_Value *object) {
+    if (!jipg_sample_char(s, '{')) return false;
+    Jipg_Profile *profile = s->record ? jipg_value_profile(object) : NULL;
+    size_t n = jipg_object_member_count(object), prev = n;
+    uint64_t seen = 0;
+
+    if (!jipg_sample_char(s, '}')) {
+        do {
+            const char *key;
+            size_t key_len;
+            if (!jipg_sample_string(s, &key, &key_len) || !jipg_sample_char(s, ':')) return false;
+
+            size_t i = 0;
+            Jipg_Value *kv = object->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next, ++i)
+                if (strlen(kv->as_object_kv.key) == key_len && memcmp(kv->as_object_kv.key, key, key_len) == 0) break;
+            if (!kv) {
+                if (!jipg_sample_skip(s)) return false;
+                continue;
+            }
+
+            Jipg_Value *value = kv->as_object_kv.value;
+            if (!(value->nullable && jipg_sample_word(s, "null")) && !jipg_sample_value(s, value)) return false;
+            if (i < 64) seen |= (uint64_t)1 << i;
+            if (profile) {
+                ++profile->present[i];
+                ++profile->follows[prev * n + i];
+                prev = i;
+            }
+        } while (jipg_sample_char(s, ','));
+        if (!jipg_sample_char(s, '}')) return false;
+    }
+
+    size_t i = 0;
+    Jipg_Value *kv = object->as_object.kv_head;
+    for (; kv; kv = kv->as_object_kv.next, ++i)
+        if (i < 64 && !kv->as_object_kv.value->optional && !(seen & (uint64_t)1 << i)) return false;
+    if (profile) ++profile->count;
+    return true;
+}
+
+// The discriminator may come anywhere, so the object is scanned for it first.
+static bool jipg_sample_union(Jipg_Sample *s, Jipg_Value *u) {
+    Jipg_Sample scan = *s;
+    scan.record = false;
+    if (!jipg_sample_char(&scan, '{')) return false;
+    const char *tag = NULL;
+    size_t tag_len = 0;
+    do {
+        const char *key;
+        size_t key_len;
+        if (!jipg_sample_string(&scan, &key, &key_len) || !jipg_sample_char(&scan, ':')) return false;
+        if (strlen(u->as_union.discriminator) == key_len && memcmp(u->as_union.discriminator, key, key_len) == 0) {
+            if (!jipg_sample_string(&scan, &tag, &tag_len)) return false;
+            break;
+        }
+        if (!jipg_sample_skip(&scan)) return false;
+    } while (jipg_sample_char(&scan, ','));
+
+    Jipg_Value *c = u->as_union.case_head;
+    for (; tag && c; c = c->as_union_case.next) {
+        if (strlen(c->as_union_case.tag) != tag_len || memcmp(c->as_union_case.tag, tag, tag_len) != 0) continue;
+        if (!jipg_sample_object(s, c->as_union_case.value)) return false;
+        if (s->record) ++jipg_value_profile(u)->count;
+        return true;
+    }
+    return false;
+}
+
+static bool jipg_sample_value(Jipg_Sample *s, Jipg_Value *value) {
+    if (++s->depth > 4096) return false;
+    bool ok = true;
+    const char *str;
+    size_t len;
+
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT_KV:
+        case JIPG_KIND_UNION_CASE:
+        case JIPG_KIND_VALUE_COUNT:
+            UNREACHABLE();
+
+        case JIPG_KIND_OBJECT: {
+            ok = jipg_sample_object(s, value);
+        } break;
+        case JIPG_KIND_ARRAY: {
+            size_t items = 0;
+            ok = jipg_sample_char(s, '[');
+            if (ok && !jipg_sample_char(s, ']')) {
+                do {
+                    ok = jipg_sample_value(s, value->as_array.internal);
+                    ++items;
+                } while (ok && jipg_sample_char(s, ','));
+                ok = ok && jipg_sample_char(s, ']');
+            }
+            ok = ok && (!value->as_array.cap || items <= value->as_array.cap);
+            if (ok && s->record) {
+                Jipg_Profile *profile = jipg_value_profile(value);
+                ++profile->count;
+                jipg_profile_length(profile, items);
+            }
+        } break;
+        case JIPG_KIND_UNION: {
+            ok = jipg_sample_union(s, value);
+        } break;
+        case JIPG_KIND_MAP: {
+            ok = jipg_sample_char(s, '{');
+            if (ok && !jipg_sample_char(s, '}')) {
+                do {
+                    ok = jipg_sample_string(s, &str, &len) && jipg_sample_char(s, ':') &&
+                         jipg_sample_value(s, value->as_map.internal);
+                } while (ok && jipg_sample_char(s, ','));
+                ok = ok && jipg_sample_char(s, '}');
+            }
+        } break;
+        case JIPG_KIND_ENUM: {
+            ok = jipg_sample_string(s, &str, &len);
+            size_t i = 0;
+            for (; ok && i < value->as_enum.count; ++i)
+                if (strlen(value->as_enum.names[i]) == len && memcmp(value->as_enum.names[i], str, len) == 0) break;
+            ok = ok && i < value->as_enum.count;
+        } break;
+        case JIPG_KIND_REF: {
+            ok = jipg_sample_value(s, value->as_ref.target);
+        } break;
+        case JIPG_KIND_STRING:
+        case JIPG_KIND_STRING_INTERNED: {
+            ok = jipg_sample_string(s, &str, &len);
+            if (ok && s->record) {
+                Jipg_Profile *profile = jipg_value_profile(value);
+                ++profile->count;
+                jipg_profile_length(profile, len);
+            }
+        } break;
+        case JIPG_KIND_INT: {
+            ok = jipg_sample_number(s, true);
+        } break;
+        case JIPG_KIND_FLOAT:
+        case JIPG_KIND_NUMBER_RAW: {
+            ok = jipg_sample_number(s, false);
+        } break;
+        case JIPG_KIND_BOOL: {
+            ok = jipg_sample_word(s, "true") || jipg_sample_word(s, "false");
+        } break;
+    }
+    --s->depth;
+    return ok;
+}
+
+// Each sample counts for the first head it matches as a whole.
+static bool jipg_profile_sample(const char *path, Jipg_Value **values, size_t value_count) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return false;
+    }
+    size_t len = 0, cap = 1 << 16;
+    char *json = JIPG_REALLOC(NULL, cap);
+    JIPG_ASSERT(json);
+    for (size_t n; (n = fread(json + len, 1, cap - len, file)) > 0;) {
+        len += n;
+        if (len == cap) {
+            json = JIPG_REALLOC(json, cap *= 2);
+            JIPG_ASSERT(json);
+        }
+    }
+    fclose(file);
+
+    bool matched = false;
+    for (size_t i = 0; i < value_count && !matched; ++i) {
+        Jipg_Sample s = {.p = json, .end = json + len};
+        if (!jipg_sample_value(&s, values[i])) continue;
+        jipg_sample_ws(&s);
+        if (s.p != s.end) continue;
+        s = (Jipg_Sample){.p = json, .end = json + len, .record = true};
+        matched = jipg_sample_value(&s, values[i]);
+    }
+    if (!matched) fprintf(stderr, "%s: sample matches none of the parsers, ignored\n", path);
+    JIPG_FREE(json);
+    return true;
+}
+
+// Initial capacity of a growable array: what 90% of the sampled ones fit in.
+static size_t jipg_array_init_cap(const Jipg_Value *array) {
+    const Jipg_Profile *profile = jipg_value_profile_if_any(array);
+    if (!profile || !profile->count) return JIPG_INIT_LIST_CAP;
+    size_t cap = jipg_profile_length_at(profile, 90);
+    return cap > JIPG_PROFILE_MAX_INIT_CAP ? JIPG_PROFILE_MAX_INIT_CAP : cap;
+}
+
 static const char *jipg_value_struct_name(const Jipg_Value *value) {
     switch (value->kind) {
         case JIPG_KIND_OBJECT:
             return value->as_object.struct_name;
         case JIPG_KIND_ARRAY:
             return value->as_array.struct_name;
+        case JIPG_KIND_UNION:
+            return value->as_union.struct_name;
+        case JIPG_KIND_MAP:
+            return value->as_map.struct_name;
+        case JIPG_KIND_ENUM:
+            return value->as_enum.struct_name;
         default:
             return NULL;
     }
@@ -531,10 +1127,20 @@ static const char *jipg_value_name(const Jipg_Value *value) {
             return "float";
         case JIPG_KIND_BOOL:
             return "bool";
+        case JIPG_KIND_STRING_INTERNED:
+            return "interned";
+        case JIPG_KIND_NUMBER_RAW:
+            return "number";
+        case JIPG_KIND_REF:
+            return value->as_ref.head;
 
         case JIPG_KIND_OBJECT:
         case JIPG_KIND_OBJECT_KV:
         case JIPG_KIND_ARRAY:
+        case JIPG_KIND_UNION:
+        case JIPG_KIND_UNION_CASE:
+        case JIPG_KIND_MAP:
+        case JIPG_KIND_ENUM:
         case JIPG_KIND_VALUE_COUNT:
             UNREACHABLE();
     };
@@ -543,6 +1149,7 @@ static const char *jipg_value_name(const Jipg_Value *value) {
 static void jipg_emit_field_type(FILE *header, Jipg_Value *value) {
     switch (value->kind) {
         case JIPG_KIND_OBJECT_KV:
+        case JIPG_KIND_UNION_CASE:
         case JIPG_KIND_VALUE_COUNT:
             UNREACHABLE();
 
@@ -554,6 +1161,24 @@ static void jipg_emit_field_type(FILE *header, Jipg_Value *value) {
             JIPG_ASSERT(value->as_array.struct_name);
             fprintf(header, "%s ", value->as_array.struct_name);
         } break;
+        case JIPG_KIND_UNION: {
+            JIPG_ASSERT(value->as_union.struct_name);
+            fprintf(header, "%s ", value->as_union.struct_name);
+        } break;
+        case JIPG_KIND_MAP: {
+            JIPG_ASSERT(value->as_map.struct_name);
+            fprintf(header, "%s ", value->as_map.struct_name);
+        } break;
+        case JIPG_KIND_ENUM: {
+            JIPG_ASSERT(value->as_enum.struct_name);
+            fprintf(header, "%s ", value->as_enum.struct_name);
+        } break;
+        case JIPG_KIND_STRING_INTERNED: {
+            fprintf(header, "const char *");
+        } break;
+        case JIPG_KIND_REF: {
+            fprintf(header, "%s *", value->as_ref.head);
+        } break;
         case JIPG_KIND_STRING: {
             fprintf(header, "char *");
         } break;
@@ -566,28 +1191,134 @@ static void jipg_emit_field_type(FILE *header, Jipg_Value *value) {
         case JIPG_KIND_BOOL: {
             fprintf(header, "bool ");
         } break;
+        case JIPG_KIND_NUMBER_RAW: {
+            fprintf(header, "Jipg_Number ");
+        } break;
     }
 }
 
-static void jipg_emit_value_types(FILE *header, Jipg_Value *value) {
-    const char *name;
+// Referenced nodes are stored in array items themselves.
+static void jipg_emit_item_type(FILE *header, Jipg_Value *internal) {
+    if (internal->kind == JIPG_KIND_REF)
+        fprintf(header, "%s ", internal->as_ref.head);
+    else
+        jipg_emit_field_type(header, internal);
+}
+
+// Formats a label or expression of the emitted code into a fixed buffer of
+// the emitters. Names too long for it are refused rather than cut short into
+// code that does not compile or, worse, jumps to another label.
+#define JIPG_FORMAT(buf, ...) jipg_format((buf), sizeof(buf), __VA_ARGS__)
+__attribute__((format(printf, 3, 4))) static void jipg_format(char *buf, size_t size, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    JIPG_ASSERT(n >= 0 && (size_t)n < size);
+    (void)n;
+}
+
+static void jipg_emit_identifier(FILE *out, const char *name) {
+    char *id = jipg_identifier(name);
+    fputs(id, out);
+    JIPG_FREE(id);
+}
+
+static size_t jipg_object_presence_bits(const Jipg_Value *object) {
+    size_t bits = 0;
+    const Jipg_Value *kv = object->as_object.kv_head;
+    for (; kv; kv = kv->as_object_kv.next) {
+        const Jipg_Value *v = kv->as_object_kv.value;
+        bits += v->optional || v->nullable;
+    }
+    JIPG_ASSERT(bits <= 64 && "at most 64 optional or nullable members per object");
+    return bits;
+}
+
+static const char *jipg_presence_type(size_t bits) {
+    if (bits <= 8) return "uint8_t";
+    if (bits <= 16) return "uint16_t";
+    if (bits <= 32) return "uint32_t";
+    return "uint64_t";
+}
+
+static bool jipg_value_uses_kind(const Jipg_Value *value, Jipg_Value_Kind kind) {
+    if (value->kind == kind) return true;
     switch (value->kind) {
         case JIPG_KIND_OBJECT: {
-            Jipg_Value *kv = value->as_object.kv_head;
+            const Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                if (jipg_value_uses_kind(kv->as_object_kv.value, kind)) return true;
+            return false;
+        }
+        case JIPG_KIND_ARRAY:
+            return jipg_value_uses_kind(value->as_array.internal, kind);
+        case JIPG_KIND_UNION: {
+            const Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                if (jipg_value_uses_kind(c->as_union_case.value, kind)) return true;
+            return false;
+        }
+        case JIPG_KIND_MAP:
+            return jipg_value_uses_kind(value->as_map.internal, kind);
+        default:
+            return false;
+    }
+}
+
+static void jipg_emit_value_types(FILE *header, Jipg_Value *value) {
+    const char *name = jipg_value_struct_name(value);
+    switch (value->shared ? JIPG_KIND_VALUE_COUNT : value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
             for (; kv; kv = kv->as_object_kv.next)
                 jipg_emit_value_types(header, kv->as_object_kv.value);
 
             const char *struct_name = value->as_object.struct_name;
 
-            fprintf(header, "typedef struct {\n");
+            size_t presence_bits = jipg_object_presence_bits(value);
+            if (presence_bits) {
+                size_t bit = 0;
+                kv = value->as_object.kv_head;
+                for (; kv; kv = kv->as_object_kv.next) {
+                    const Jipg_Value *v = kv->as_object_kv.value;
+                    if (!v->optional && !v->nullable) continue;
+                    fprintf(header, "#define %s_HAS_%s ((%s)1 << %zu)\n", struct_name, kv->as_object_kv.key,
+                            jipg_presence_type(presence_bits), bit++);
+                }
+                fprintf(header, "\n");
+            }
+
+            fprintf(header, "typedef struct %s {\n", struct_name);
             kv = value->as_object.kv_head;
             for (; kv; kv = kv->as_object_kv.next) {
                 fprintf(header, "    ");
                 jipg_emit_field_type(header, kv->as_object_kv.value);
                 fprintf(header, "%s;\n", kv->as_object_kv.key);
             }
+            // Set for optional and nullable members that were present and not null.
+            if (presence_bits) fprintf(header, "    %s _present;\n", jipg_presence_type(presence_bits));
             fprintf(header, "} %s;\n", struct_name);
-            name = struct_name;
+
+            // Raw numbers of items and map values go through jipg_number_as_
+            // directly. Accessors of a head are named after it.
+            const char *prefix = value->head ? value->head : struct_name;
+            bool accessors = false;
+            kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next) {
+                if (kv->as_object_kv.value->kind != JIPG_KIND_NUMBER_RAW) continue;
+                if (!accessors) fprintf(header, "\n");
+                accessors = true;
+                const char *key = kv->as_object_kv.key;
+                fprintf(header,
+                        "static inline bool %s_%s_as_i64(%s *v, const char *json, int64_t *res) {\n"
+                        "    return jipg_number_as_i64(&v->%s, json, res);\n"
+                        "}\n"
+                        "static inline bool %s_%s_as_f64(%s *v, const char *json, double *res) {\n"
+                        "    return jipg_number_as_f64(&v->%s, json, res);\n"
+                        "}\n",
+                        prefix, key, struct_name, key, prefix, key, struct_name, key);
+            }
 
             if (!value->head) fprintf(header, "\n");
         } break;
@@ -598,16 +1329,96 @@ static void jipg_emit_value_types(FILE *header, Jipg_Value *value) {
             const char *struct_name = value->as_array.struct_name;
 
             fprintf(header,
-                    "typedef struct {\n"
+                    "typedef struct %s {\n"
                     "    size_t len;\n"
-                    "    ");
-            jipg_emit_field_type(header, internal);
+                    "    ",
+                    struct_name);
+            jipg_emit_item_type(header, internal);
             fprintf(header,
                     "*items;\n"
                     "} %s;\n",
                     struct_name);
-            name = struct_name;
+            if (!value->head) fprintf(header, "\n");
+        } break;
+
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_emit_value_types(header, c->as_union_case.value);
+
+            const char *struct_name = value->as_union.struct_name;
+
+            fprintf(header, "typedef enum {\n");
+            c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                fprintf(header, "    %s_%s,\n", struct_name, c->as_union_case.name);
+            fprintf(header, "} %s_Tag;\n\n", struct_name);
+
+            fprintf(header,
+                    "typedef struct %s {\n"
+                    "    %s_Tag %s;\n"
+                    "    union {\n",
+                    struct_name, struct_name, value->as_union.discriminator);
+            c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next) {
+                fprintf(header, "        ");
+                jipg_emit_field_type(header, c->as_union_case.value);
+                fprintf(header, "%s;\n", c->as_union_case.name);
+            }
+            fprintf(header,
+                    "    };\n"
+                    "} %s;\n",
+                    struct_name);
+            if (!value->head) fprintf(header, "\n");
+        } break;
+
+        case JIPG_KIND_MAP: {
+            Jipg_Value *internal = value->as_map.internal;
+            jipg_emit_value_types(header, internal);
+            const char *struct_name = value->as_map.struct_name;
+
+            fprintf(header,
+                    "typedef struct {\n"
+                    "    char *key;\n"
+                    "    size_t key_len;\n"
+                    "    ");
+            jipg_emit_field_type(header, internal);
+            fprintf(header,
+                    "value;\n"
+                    "} %s_Entry;\n\n",
+                    struct_name);
+
+            // Open addressing: hashes[i] == 0 marks an empty slot, the probe loop
+            // only touches the dense hashes array until a candidate matches.
+            fprintf(header,
+                    "typedef struct %s {\n"
+                    "    size_t len;\n"
+                    "    size_t cap;\n"
+                    "    uint64_t *hashes;\n"
+                    "    %s_Entry *entries;\n"
+                    "} %s;\n\n",
+                    struct_name, struct_name, struct_name);
+
+            fprintf(header, "%s_Entry *%s_get(const %s *map, const char *key, size_t key_len);\n\n",
+                    struct_name, struct_name, struct_name);
+            fprintf(header,
+                    "static inline %s_Entry *%s_get_cstr(const %s *map, const char *key) {\n"
+                    "    return %s_get(map, key, strlen(key));\n"
+                    "}\n",
+                    struct_name, struct_name, struct_name, struct_name);
+            if (!value->head) fprintf(header, "\n");
+        } break;
+
+        case JIPG_KIND_ENUM: {
+            const char *struct_name = value->as_enum.struct_name;
 
+            fprintf(header, "typedef enum {\n");
+            for (size_t i = 0; i < value->as_enum.count; ++i) {
+                fprintf(header, "    %s_", struct_name);
+                jipg_emit_identifier(header, value->as_enum.names[i]);
+                fprintf(header, ",\n");
+            }
+            fprintf(header, "} %s;\n", struct_name);
             if (!value->head) fprintf(header, "\n");
         } break;
 
@@ -621,12 +1432,145 @@ static void jipg_emit_value_types(FILE *header, Jipg_Value *value) {
         fprintf(header, "\ntypedef %s %s;\n\n", name, value->head);
         name = value->head;
 
-        fprintf(header, "bool parse_%s(const char *json, size_t json_length, %s *res);\n\n", name, name);
+        if (jipg_value_uses_kind(value, JIPG_KIND_STRING_INTERNED)) {
+            fprintf(header,
+                    "// Returns the interned copy of str that JIPG_STRING_INTERNED fields point to,\n"
+                    "// so they can be compared by pointer.\n"
+                    "const char *%s_intern(const char *str, size_t len);\n\n",
+                    name);
+        }
+
+        fprintf(header, "bool parse_%s(const char *json, size_t json_length, %s *res);\n", name, name);
+        fprintf(header,
+                "// Like parse_%s, but on failure also describes the error in err.\n"
+                "bool parse_%s_error(const char *json, size_t json_length, %s *res, Jipg_Error *err);\n\n",
+                name, name, name);
         fprintf(header,
                 "static inline bool parse_%s_cstr(const char *json, %s *res) {\n"
                 "    return parse_%s(json, strlen(json), res);\n"
                 "}\n\n",
                 name, name, name);
+        fprintf(header,
+                "// Parses the n documents bufs[i] of lens[i] bytes into out[i], prefetching the\n"
+                "// ones ahead. Returns the index of the first one that fails, or n; the caller\n"
+                "// can resume after it.\n"
+                "size_t parse_%s_batch(const char **bufs, const size_t *lens, size_t n, %s *out);\n\n",
+                name, name);
+        fprintf(header,
+                "// Checks that json would parse as a %s, without allocating or building\n"
+                "// it. Beyond what parse_%s() checks, integers must be integer literals in\n"
+                "// the range of int64_t and floats finite%s. err may be NULL.\n"
+                "bool validate_%s(const char *json, size_t json_length);\n"
+                "bool validate_%s_error(const char *json, size_t json_length, Jipg_Error *err);\n\n",
+                name, name,
+                jipg_value_uses_kind(value, JIPG_KIND_REF)
+                    ? ", and references nest at most\n// " STR(JIPG_VALIDATE_MAX_DEPTH) " deep"
+                    : "",
+                name, name);
+
+        if (value->kind == JIPG_KIND_ARRAY) {
+            fprintf(header,
+                    "// Called by parse_%s_each() with each item, which is released when it\n"
+                    "// returns. Returning false stops the parse.\n"
+                    "typedef bool (*%s_Each_Fn)(",
+                    name, name);
+            jipg_emit_item_type(header, value->as_array.internal);
+            fprintf(header,
+                    "*item, void *ctx);\n"
+                    "// Parses the items one at a time into the same stack slot instead of building\n"
+                    "// the array, so memory use does not grow with its length. err may be NULL.\n"
+                    "bool parse_%s_each(const char *json, size_t json_length, %s_Each_Fn callback, void *ctx,\n"
+                    "    Jipg_Error *err);\n\n",
+                    name, name);
+            if (jipg_global_context.gzip) {
+                fprintf(header,
+                        "// Like parse_%s_each() for the gzip members, or zlib stream, read from fd\n"
+                        "// to its end, while another thread inflates it up to " STR(JIPG_GZIP_DEPTH) " blocks ahead.\n"
+                        "// Only items that span blocks are copied. The offset of err counts inflated\n"
+                        "// bytes. fd is not closed. Needs -pthread -lz.\n"
+                        "bool parse_%s_gzip_each(int fd, %s_Each_Fn callback, void *ctx, Jipg_Error *err);\n\n",
+                        name, name, name);
+            }
+        }
+
+        if (value->kind == JIPG_KIND_OBJECT) {
+            fprintf(header, "enum {\n");
+            const Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next) fprintf(header, "    %s_MEMBER_%s,\n", name, kv->as_object_kv.key);
+            fprintf(header,
+                    "    %s_MEMBER_COUNT\n"
+                    "};\n"
+                    "// Parses a patch into res: members it has are overwritten, nested objects\n"
+                    "// merged, arrays replaced and map entries added or replaced; the others keep\n"
+                    "// their values. Strings and arrays reuse their storage where it fits and\n"
+                    "// the values replaced are freed. Bit %s_MEMBER_<member> of changed, which\n"
+                    "// holds (%s_MEMBER_COUNT + 63) / 64 words or is NULL, is set for each\n"
+                    "// member the patch sets. On failure res may be partly updated, but still\n"
+                    "// owns everything it points to. err may be NULL.\n",
+                    name, name, name);
+            if (jipg_value_uses_kind(value, JIPG_KIND_REF))
+                fprintf(header, "// res must not hold nodes from a Jipg_Node_Pool, which are not freed one by one.\n");
+            fprintf(header,
+                    "bool merge_%s(const char *json, size_t json_length, %s *res, uint64_t *changed, Jipg_Error *err);\n\n",
+                    name, name);
+        }
+
+        if (jipg_value_uses_kind(value, JIPG_KIND_REF)) {
+            fprintf(header,
+                    "// Takes the nodes of JIPG_REF members from pool instead of allocating each\n"
+                    "// on its own; %s_pool_free() releases them all at once. err may be NULL.\n"
+                    "bool parse_%s_pool(const char *json, size_t json_length, %s *res, Jipg_Node_Pool *pool,\n"
+                    "    Jipg_Error *err);\n"
+                    "void %s_pool_free(Jipg_Node_Pool *pool);\n\n",
+                    name, name, name, name);
+        }
+
+        if (jipg_global_context.result_arena) {
+            fprintf(header,
+                    "// Parses into res, zeroing it first, with its strings, arrays, maps and\n"
+                    "// nodes taken from arena, which belongs to the calling thread. They are not\n"
+                    "// freed one by one: %s_arena_reset() drops them all but keeps the largest\n"
+                    "// block for the next parse, %s_arena_free() unmaps everything. err may be\n"
+                    "// NULL.\n"
+                    "bool parse_%s_arena(const char *json, size_t json_length, %s *res, Jipg_Arena *arena,\n"
+                    "    Jipg_Error *err);\n"
+                    "void %s_arena_reset(Jipg_Arena *arena);\n"
+                    "void %s_arena_free(Jipg_Arena *arena);\n\n",
+                    name, name, name, name, name, name);
+        }
+
+        if (jipg_global_context.snapshot) {
+            fprintf(header,
+                    "// Writes res to path as one blob with offsets in place of pointers.\n"
+                    "bool %s_snapshot_write(const %s *res, const char *path);\n"
+                    "// Maps a file written by %s_snapshot_write() by the same schema and build,\n"
+                    "// checks it and relocates it in place. Returns NULL if it cannot be used.\n"
+                    "// The result lives in the mapping until %s_snapshot_unmap(snap).\n"
+                    "const %s *%s_snapshot_map(const char *path, Jipg_Snapshot *snap);\n"
+                    "void %s_snapshot_unmap(Jipg_Snapshot *snap);\n\n",
+                    name, name, name, name, name, name, name);
+        }
+
+        if (jipg_global_context.pipeline) {
+            fprintf(header,
+                    "// Reads the n files at paths and parses file i into out[i] on workers threads,\n"
+                    "// with up to " STR(JIPG_PIPELINE_DEPTH) " reads in flight through io_uring, or with every\n"
+                    "// thread reading files itself where that is not available. Unless ok is NULL,\n"
+                    "// ok[i] tells whether file i was read and parsed. Returns how many were. Needs\n"
+                    "// -pthread.\n"
+                    "size_t parse_%s_files(const char *const *paths, size_t n, %s *out, bool *ok, unsigned workers);\n\n",
+                    name, name);
+        }
+
+        if (jipg_global_context.instrument) {
+            const char *layout = jipg_global_context.parsers[0].head_struct_name;
+            if (strcmp(name, layout) != 0) fprintf(header, "typedef %s_stats %s_stats;\n", layout, name);
+            fprintf(header,
+                    "void %s_stats_enable(bool enable);\n"
+                    "const %s_stats *%s_stats_get(void);\n"
+                    "void %s_stats_reset(void);\n\n",
+                    name, name, name, name);
+        }
     }
 }
 
@@ -645,16 +1589,224 @@ static void jipg_emit_header_macro(FILE *header, char *header_name) {
     jipg_emit_file_name_all_caps(header, header_name);
     fprintf(header, "_H");
 }
+// The C++ header has a guard of its own, so that it is never taken for the C
+// header generated from the same schema.
+static void jipg_emit_cpp_header_macro(FILE *header, char *header_name) {
+    jipg_emit_file_name_all_caps(header, header_name);
+    fprintf(header, "_HPP");
+}
 static void jipg_emit_header_impl_macro(FILE *header, char *header_name) {
     jipg_emit_file_name_all_caps(header, header_name);
     fprintf(header, "_IMPLEMENTATION");
 }
 
+// Shared by every generated header and the runtime header, hence the guard.
+static void jipg_emit_error_type(FILE *header) {
+    fprintf(header,
+            "#ifndef JIPG_ERROR_DEFINED\n"
+            "#define JIPG_ERROR_DEFINED\n"
+            "// Filled by parse_<Head>_error() on failure. Only the byte offset is kept\n"
+            "// while parsing; jipg_error_position() derives line and column from it.\n"
+            "typedef struct {\n"
+            "    size_t offset;\n"
+            "    const char *expected;\n"
+            "    const char *found;\n"
+            "    // JSON pointer to the value that failed, e.g. /friends/3.\n"
+            "    char path[256];\n"
+            "} Jipg_Error;\n"
+            "\n"
+            "static inline void jipg_error_position(const Jipg_Error *err, const char *json, size_t *line, size_t *column) {\n"
+            "    const char *line_start = json;\n"
+            "    *line = 1;\n"
+            "    for (const char *p = json; p < json + err->offset; ++p) {\n"
+            "        if (*p == '\\n') {\n"
+            "            ++*line;\n"
+            "            line_start = p + 1;\n"
+            "        }\n"
+            "    }\n"
+            "    *column = json + err->offset - line_start + 1;\n"
+            "}\n"
+            "#endif\n\n");
+}
+
+// JIPG_NUMBER_RAW values. Like Jipg_Error, shared by every generated header
+// and the runtime header.
+static void jipg_emit_number_type(FILE *header) {
+    fprintf(header,
+            "#ifndef JIPG_NUMBER_DEFINED\n"
+            "#define JIPG_NUMBER_DEFINED\n"
+            "#define JIPG_NUMBER_I64 1u\n"
+            "#define JIPG_NUMBER_F64 2u\n"
+            "\n"
+            "// Where the text of a number sits in the parsed input. The jipg_number_as_\n"
+            "// functions convert it when first asked and keep the last conversion in as.\n"
+            "typedef struct {\n"
+            "    size_t offset;\n"
+            "    uint32_t len;\n"
+            "    uint32_t cached;\n"
+            "    union {\n"
+            "        int64_t i64;\n"
+            "        double f64;\n"
+            "    } as;\n"
+            "} Jipg_Number;\n"
+            "\n"
+            "// Fails unless the text is an integer literal in the range of int64_t.\n"
+            "static inline bool jipg_number_as_i64(Jipg_Number *n, const char *json, int64_t *res) {\n"
+            "    if (n->cached == JIPG_NUMBER_I64) {\n"
+            "        *res = n->as.i64;\n"
+            "        return true;\n"
+            "    }\n"
+            "    const char *s = json + n->offset, *end = s + n->len;\n"
+            "    bool negative = s < end && *s == '-';\n"
+            "    s += negative;\n"
+            "    if (s == end || (*s == '0' && end - s > 1)) return false;\n"
+            "    uint64_t limit = (uint64_t)INT64_MAX + negative, v = 0;\n"
+            "    for (; s < end; ++s) {\n"
+            "        if (*s < '0' || *s > '9') return false;\n"
+            "        if (v > (limit - (uint64_t)(*s - '0')) / 10) return false;\n"
+            "        v = v * 10 + (uint64_t)(*s - '0');\n"
+            "    }\n"
+            "    n->as.i64 = negative && v ? -(int64_t)(v - 1) - 1 : (int64_t)v;\n"
+            "    n->cached = JIPG_NUMBER_I64;\n"
+            "    *res = n->as.i64;\n"
+            "    return true;\n"
+            "}\n"
+            "\n"
+            "static inline bool jipg_number_as_f64(Jipg_Number *n, const char *json, double *res) {\n"
+            "    if (n->cached == JIPG_NUMBER_F64) {\n"
+            "        *res = n->as.f64;\n"
+            "        return true;\n"
+            "    }\n"
+            "    const char *s = json + n->offset;\n"
+            "    char *end;\n"
+            "    double v = strtod(s, &end);\n"
+            "    if (!n->len || end != s + n->len) return false;\n"
+            "    n->as.f64 = v;\n"
+            "    n->cached = JIPG_NUMBER_F64;\n"
+            "    *res = v;\n"
+            "    return true;\n"
+            "}\n"
+            "#endif\n\n");
+}
+
+static bool jipg_value_refers_to(const Jipg_Value *value, const Jipg_Value *target) {
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            const Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                if (jipg_value_refers_to(kv->as_object_kv.value, target)) return true;
+            return false;
+        }
+        case JIPG_KIND_ARRAY:
+            return jipg_value_refers_to(value->as_array.internal, target);
+        case JIPG_KIND_UNION: {
+            const Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                if (jipg_value_refers_to(c->as_union_case.value, target)) return true;
+            return false;
+        }
+        case JIPG_KIND_MAP:
+            return jipg_value_refers_to(value->as_map.internal, target);
+        case JIPG_KIND_REF:
+            return value->as_ref.target == target;
+        default:
+            return false;
+    }
+}
+
+static bool jipg_value_is_ref_target(const Jipg_Value *value, Jipg_Value **values, size_t value_count) {
+    for (size_t i = 0; i < value_count; ++i)
+        if (jipg_value_refers_to(values[i], value)) return true;
+    return false;
+}
+
+// Shared by every generated header and the runtime header, hence the guard.
+static void jipg_emit_node_pool_type(FILE *header) {
+    fprintf(header,
+            "#ifndef JIPG_NODE_POOL_DEFINED\n"
+            "#define JIPG_NODE_POOL_DEFINED\n"
+            "// Chunks the nodes of JIPG_REF members are carved from in parse order, so\n"
+            "// a tree's nodes sit next to each other. Zero initialize before first use.\n"
+            "typedef struct Jipg_Node_Chunk Jipg_Node_Chunk;\n"
+            "typedef struct {\n"
+            "    Jipg_Node_Chunk *chunk;\n"
+            "    size_t used;\n"
+            "    size_t cap;\n"
+            "} Jipg_Node_Pool;\n"
+            "#endif\n\n");
+}
+
+static void jipg_emit_arena_type(FILE *header) {
+    fprintf(header,
+            "#ifndef JIPG_ARENA_DEFINED\n"
+            "#define JIPG_ARENA_DEFINED\n"
+            "// Huge page blocks one thread's parse results are carved from. Zero initialize\n"
+            "// before first use.\n"
+            "typedef struct Jipg_Arena_Block Jipg_Arena_Block;\n"
+            "typedef struct {\n"
+            "    Jipg_Arena_Block *block;\n"
+            "    size_t used;\n"
+            "    size_t cap;\n"
+            "    // NUMA node the blocks are kept on plus one, 0 until the first block.\n"
+            "    int node;\n"
+            "    // Bytes mapped, and how many blocks got huge pages.\n"
+            "    size_t bytes;\n"
+            "    size_t huge_blocks;\n"
+            "} Jipg_Arena;\n"
+            "#endif\n\n");
+}
+
+static void jipg_emit_snapshot_type(FILE *header) {
+    fprintf(header,
+            "#ifndef JIPG_SNAPSHOT_DEFINED\n"
+            "#define JIPG_SNAPSHOT_DEFINED\n"
+            "// A snapshot file mapped by <Head>_snapshot_map().\n"
+            "typedef struct {\n"
+            "    void *base;\n"
+            "    size_t size;\n"
+            "} Jipg_Snapshot;\n"
+            "#endif\n\n");
+}
+
+// One layout for all heads of the output, named after the first head, since
+// parsers shared between heads bump the same counter indices.
+static void jipg_emit_stats_type(FILE *header) {
+    Jipg_Context *ctx = &jipg_global_context;
+    const char *layout = ctx->parsers[0].head_struct_name;
+
+    fprintf(header,
+            "// Parser counters, collected on the calling thread while enabled when the\n"
+            "// generated source is compiled with JIPG_INSTRUMENT. Without it the hooks\n"
+            "// compile to nothing and the counters stay zero. A shared runtime must be\n"
+            "// compiled with JIPG_INSTRUMENT exactly when the sources using it are.\n"
+            "typedef struct {\n"
+            "    uint64_t tokens;\n"
+            "    uint64_t whitespace_bytes;\n"
+            "    uint64_t key_misses;\n"
+            "    uint64_t array_reallocs;\n");
+    if (ctx->stats_field_count) fprintf(header, "    uint64_t field_parses[%zu];\n", ctx->stats_field_count);
+    if (ctx->stats_struct_count) {
+        fprintf(header,
+                "    uint64_t struct_calls[%zu];\n"
+                "    // Inclusive of nested parsers; TSC cycles on x86, nanoseconds elsewhere.\n"
+                "    uint64_t struct_ticks[%zu];\n",
+                ctx->stats_struct_count, ctx->stats_struct_count);
+    }
+    fprintf(header, "} %s_stats;\n\n", layout);
+
+    if (ctx->stats_field_count)
+        fprintf(header, "extern const char *const %s_stats_field_names[%zu];\n", layout, ctx->stats_field_count);
+    if (ctx->stats_struct_count)
+        fprintf(header, "extern const char *const %s_stats_struct_names[%zu];\n", layout, ctx->stats_struct_count);
+    fprintf(header, "\n");
+}
+
 static void jipg_emit_header(FILE *header, Jipg_Value **values, size_t value_count, char *header_name) {
     static const char *header_includes[] = {
         "<stdbool.h>",
         "<stddef.h>",
         "<stdint.h>",
+        "<stdlib.h>",
         "<string.h>",
     };
 
@@ -669,6 +1821,23 @@ static void jipg_emit_header(FILE *header, Jipg_Value **values, size_t value_cou
         fprintf(header, "#include %s\n", header_includes[i]);
     fprintf(header, "\n");
 
+    jipg_emit_error_type(header);
+    jipg_emit_number_type(header);
+    jipg_emit_node_pool_type(header);
+    if (jipg_global_context.result_arena) jipg_emit_arena_type(header);
+    if (jipg_global_context.snapshot) jipg_emit_snapshot_type(header);
+    if (jipg_global_context.instrument && value_count) jipg_emit_stats_type(header);
+
+    // Referenced heads are declared up front so members can point to them
+    // before, or from within, their definition.
+    bool forward = false;
+    for (size_t i = 0; i < value_count; ++i) {
+        if (!jipg_value_is_ref_target(values[i], values, value_count)) continue;
+        fprintf(header, "typedef struct %s %s;\n", jipg_value_struct_name(values[i]), values[i]->head);
+        forward = true;
+    }
+    if (forward) fprintf(header, "\n");
+
     for (size_t i = 0; i < value_count; ++i) {
         Jipg_Value *value = values[i];
         jipg_emit_value_types(header, value);
@@ -678,7 +1847,7 @@ static void jipg_emit_header(FILE *header, Jipg_Value **values, size_t value_cou
     jipg_emit_header_macro(header, header_name);
 }
 
-static void jipg_emit_lexer_impl(FILE *source) {
+static void jipg_emit_lexer_types(FILE *source) {
     fprintf(source,
             "typedef enum {\n"
             "   TOKEN_TYPE_NONE,\n"
@@ -704,6 +1873,9 @@ static void jipg_emit_lexer_impl(FILE *source) {
             "   const char *lit;\n"
             "   uint32_t len;\n"
             "   Token_Type type;\n"
+            "   bool escaped;\n"
+            "   // Key hash of lit, set by the lexer for short strings; 0 if not yet known.\n"
+            "   uint64_t hash;\n"
             "} Token;\n");
 
     fprintf(source,
@@ -713,8 +1885,25 @@ static void jipg_emit_lexer_impl(FILE *source) {
             "   size_t pos;\n"
             "   size_t read_pos;\n"
             "   char ch;\n"
-            "} Lexer;\n");
+            // The counters are pointers rather than counts so they survive the
+            // Lexer save/restore done for lookahead. They depend on
+            // JIPG_INSTRUMENT alone, not on --instrument, so a shared runtime
+            // and the schemas using it agree on the layout as long as they are
+            // all compiled with or all without it.
+            "#ifdef JIPG_INSTRUMENT\n"
+            "   uint64_t *tokens;\n"
+            "   uint64_t *whitespace_bytes;\n"
+            "#endif\n"
+            "} Lexer;\n"
+            "#ifdef JIPG_INSTRUMENT\n"
+            "#define LEX_STAT(l, counter, n) ((l)->counter ? (void)(*(l)->counter += (n)) : (void)0)\n"
+            "#else\n"
+            "#define LEX_STAT(l, counter, n) ((void)(n))\n"
+            "#endif\n");
+}
 
+// Small lexer primitives stay static inline even when the runtime is shared.
+static void jipg_emit_lexer_inline(FILE *source) {
     fprintf(source,
             "static inline void read_char(Lexer *l) {\n"
             "   if (l->read_pos >= l->len) {\n"
@@ -789,13 +1978,240 @@ static void jipg_emit_lexer_impl(FILE *source) {
             "    return ch == ' ' || ch == '\\t' || ch == '\\n' || ch == '\\r';\n"
             "}\n"
             "static inline void skip_whitespace(Lexer *l) {\n"
+            "    size_t start = l->pos;\n"
             "    while(is_whitespace(l->ch)) {\n"
             "        read_char(l);\n"
             "    }\n"
+            "    LEX_STAT(l, whitespace_bytes, l->pos - start);\n"
+            "}\n");
+
+    // Key hash: 8 bytes per step, the tail zero padded as a little-endian
+    // word. jipg_key_hash() computes the same for case labels. Never 0.
+    fprintf(source,
+            "static inline uint64_t load_word(const char *p) {\n"
+            "    uint64_t w;\n"
+            "    memcpy(&w, p, sizeof(w));\n"
+            "#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__\n"
+            "    w = __builtin_bswap64(w);\n"
+            "#endif\n"
+            "    return w;\n"
+            "}\n"
+            "// Loads the 1 to 7 bytes at p without reading past them.\n"
+            "static inline uint64_t load_tail(const char *p, size_t n) {\n"
+            "    const unsigned char *s = (const unsigned char *)p;\n"
+            "    if (n >= 4) {\n"
+            "        uint64_t lo = s[0] | s[1] << 8 | s[2] << 16 | (uint64_t)s[3] << 24;\n"
+            "        uint64_t hi = s[n - 4] | s[n - 3] << 8 | s[n - 2] << 16 | (uint64_t)s[n - 1] << 24;\n"
+            "        return lo | hi << (8 * (n - 4));\n"
+            "    }\n"
+            "    return s[0] | (uint64_t)s[n / 2] << (8 * (n / 2)) | (uint64_t)s[n - 1] << (8 * (n - 1));\n"
+            "}\n"
+            "static inline uint64_t hash_word(uint64_t h, uint64_t w) {\n"
+            "    h = (h ^ w) * %lluull;\n"
+            "    return h ^ (h >> 32);\n"
+            "}\n"
+            "static inline uint64_t hash_finish(uint64_t h) {\n"
+            "    h ^= h >> 29;\n"
+            "    h *= %lluull;\n"
+            "    h ^= h >> 32;\n"
+            "    return h ? h : 1;\n"
+            "}\n"
+            "static inline uint64_t hash_bytes(const char *p, size_t len) {\n"
+            "    uint64_t h = len * %lluull;\n"
+            "    size_t i = 0;\n"
+            "    for (; i + 8 <= len; i += 8) h = hash_word(h, load_word(p + i));\n"
+            "    if (i < len) h = hash_word(h, load_tail(p + i, len - i));\n"
+            "    return hash_finish(h);\n"
+            "}\n"
+            "// hash_bytes() for len <= 16, for when 16 bytes may be read at p.\n"
+            "static inline uint64_t hash_short(const char *p, size_t len) {\n"
+            "    uint64_t w = load_word(p);\n"
+            "    uint64_t h = len * %lluull;\n"
+            "    if (len > 8) {\n"
+            "        h = hash_word(h, w);\n"
+            "        w = load_word(p + 8);\n"
+            "        len -= 8;\n"
+            "    }\n"
+            "    if (len) h = hash_word(h, w & (~0ull >> (64 - 8 * len)));\n"
+            "    return hash_finish(h);\n"
+            "}\n",
+            JIPG_KEY_HASH_MUL, JIPG_KEY_HASH_SEED, JIPG_KEY_HASH_SEED, JIPG_KEY_HASH_SEED);
+}
+
+// decl and prefix are "static inline " and "" when the runtime is embedded in a
+// generated source, or "" and "jipg_" when emitting the shared runtime source.
+static void jipg_emit_lexer_impl(FILE *source, const char *decl, const char *prefix) {
+    fprintf(source,
+            "#if defined(__SSE2__)\n"
+            "#include <immintrin.h>\n"
+            "#endif\n");
+
+    fprintf(source,
+            "static inline size_t utf8_sequence(const unsigned char *s, size_t n) {\n"
+            "    unsigned char lo = 0x80, hi = 0xBF;\n"
+            "    size_t len;\n"
+            "    if (s[0] >= 0xC2 && s[0] <= 0xDF) {\n"
+            "        len = 2;\n"
+            "    } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {\n"
+            "        len = 3;\n"
+            "        if (s[0] == 0xE0) lo = 0xA0;\n"
+            "        if (s[0] == 0xED) hi = 0x9F;\n"
+            "    } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {\n"
+            "        len = 4;\n"
+            "        if (s[0] == 0xF0) lo = 0x90;\n"
+            "        if (s[0] == 0xF4) hi = 0x8F;\n"
+            "    } else {\n"
+            "        return 0;\n"
+            "    }\n"
+            "    if (n < len || s[1] < lo || s[1] > hi) return 0;\n"
+            "    for (size_t i = 2; i < len; ++i)\n"
+            "        if ((s[i] & 0xC0) != 0x80) return 0;\n"
+            "    return len;\n"
+            "}\n");
+
+    // Keiser and Lemire's lookup algorithm: three nibble table lookups classify
+    // every byte pair and a saturating subtract finds required continuations.
+    fprintf(source,
+            "#if defined(__SSSE3__)\n"
+            "static inline __m128i utf8_block_error(__m128i in, __m128i prev) {\n"
+            "    const __m128i nibble = _mm_set1_epi8(0x0F);\n"
+            "    __m128i prev1 = _mm_alignr_epi8(in, prev, 15);\n"
+            "    __m128i byte_1_high = _mm_shuffle_epi8(\n"
+            "        _mm_setr_epi8(0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,\n"
+            "                      (char)0x80, (char)0x80, (char)0x80, (char)0x80, 0x21, 0x01, 0x15, 0x49),\n"
+            "        _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));\n"
+            "    __m128i byte_1_low = _mm_shuffle_epi8(\n"
+            "        _mm_setr_epi8((char)0xE7, (char)0xA3, (char)0x83, (char)0x83, (char)0x8B, (char)0xCB, (char)0xCB, (char)0xCB,\n"
+            "                      (char)0xCB, (char)0xCB, (char)0xCB, (char)0xCB, (char)0xCB, (char)0xDB, (char)0xCB, (char)0xCB),\n"
+            "        _mm_and_si128(prev1, nibble));\n"
+            "    __m128i byte_2_high = _mm_shuffle_epi8(\n"
+            "        _mm_setr_epi8(0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,\n"
+            "                      (char)0xE6, (char)0xAE, (char)0xBA, (char)0xBA, 0x01, 0x01, 0x01, 0x01),\n"
+            "        _mm_and_si128(_mm_srli_epi16(in, 4), nibble));\n"
+            "    __m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);\n"
+            "    __m128i third = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 14), _mm_set1_epi8(0xE0 - 0x80));\n"
+            "    __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13), _mm_set1_epi8((char)(0xF0 - 0x80)));\n"
+            "    __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));\n"
+            "    return _mm_xor_si128(must23, special);\n"
+            "}\n"
+            "#endif\n");
+
+    fprintf(source,
+            "static inline bool validate_utf8(const char *str, size_t len) {\n"
+            "    const unsigned char *s = (const unsigned char *)str;\n"
+            "    size_t i = 0;\n"
+            "#if defined(__SSSE3__)\n"
+            "    __m128i prev = _mm_setzero_si128();\n"
+            "    __m128i error = _mm_setzero_si128();\n"
+            "    for (; i + 16 <= len; i += 16) {\n"
+            "        __m128i in = _mm_loadu_si128((const __m128i *)(s + i));\n"
+            "        error = _mm_or_si128(error, utf8_block_error(in, prev));\n"
+            "        prev = in;\n"
+            "    }\n"
+            "    if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF) return false;\n"
+            "    // Let the scalar tail start at the last lead byte the vector loop saw.\n"
+            "    while (i > 0 && (s[i - 1] & 0xC0) == 0x80) --i;\n"
+            "    if (i > 0 && s[i - 1] >= 0xC0) --i;\n"
+            "#endif\n"
+            "    while (i < len) {\n"
+            "        if (s[i] < 0x80) {\n"
+            "            ++i;\n"
+            "            continue;\n"
+            "        }\n"
+            "        size_t n = utf8_sequence(s + i, len - i);\n"
+            "        if (!n) return false;\n"
+            "        i += n;\n"
+            "    }\n"
+            "    return true;\n"
+            "}\n");
+
+    // A token cut short by the end of the input leaves read_pos past len, as
+    // read_char() does there, so a truncated token can be told from a bad one.
+    fprintf(source,
+            "static inline bool past_end(Lexer *l) {\n"
+            "    l->read_pos = l->len + 1;\n"
+            "    return false;\n"
+            "}\n");
+
+    // Scans the string starting at l->pos up to its closing quote, validating
+    // escapes and UTF-8. Plain runs are skipped a vector at a time.
+    fprintf(source,
+            "static inline bool scan_string(Lexer *l, Token *tok) {\n"
+            "    const char *in = l->input;\n"
+            "    size_t len = l->len;\n"
+            "    size_t i = l->pos;\n"
+            "    // Bytes with the high bit set only need a UTF-8 check once the string\n"
+            "    // ends; high may also include bytes past it, which merely costs that check.\n"
+            "    uint32_t high = 0;\n"
+            "    for (;;) {\n"
+            "#if defined(__AVX2__)\n"
+            "        for (; i + 32 <= len; i += 32) {\n"
+            "            __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));\n"
+            "            __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\"')),\n"
+            "                                           _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\\\')));\n"
+            "            stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1F)), v));\n"
+            "            high |= (uint32_t)_mm256_movemask_epi8(v);\n"
+            "            uint32_t mask = (uint32_t)_mm256_movemask_epi8(stop);\n"
+            "            if (mask) {\n"
+            "                i += __builtin_ctz(mask);\n"
+            "                break;\n"
+            "            }\n"
+            "        }\n"
+            "#endif\n"
+            "#if defined(__SSE2__)\n"
+            "        for (; i + 16 <= len; i += 16) {\n"
+            "            __m128i v = _mm_loadu_si128((const __m128i *)(in + i));\n"
+            "            __m128i stop = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\"')),\n"
+            "                                        _mm_cmpeq_epi8(v, _mm_set1_epi8('\\\\')));\n"
+            "            stop = _mm_or_si128(stop, _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v));\n"
+            "            high |= (uint32_t)_mm_movemask_epi8(v);\n"
+            "            uint32_t mask = (uint32_t)_mm_movemask_epi8(stop);\n"
+            "            if (mask) {\n"
+            "                i += __builtin_ctz(mask);\n"
+            "                break;\n"
+            "            }\n"
+            "        }\n"
+            "#endif\n"
+            "        if (i >= len) return past_end(l);\n"
+            "        unsigned char c = (unsigned char)in[i];\n"
+            "        if (c == '\"') break;\n"
+            "        if (c == '\\\\') {\n"
+            "            tok->escaped = true;\n"
+            "            if (i + 1 >= len) return past_end(l);\n"
+            "            switch (in[i + 1]) {\n"
+            "                case '\"': case '\\\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':\n"
+            "                    i += 2;\n"
+            "                    break;\n"
+            "                case 'u':\n"
+            "                    if (i + 6 > len) return past_end(l);\n"
+            "                    for (size_t k = 2; k < 6; ++k)\n"
+            "                        if (!isxdigit((unsigned char)in[i + k])) return false;\n"
+            "                    i += 6;\n"
+            "                    break;\n"
+            "                default:\n"
+            "                    return false;\n"
+            "            }\n"
+            "        } else if (c < 0x20) {\n"
+            "            return false;\n"
+            "        } else {\n"
+            "            high |= c & 0x80;\n"
+            "            ++i;\n"
+            "        }\n"
+            "    }\n"
+            "    tok->lit = in + l->pos;\n"
+            "    tok->len = i - l->pos;\n"
+            "    if (high && !validate_utf8(tok->lit, tok->len)) return false;\n"
+            "    // Keys are short: hash them while their bytes are at hand.\n"
+            "    if (!tok->escaped && tok->len <= 16 && l->pos + 16 <= len)\n"
+            "        tok->hash = hash_short(tok->lit, tok->len);\n"
+            "    l->read_pos = i;\n"
+            "    read_char(l);\n"
+            "    return true;\n"
             "}\n");
 
     fprintf(source,
-            "static inline Token next_token(Lexer *l) {\n"
+            "%sToken %snext_token(Lexer *l) {\n"
+            "    LEX_STAT(l, tokens, 1);\n"
             "    skip_whitespace(l);\n"
             "    Token tok = {.lit = l->input + l->pos, .len = 1};\n"
             "    switch (l->ch) {\n"
@@ -820,15 +2236,10 @@ static void jipg_emit_lexer_impl(FILE *source) {
             "        case '\"': {\n"
             "            tok.type = TOKEN_TYPE_STRING;\n"
             "            read_char(l);\n"
-            "            tok.len = 0;\n"
-            "            tok.lit = l->input + l->pos;\n"
-            "            for (; l->ch != '\"'; read_char(l), ++tok.len) {\n"
-            "                if (l->ch == '\\\\') {\n"
-            "                    read_char(l);\n"
-            "                    ++tok.len;\n"
-            "                }\n"
+            "            if (!scan_string(l, &tok)) {\n"
+            "                tok.type = TOKEN_TYPE_ILLEGAL;\n"
+            "                return tok;\n"
             "            }\n"
-            "            // read_char(l);\n"
             "        } break;\n"
             "        default: {\n"
             "            if (isdigit(l->ch) || l->ch == '.' || l->ch == '-') {\n"
@@ -836,19 +2247,20 @@ static void jipg_emit_lexer_impl(FILE *source) {
             "                tok.len = read_number(l);\n"
             "                return tok;"
             "            } else {\n"
-            "                if (strncmp(l->input, \"true\", 4) == 0) {\n"
+            "                if (l->len - l->pos >= 4 && memcmp(l->input + l->pos, \"true\", 4) == 0) {\n"
             "                    tok.type = TOKEN_TYPE_TRUE;\n"
             "                    tok.len = 4;\n"
             "                    read_chars(l, 4);\n"
-            "                } else if (strncmp(l->input, \"false\", 5) == 0) {\n"
+            "                } else if (l->len - l->pos >= 5 && memcmp(l->input + l->pos, \"false\", 5) == 0) {\n"
             "                    tok.type = TOKEN_TYPE_FALSE;\n"
             "                    tok.len = 5;\n"
             "                    read_chars(l, 5);\n"
-            "                } else if (strncmp(l->input, \"null\", 4) == 0) {\n"
+            "                } else if (l->len - l->pos >= 4 && memcmp(l->input + l->pos, \"null\", 4) == 0) {\n"
             "                    tok.type = TOKEN_TYPE_NULL;\n"
             "                    tok.len = 4;\n"
             "                    read_chars(l, 4);\n"
             "                } else {\n"
+            "                    if (l->len - l->pos < 5) past_end(l);\n"
             "                    tok.type = TOKEN_TYPE_ILLEGAL;\n"
             "                }\n"
             "                return tok;\n"
@@ -857,29 +2269,236 @@ static void jipg_emit_lexer_impl(FILE *source) {
             "    }\n"
             "    read_char(l);\n"
             "    return tok;\n"
-            "}\n");
+            "}\n",
+            decl, prefix);
 
+    // Escaped keys hash as the bytes they decode to, so "na\u006de" finds
+    // name. decode_string() comes with the helpers further down.
     fprintf(source,
-            "static inline uint64_t hash(Token *tok) {\n"
-            "    static uint64_t sbox_lut[256] = {\n");
+            "%ssize_t %sdecode_string(const Token *tok, char *out);\n"
+            "%suint64_t %shash(Token *tok) {\n"
+            "    if (tok->hash) return tok->hash;\n"
+            "    if (!tok->escaped) return tok->hash = hash_bytes(tok->lit, tok->len);\n"
+            "    char buf[256];\n"
+            "    char *out = tok->len <= sizeof(buf) ? buf : (char *)JIPG_REALLOC(NULL, tok->len);\n"
+            "    size_t len = out ? decode_string(tok, out) : SIZE_MAX;\n"
+            "    tok->hash = len == SIZE_MAX ? hash_bytes(tok->lit, tok->len) : hash_bytes(out, len);\n"
+            "    if (out != buf) JIPG_FREE(out);\n"
+            "    return tok->hash;\n"
+            "}\n",
+            decl, prefix, decl, prefix);
+}
 
-    for (size_t i = 0; i < ARRAY_SIZE(sbox_lut); ++i) {
-        fprintf(source, "       %lullu,\n", sbox_lut[i]);
-    }
+// --arena: parse_<Head>_arena() takes the strings, arrays, map tables and
+// nodes of its result from a Jipg_Arena instead of realloc(). Each parsing
+// thread owns one; its blocks are mapped as 2 MB huge pages, explicitly with
+// MAP_HUGETLB or else through transparent huge pages, and kept on the NUMA
+// node the thread first allocated on. Every allocation is preceded by its
+// size, so growing the newest one extends it in place.
+static void jipg_emit_arena_helpers(FILE *source, const char *decl, const char *prefix) {
+    fprintf(source,
+            "struct Jipg_Arena_Block {\n"
+            "    Jipg_Arena_Block *prev;\n"
+            "    size_t size;\n"
+            "};\n"
+            "static _Thread_local Jipg_Arena *arena;\n"
+            "%sJipg_Arena *%sset_arena(Jipg_Arena *a) {\n"
+            "    Jipg_Arena *old = arena;\n"
+            "    arena = a;\n"
+            "    return old;\n"
+            "}\n",
+            decl, prefix);
 
     fprintf(source,
-            "    };\n"
-            "    uint64_t res = 0;\n"
-            "    for (size_t i = 0; i < tok->len; ++i) {\n"
-            "        res = (res + sbox_lut[tok->lit[i]]) * 3;\n"
+            "static void *arena_map(Jipg_Arena *a, size_t size) {\n"
+            "#ifdef __linux__\n"
+            "    const size_t huge = (size_t)2 << 20;\n"
+            "    char *p = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);\n"
+            "    if (p != MAP_FAILED) {\n"
+            "        ++a->huge_blocks;\n"
+            "    } else {\n"
+            "        // Transparent huge pages need the range aligned to them.\n"
+            "        char *raw = (char *)mmap(NULL, size + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);\n"
+            "        if (raw == MAP_FAILED) return NULL;\n"
+            "        p = (char *)(((uintptr_t)raw + huge - 1) & ~(uintptr_t)(huge - 1));\n"
+            "        if (p > raw) munmap(raw, p - raw);\n"
+            "        munmap(p + size, raw + huge - p);\n"
+            "        if (madvise(p, size, MADV_HUGEPAGE) == 0) ++a->huge_blocks;\n"
+            "    }\n"
+            "    // The kernel places a page on the node of the thread touching it first.\n"
+            "    // Asking where the first page of the first block went gives the node\n"
+            "    // later blocks are bound to, even if the thread migrates.\n"
+            "    if (!a->node) {\n"
+            "        int node = -1;\n"
+            "        p[0] = 0;\n"
+            "        if (syscall(SYS_get_mempolicy, &node, NULL, 0, p, MPOL_F_NODE | MPOL_F_ADDR) == 0) a->node = node + 1;\n"
+            "    }\n"
+            "    if (a->node && a->node <= 64) {\n"
+            "        unsigned long mask = 1UL << (a->node - 1);\n"
+            "        syscall(SYS_mbind, p, size, MPOL_PREFERRED, &mask, 8 * sizeof(mask) + 1, 0);\n"
+            "    }\n"
+            "    return p;\n"
+            "#else\n"
+            "    (void)a;\n"
+            "    return JIPG_REALLOC(NULL, size);\n"
+            "#endif\n"
+            "}\n"
+            "static void arena_unmap(Jipg_Arena_Block *block) {\n"
+            "#ifdef __linux__\n"
+            "    munmap(block, block->size);\n"
+            "#else\n"
+            "    JIPG_FREE(block);\n"
+            "#endif\n"
+            "}\n");
+
+    // Blocks double up to a gigabyte, so a large result takes few of them and
+    // a reset arena keeps its largest one.
+    fprintf(source,
+            "static void *arena_realloc(Jipg_Arena *a, void *p, size_t n) {\n"
+            "    size_t need = (n + 15) & ~(size_t)15;\n"
+            "    size_t old = p ? ((size_t *)p)[-2] : 0;\n"
+            "    char *base = (char *)a->block;\n"
+            "    if (p && (char *)p + old == base + a->used && (size_t)((char *)p - base) + need <= a->cap) {\n"
+            "        a->used = (char *)p - base + need;\n"
+            "        ((size_t *)p)[-2] = need;\n"
+            "        return p;\n"
             "    }\n"
+            "    if (need <= old) return p;\n"
+            "    if (!a->block || a->used + 16 + need > a->cap) {\n"
+            "        size_t size = a->block ? 2 * a->block->size : " STR(JIPG_ARENA_BLOCK_SIZE) ";\n"
+            "        if (size > ((size_t)1 << 30)) size = (size_t)1 << 30;\n"
+            "        if (size < 32 + need) size = (32 + need + ((size_t)2 << 20) - 1) & ~(((size_t)2 << 20) - 1);\n"
+            "        Jipg_Arena_Block *block = (Jipg_Arena_Block *)arena_map(a, size);\n"
+            "        if (!block) return NULL;\n"
+            "        block->prev = a->block;\n"
+            "        block->size = size;\n"
+            "        a->block = block;\n"
+            "        a->used = 16;\n"
+            "        a->cap = size;\n"
+            "        a->bytes += size;\n"
+            "        base = (char *)block;\n"
+            "    }\n"
+            "    char *res = base + a->used + 16;\n"
+            "    ((size_t *)res)[-2] = need;\n"
+            "    a->used += 16 + need;\n"
+            "    if (old) memcpy(res, p, old);\n"
             "    return res;\n"
             "}\n");
+
+    fprintf(source,
+            "%svoid *%smem_realloc(void *p, size_t n) {\n"
+            "    return arena ? arena_realloc(arena, p, n) : JIPG_REALLOC(p, n);\n"
+            "}\n"
+            "%svoid %smem_free(void *p) {\n"
+            "    if (!arena) {\n"
+            "        JIPG_FREE(p);\n"
+            "    } else if (p && (char *)p + ((size_t *)p)[-2] == (char *)arena->block + arena->used) {\n"
+            "        arena->used = (char *)p - 16 - (char *)arena->block;\n"
+            "    }\n"
+            "}\n",
+            decl, prefix, decl, prefix);
+
+    fprintf(source,
+            "%svoid %sarena_reset(Jipg_Arena *a) {\n"
+            "    if (!a->block) return;\n"
+            "    while (a->block->prev) {\n"
+            "        Jipg_Arena_Block *prev = a->block->prev;\n"
+            "        a->block->prev = prev->prev;\n"
+            "        a->bytes -= prev->size;\n"
+            "        arena_unmap(prev);\n"
+            "    }\n"
+            "    a->used = 16;\n"
+            "}\n"
+            "%svoid %sarena_free(Jipg_Arena *a) {\n"
+            "    while (a->block) {\n"
+            "        Jipg_Arena_Block *prev = a->block->prev;\n"
+            "        arena_unmap(a->block);\n"
+            "        a->block = prev;\n"
+            "    }\n"
+            "    a->used = 0;\n"
+            "    a->cap = 0;\n"
+            "    a->bytes = 0;\n"
+            "    a->huge_blocks = 0;\n"
+            "}\n",
+            decl, prefix, decl, prefix);
 }
 
-static void jipg_emit_helpers(FILE *source) {
+static void jipg_emit_helpers(FILE *source, const char *decl, const char *prefix) {
+    // Failure paths: the first failure records where and what, every parser it
+    // unwinds through prepends its member or index to the path. All of it is
+    // cold and out of line, and the error sink is thread local rather than in
+    // the Lexer, so the happy path only pays for the branch.
+    const char *cold = *decl ? "static __attribute__((cold, noinline, unused)) " : "__attribute__((cold, noinline)) ";
+
+    fprintf(source,
+            "static _Thread_local Jipg_Error *parse_error;\n"
+            "%sJipg_Error *%sset_parse_error(Jipg_Error *err) {\n"
+            "    Jipg_Error *old = parse_error;\n"
+            "    parse_error = err;\n"
+            "    return old;\n"
+            "}\n",
+            decl, prefix);
+    fprintf(source,
+            "%sbool %sfail_at(Lexer *l, const char *at, const char *expected, const char *found) {\n"
+            "    Jipg_Error *err = parse_error;\n"
+            "    if (err && !err->expected) {\n"
+            "        err->offset = at - l->input;\n"
+            "        err->expected = expected;\n"
+            "        err->found = found;\n"
+            "    }\n"
+            "    return false;\n"
+            "}\n",
+            cold, prefix);
+
+    fprintf(source,
+            "%sbool %sfail(Lexer *l, const Token *tok, const char *expected) {\n"
+            "    static const char *const names[] = {\n"
+            "        \"nothing\", \"illegal token\", \"end of input\", \"'{'\", \"'}'\", \"'['\", \"']'\",\n"
+            "        \"':'\", \"','\", \"string\", \"number\", \"true\", \"false\", \"null\",\n"
+            "    };\n"
+            "    bool eof = (size_t)(tok->lit - l->input) >= l->len;\n"
+            "    return fail_at(l, tok->lit, expected, eof ? \"end of input\" : names[tok->type]);\n"
+            "}\n",
+            cold, prefix);
+
+    fprintf(source,
+            "%sbool %sfail_key(const char *key, size_t len) {\n"
+            "    Jipg_Error *err = parse_error;\n"
+            "    if (!err) return false;\n"
+            "    char seg[sizeof(err->path)];\n"
+            "    size_t n = 0;\n"
+            "    seg[n++] = '/';\n"
+            "    for (size_t i = 0; i < len && n + 2 < sizeof(seg); ++i) {\n"
+            "        if (key[i] == '~' || key[i] == '/') {\n"
+            "            seg[n++] = '~';\n"
+            "            seg[n++] = key[i] == '~' ? '0' : '1';\n"
+            "        } else {\n"
+            "            seg[n++] = key[i];\n"
+            "        }\n"
+            "    }\n"
+            "    size_t path_len = strlen(err->path);\n"
+            "    if (path_len + n < sizeof(err->path)) {\n"
+            "        memmove(err->path + n, err->path, path_len + 1);\n"
+            "        memcpy(err->path, seg, n);\n"
+            "    }\n"
+            "    return false;\n"
+            "}\n",
+            cold, prefix);
+
+    fprintf(source,
+            "%sbool %sfail_index(size_t index) {\n"
+            "    char digits[20];\n"
+            "    size_t n = sizeof(digits);\n"
+            "    do {\n"
+            "        digits[--n] = '0' + index %% 10;\n"
+            "        index /= 10;\n"
+            "    } while (index);\n"
+            "    return fail_key(digits + n, sizeof(digits) - n);\n"
+            "}\n",
+            cold, prefix);
+
     fprintf(source,
-            "static inline bool parse_bool(Lexer *l, bool *res) {\n"
+            "%sbool %sparse_bool(Lexer *l, bool *res) {\n"
             "    Token tok = next_token(l);\n"
             "    switch (tok.type) {\n"
             "        case TOKEN_TYPE_TRUE: {\n"
@@ -891,196 +2510,5301 @@ static void jipg_emit_helpers(FILE *source) {
             "            return true;\n"
             "        } break;\n"
             "        default:\n"
-            "            return false;\n"
+            "            return fail(l, &tok, \"true or false\");\n"
             "    }\n"
-            "}\n");
+            "}\n",
+            decl, prefix);
 
     fprintf(source,
-            "static inline bool parse_int(Lexer *l, int64_t *res) {\n"
+            "%sbool %sparse_int(Lexer *l, int64_t *res) {\n"
             "    Token tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_NUMBER)\n"
+            "        return fail(l, &tok, \"number\");\n"
             "    *res = (int64_t)atof(tok.lit);\n"
             "    return true;\n"
-            "}\n");
+            "}\n",
+            decl, prefix);
 
     fprintf(source,
-            "static inline bool parse_float(Lexer *l, double *res) {\n"
+            "%sbool %sparse_float(Lexer *l, double *res) {\n"
             "    Token tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_NUMBER)\n"
+            "        return fail(l, &tok, \"number\");\n"
             "    *res = atof(tok.lit);\n"
             "    return true;\n"
-            "}\n");
+            "}\n",
+            decl, prefix);
 
+    // JIPG_NUMBER_RAW: only where the token is, converted later if ever.
     fprintf(source,
-            "static inline bool parse_str(Lexer *l, char **res) {\n"
+            "%sbool %sparse_number(Lexer *l, Jipg_Number *res) {\n"
             "    Token tok = next_token(l);\n"
-            "    if (tok.type != TOKEN_TYPE_STRING)\n"
-            "        return false;\n"
-            "    *res = (char *)%s(NULL, tok.len + 1);\n"
-            "    if (!*res) return false;\n"
-            "    memcpy(*res, tok.lit, tok.len);\n"
-            "    (*res)[tok.len] = 0;\n"
+            "    if (tok.type != TOKEN_TYPE_NUMBER)\n"
+            "        return fail(l, &tok, \"number\");\n"
+            "    if (tok.len > UINT32_MAX)\n"
+            "        return fail(l, &tok, \"shorter number\");\n"
+            "    res->offset = tok.lit - l->input;\n"
+            "    res->len = (uint32_t)tok.len;\n"
+            "    res->cached = 0;\n"
             "    return true;\n"
             "}\n",
-            STR(JIPG_REALLOC));
-}
+            decl, prefix);
 
-static void jipg_emit_value_parser(FILE *source, Jipg_Value *value);
+    fprintf(source,
+            "static inline uint32_t read_hex4(const char *s) {\n"
+            "    uint32_t res = 0;\n"
+            "    for (size_t i = 0; i < 4; ++i) {\n"
+            "        char c = s[i];\n"
+            "        res = res * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);\n"
+            "    }\n"
+            "    return res;\n"
+            "}\n");
 
-static void jipg_emit_object_parser(FILE *source, Jipg_Value *object) {
-    Jipg_Value *kv = object->as_object.kv_head;
+    // Decodes the escapes of a string token into out, which must hold tok->len
+    // bytes; escapes never decode to more bytes than they take up. Returns the
+    // decoded length or SIZE_MAX on an unpaired surrogate.
+    fprintf(source,
+            "%ssize_t %sdecode_string(const Token *tok, char *out) {\n"
+            "    const char *s = tok->lit;\n"
+            "    const char *end = s + tok->len;\n"
+            "    char *o = out;\n"
+            "    while (s < end) {\n"
+            "        const char *bs = memchr(s, '\\\\', end - s);\n"
+            "        if (!bs) bs = end;\n"
+            "        memcpy(o, s, bs - s);\n"
+            "        o += bs - s;\n"
+            "        s = bs;\n"
+            "        if (s == end) break;\n"
+            "        char c = s[1];\n"
+            "        s += 2;\n"
+            "        switch (c) {\n"
+            "            case 'b': *o++ = '\\b'; break;\n"
+            "            case 'f': *o++ = '\\f'; break;\n"
+            "            case 'n': *o++ = '\\n'; break;\n"
+            "            case 'r': *o++ = '\\r'; break;\n"
+            "            case 't': *o++ = '\\t'; break;\n"
+            "            case 'u': {\n"
+            "                uint32_t cp = read_hex4(s);\n"
+            "                s += 4;\n"
+            "                if (cp >= 0xD800 && cp <= 0xDBFF) {\n"
+            "                    if (end - s < 6 || s[0] != '\\\\' || s[1] != 'u') return SIZE_MAX;\n"
+            "                    uint32_t lo = read_hex4(s + 2);\n"
+            "                    if (lo < 0xDC00 || lo > 0xDFFF) return SIZE_MAX;\n"
+            "                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);\n"
+            "                    s += 6;\n"
+            "                } else if (cp >= 0xDC00 && cp <= 0xDFFF) {\n"
+            "                    return SIZE_MAX;\n"
+            "                }\n"
+            "                if (cp < 0x80) {\n"
+            "                    *o++ = (char)cp;\n"
+            "                } else if (cp < 0x800) {\n"
+            "                    *o++ = (char)(0xC0 | cp >> 6);\n"
+            "                    *o++ = (char)(0x80 | (cp & 0x3F));\n"
+            "                } else if (cp < 0x10000) {\n"
+            "                    *o++ = (char)(0xE0 | cp >> 12);\n"
+            "                    *o++ = (char)(0x80 | (cp >> 6 & 0x3F));\n"
+            "                    *o++ = (char)(0x80 | (cp & 0x3F));\n"
+            "                } else {\n"
+            "                    *o++ = (char)(0xF0 | cp >> 18);\n"
+            "                    *o++ = (char)(0x80 | (cp >> 12 & 0x3F));\n"
+            "                    *o++ = (char)(0x80 | (cp >> 6 & 0x3F));\n"
+            "                    *o++ = (char)(0x80 | (cp & 0x3F));\n"
+            "                }\n"
+            "            } break;\n"
+            "            default: *o++ = c; break;\n"
+            "        }\n"
+            "    }\n"
+            "    return o - out;\n"
+            "}\n",
+            decl, prefix);
 
-    for (; kv; kv = kv->as_object_kv.next) {
-        Jipg_Value *value = kv->as_object_kv.value;
-        jipg_emit_value_parser(source, value);
-    }
+    if (jipg_global_context.result_arena) jipg_emit_arena_helpers(source, decl, prefix);
 
+    // Copies a string token, decoding escapes, into a new allocation.
+    fprintf(source,
+            "%schar *%scopy_string(const Token *tok, size_t *len) {\n"
+            "    char *res = (char *)%s(NULL, tok->len + 1);\n"
+            "    if (!res) return NULL;\n"
+            "    *len = tok->len;\n"
+            "    if (!tok->escaped) {\n"
+            "        memcpy(res, tok->lit, tok->len);\n"
+            "    } else if ((*len = decode_string(tok, res)) == SIZE_MAX) {\n"
+            "        %s(res);\n"
+            "        return NULL;\n"
+            "    }\n"
+            "    res[*len] = 0;\n"
+            "    return res;\n"
+            "}\n",
+            decl, prefix, jipg_result_realloc(), jipg_result_free());
+
+    fprintf(source,
+            "%sbool %sparse_str(Lexer *l, char **res) {\n"
+            "    Token tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_STRING)\n"
+            "        return fail(l, &tok, \"string\");\n"
+            "    size_t len;\n"
+            "    *res = copy_string(&tok, &len);\n"
+            "    return *res != NULL || fail(l, &tok, \"valid string\");\n"
+            "}\n",
+            decl, prefix);
+
+    // Like parse_str, but decodes into the old string when it is long enough
+    // and reallocates it otherwise.
+    fprintf(source,
+            "%sbool %smerge_str(Lexer *l, char **res) {\n"
+            "    Token tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_STRING)\n"
+            "        return fail(l, &tok, \"string\");\n"
+            "    if (!*res || strlen(*res) < tok.len) {\n"
+            "        char *str = (char *)%s(*res, tok.len + 1);\n"
+            "        if (!str) return fail_at(l, tok.lit, \"allocation\", \"out of memory\");\n"
+            "        *res = str;\n"
+            "    }\n"
+            "    size_t len = tok.len;\n"
+            "    if (!tok.escaped)\n"
+            "        memcpy(*res, tok.lit, len);\n"
+            "    else if ((len = decode_string(&tok, *res)) == SIZE_MAX)\n"
+            "        return fail(l, &tok, \"valid string\");\n"
+            "    (*res)[len] = 0;\n"
+            "    return true;\n"
+            "}\n",
+            decl, prefix, jipg_result_realloc());
+
+    fprintf(source,
+            "%sbool %sskip_value(Lexer *l) {\n"
+            "    size_t depth = 0;\n"
+            "    do {\n"
+            "        Token tok = next_token(l);\n"
+            "        switch (tok.type) {\n"
+            "            case TOKEN_TYPE_LBRACE:\n"
+            "            case TOKEN_TYPE_LBRACKET:\n"
+            "                ++depth;\n"
+            "                break;\n"
+            "            case TOKEN_TYPE_RBRACE:\n"
+            "            case TOKEN_TYPE_RBRACKET:\n"
+            "                if (depth == 0) return fail(l, &tok, \"value\");\n"
+            "                --depth;\n"
+            "                break;\n"
+            "            case TOKEN_TYPE_NONE:\n"
+            "            case TOKEN_TYPE_ILLEGAL:\n"
+            "            case TOKEN_TYPE_EOF:\n"
+            "                return fail(l, &tok, \"value\");\n"
+            "            default:\n"
+            "                break;\n"
+            "        }\n"
+            "    } while (depth);\n"
+            "    return true;\n"
+            "}\n",
+            decl, prefix);
+
+    // Checks for validate_<Head>(): the leaf parsers without their results.
+    // Integers must be integer literals in the range of int64_t and floats
+    // finite; strings only have their \\u escapes paired up, the lexer checked
+    // the rest.
+    fprintf(source,
+            "%sbool %scheck_bool(Lexer *l) {\n"
+            "    Token tok = next_token(l);\n"
+            "    return tok.type == TOKEN_TYPE_TRUE || tok.type == TOKEN_TYPE_FALSE || fail(l, &tok, \"true or false\");\n"
+            "}\n",
+            decl, prefix);
+
+    fprintf(source,
+            "%sbool %scheck_int(Lexer *l) {\n"
+            "    Token tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_NUMBER)\n"
+            "        return fail(l, &tok, \"number\");\n"
+            "    const char *s = tok.lit, *end = tok.lit + tok.len;\n"
+            "    bool negative = s < end && *s == '-';\n"
+            "    s += negative;\n"
+            "    if (s == end || (*s == '0' && end - s > 1))\n"
+            "        return fail(l, &tok, \"integer\");\n"
+            "    uint64_t limit = (uint64_t)INT64_MAX + negative, n = 0;\n"
+            "    for (; s < end; ++s) {\n"
+            "        if (*s < '0' || *s > '9') return fail(l, &tok, \"integer\");\n"
+            "        if (n > (limit - (uint64_t)(*s - '0')) / 10) return fail(l, &tok, \"64-bit integer\");\n"
+            "        n = n * 10 + (uint64_t)(*s - '0');\n"
+            "    }\n"
+            "    return true;\n"
+            "}\n",
+            decl, prefix);
+
+    fprintf(source,
+            "static inline bool json_number(const Token *tok) {\n"
+            "    const char *s = tok->lit, *end = tok->lit + tok->len;\n"
+            "    s += s < end && *s == '-';\n"
+            "    const char *digits = s;\n"
+            "    while (s < end && *s >= '0' && *s <= '9') ++s;\n"
+            "    bool ok = s > digits && (*digits != '0' || s - digits == 1);\n"
+            "    if (ok && s < end && *s == '.') {\n"
+            "        digits = ++s;\n"
+            "        while (s < end && *s >= '0' && *s <= '9') ++s;\n"
+            "        ok = s > digits;\n"
+            "    }\n"
+            "    if (ok && s < end && (*s == 'e' || *s == 'E')) {\n"
+            "        ++s;\n"
+            "        s += s < end && (*s == '+' || *s == '-');\n"
+            "        digits = s;\n"
+            "        while (s < end && *s >= '0' && *s <= '9') ++s;\n"
+            "        ok = s > digits;\n"
+            "    }\n"
+            "    return ok && s == end;\n"
+            "}\n");
+
+    fprintf(source,
+            "%sbool %scheck_float(Lexer *l) {\n"
+            "    Token tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_NUMBER)\n"
+            "        return fail(l, &tok, \"number\");\n"
+            "    if (!json_number(&tok)) return fail(l, &tok, \"number\");\n"
+            "    return !__builtin_isinf(atof(tok.lit)) || fail(l, &tok, \"finite number\");\n"
+            "}\n",
+            decl, prefix);
+
+    // Raw numbers keep their text, so any size goes.
+    fprintf(source,
+            "%sbool %scheck_number(Lexer *l) {\n"
+            "    Token tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_NUMBER)\n"
+            "        return fail(l, &tok, \"number\");\n"
+            "    return (json_number(&tok) && tok.len <= UINT32_MAX) || fail(l, &tok, \"number\");\n"
+            "}\n",
+            decl, prefix);
+
+    fprintf(source,
+            "%sbool %svalid_string(const Token *tok) {\n"
+            "    const char *s = tok->lit;\n"
+            "    const char *end = s + tok->len;\n"
+            "    while ((s = memchr(s, '\\\\', end - s))) {\n"
+            "        if (s[1] != 'u') {\n"
+            "            s += 2;\n"
+            "            continue;\n"
+            "        }\n"
+            "        uint32_t cp = read_hex4(s + 2);\n"
+            "        s += 6;\n"
+            "        if (cp >= 0xD800 && cp <= 0xDBFF) {\n"
+            "            if (end - s < 6 || s[0] != '\\\\' || s[1] != 'u') return false;\n"
+            "            uint32_t lo = read_hex4(s + 2);\n"
+            "            if (lo < 0xDC00 || lo > 0xDFFF) return false;\n"
+            "            s += 6;\n"
+            "        } else if (cp >= 0xDC00 && cp <= 0xDFFF) {\n"
+            "            return false;\n"
+            "        }\n"
+            "    }\n"
+            "    return true;\n"
+            "}\n",
+            decl, prefix);
+
+    fprintf(source,
+            "%sbool %scheck_str(Lexer *l) {\n"
+            "    Token tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_STRING)\n"
+            "        return fail(l, &tok, \"string\");\n"
+            "    return !tok.escaped || valid_string(&tok) || fail(l, &tok, \"valid string\");\n"
+            "}\n",
+            decl, prefix);
+
+    // Scans the members of an object, positioned after its '{', for key_hash
+    // and returns the token of its value.
+    fprintf(source,
+            "%sbool %sfind_key(Lexer *l, uint64_t key_hash, Token *res) {\n"
+            "    Token tok = next_token(l);\n"
+            "    while (tok.type == TOKEN_TYPE_STRING) {\n"
+            "        uint64_t h = hash(&tok);\n"
+            "        tok = next_token(l);\n"
+            "        if (tok.type != TOKEN_TYPE_COLON) return fail(l, &tok, \"':'\");\n"
+            "        if (h == key_hash) {\n"
+            "            *res = next_token(l);\n"
+            "            return true;\n"
+            "        }\n"
+            "        if (!skip_value(l)) return false;\n"
+            "        tok = next_token(l);\n"
+            "        if (tok.type == TOKEN_TYPE_COMMA)\n"
+            "            tok = next_token(l);\n"
+            "    }\n"
+            "    return fail(l, &tok, \"discriminator member\");\n"
+            "}\n",
+            decl, prefix);
+
+    // The intern table only ever grows and never frees its strings, so interned
+    // pointers stay valid and equal strings always compare equal by pointer.
+    fprintf(source,
+            "static struct {\n"
+            "    atomic_flag lock;\n"
+            "    size_t len;\n"
+            "    size_t cap;\n"
+            "    uint64_t *hashes;\n"
+            "    char **strs;\n"
+            "    size_t *lens;\n"
+            "} intern_table = {.lock = ATOMIC_FLAG_INIT};\n");
+
+    fprintf(source,
+            "%sconst char *%sintern(const char *str, size_t len) {\n"
+            "    uint64_t h = hash_bytes(str, len);\n"
+            "    while (atomic_flag_test_and_set_explicit(&intern_table.lock, memory_order_acquire)) {\n"
+            "    }\n"
+            "    char *res = NULL;\n"
+            "    if (2 * (intern_table.len + 1) > intern_table.cap) {\n"
+            "        size_t cap = intern_table.cap ? intern_table.cap * 2 : 64;\n"
+            "        uint64_t *hashes = (uint64_t *)JIPG_REALLOC(NULL, cap * sizeof(*hashes));\n"
+            "        char **strs = (char **)JIPG_REALLOC(NULL, cap * sizeof(*strs));\n"
+            "        size_t *lens = (size_t *)JIPG_REALLOC(NULL, cap * sizeof(*lens));\n"
+            "        if (!hashes || !strs || !lens) {\n"
+            "            JIPG_FREE(hashes);\n"
+            "            JIPG_FREE(strs);\n"
+            "            JIPG_FREE(lens);\n"
+            "            goto done;\n"
+            "        }\n"
+            "        memset(hashes, 0, cap * sizeof(*hashes));\n"
+            "        for (size_t i = 0; i < intern_table.cap; ++i) {\n"
+            "            if (!intern_table.hashes[i]) continue;\n"
+            "            size_t j = intern_table.hashes[i] & (cap - 1);\n"
+            "            while (hashes[j]) j = (j + 1) & (cap - 1);\n"
+            "            hashes[j] = intern_table.hashes[i];\n"
+            "            strs[j] = intern_table.strs[i];\n"
+            "            lens[j] = intern_table.lens[i];\n"
+            "        }\n"
+            "        JIPG_FREE(intern_table.hashes);\n"
+            "        JIPG_FREE(intern_table.strs);\n"
+            "        JIPG_FREE(intern_table.lens);\n"
+            "        intern_table.hashes = hashes;\n"
+            "        intern_table.strs = strs;\n"
+            "        intern_table.lens = lens;\n"
+            "        intern_table.cap = cap;\n"
+            "    }\n"
+            "    size_t mask = intern_table.cap - 1;\n"
+            "    size_t i = h & mask;\n"
+            "    for (; intern_table.hashes[i]; i = (i + 1) & mask) {\n"
+            "        char *s = intern_table.strs[i];\n"
+            "        // Decoded strings may contain NULs, so lengths are compared first.\n"
+            "        if (intern_table.hashes[i] == h && intern_table.lens[i] == len && memcmp(s, str, len) == 0) {\n"
+            "            res = s;\n"
+            "            goto done;\n"
+            "        }\n"
+            "    }\n"
+            "    res = (char *)JIPG_REALLOC(NULL, len + 1);\n"
+            "    if (!res) goto done;\n"
+            "    memcpy(res, str, len);\n"
+            "    res[len] = 0;\n"
+            "    intern_table.hashes[i] = h;\n"
+            "    intern_table.strs[i] = res;\n"
+            "    intern_table.lens[i] = len;\n"
+            "    ++intern_table.len;\n"
+            "done:\n"
+            "    atomic_flag_clear_explicit(&intern_table.lock, memory_order_release);\n"
+            "    return res;\n"
+            "}\n",
+            decl, prefix);
+
+    fprintf(source,
+            "%sbool %sparse_interned(Lexer *l, const char **res) {\n"
+            "    Token tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_STRING)\n"
+            "        return fail(l, &tok, \"string\");\n"
+            "    if (!tok.escaped) {\n"
+            "        *res = intern(tok.lit, tok.len);\n"
+            "        return *res != NULL || fail_at(l, tok.lit, \"allocation\", \"out of memory\");\n"
+            "    }\n"
+            "    size_t len;\n"
+            "    char *str = copy_string(&tok, &len);\n"
+            "    if (!str) return fail(l, &tok, \"valid string\");\n"
+            "    *res = intern(str, len);\n"
+            "    %s(str);\n"
+            "    return *res != NULL || fail_at(l, tok.lit, \"allocation\", \"out of memory\");\n"
+            "}\n",
+            decl, prefix, jipg_result_free());
+
+    // Nodes of JIPG_REF members. Without a pool set each node is a separate
+    // allocation the caller frees like any other member.
+    fprintf(source,
+            "static _Thread_local Jipg_Node_Pool *node_pool;\n"
+            "%sJipg_Node_Pool *%sset_node_pool(Jipg_Node_Pool *pool) {\n"
+            "    Jipg_Node_Pool *old = node_pool;\n"
+            "    node_pool = pool;\n"
+            "    return old;\n"
+            "}\n"
+            "struct Jipg_Node_Chunk {\n"
+            "    Jipg_Node_Chunk *prev;\n"
+            "    max_align_t nodes[];\n"
+            "};\n",
+            decl, prefix);
+
+    fprintf(source,
+            "%svoid *%salloc_node(size_t size) {\n"
+            "    Jipg_Node_Pool *pool = node_pool;\n"
+            "    size_t n = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t);\n"
+            "    void *res;\n"
+            "    if (!pool) {\n"
+            "        res = %s(NULL, n * sizeof(max_align_t));\n"
+            "    } else {\n"
+            "        if (pool->used + n > pool->cap) {\n"
+            "            size_t cap = %d / sizeof(max_align_t);\n"
+            "            if (cap < n) cap = n;\n"
+            "            Jipg_Node_Chunk *chunk = (Jipg_Node_Chunk *)JIPG_REALLOC(NULL, sizeof(*chunk) + cap * sizeof(max_align_t));\n"
+            "            if (!chunk) return NULL;\n"
+            "            chunk->prev = pool->chunk;\n"
+            "            pool->chunk = chunk;\n"
+            "            pool->used = 0;\n"
+            "            pool->cap = cap;\n"
+            "        }\n"
+            "        res = pool->chunk->nodes + pool->used;\n"
+            "        pool->used += n;\n"
+            "    }\n"
+            "    if (res) memset(res, 0, n * sizeof(max_align_t));\n"
+            "    return res;\n"
+            "}\n",
+            decl, prefix, jipg_result_realloc(), JIPG_NODE_CHUNK_SIZE);
+
+    fprintf(source,
+            "%svoid %snode_pool_free(Jipg_Node_Pool *pool) {\n"
+            "    while (pool->chunk) {\n"
+            "        Jipg_Node_Chunk *prev = pool->chunk->prev;\n"
+            "        JIPG_FREE(pool->chunk);\n"
+            "        pool->chunk = prev;\n"
+            "    }\n"
+            "    pool->used = 0;\n"
+            "    pool->cap = 0;\n"
+            "}\n",
+            decl, prefix);
+
+    // Counts the members of an object positioned after its '{' up to its '}'.
+    fprintf(source,
+            "%sbool %scount_members(Lexer *l, size_t *count) {\n"
+            "    Token tok = next_token(l);\n"
+            "    while (tok.type != TOKEN_TYPE_RBRACE) {\n"
+            "        if (tok.type != TOKEN_TYPE_STRING) return fail(l, &tok, \"string or '}'\");\n"
+            "        tok = next_token(l);\n"
+            "        if (tok.type != TOKEN_TYPE_COLON) return fail(l, &tok, \"':'\");\n"
+            "        if (!skip_value(l)) return false;\n"
+            "        ++*count;\n"
+            "        tok = next_token(l);\n"
+            "        if (tok.type == TOKEN_TYPE_COMMA)\n"
+            "            tok = next_token(l);\n"
+            "    }\n"
+            "    return true;\n"
+            "}\n",
+            decl, prefix);
+}
+
+typedef struct {
+    const char *ret;
+    const char *name;
+    const char *params;
+    const char *args;
+} Jipg_Runtime_Fn;
+
+// Out-of-line functions of the shared runtime. The runtime header forwards the
+// unprefixed names generated parsers call to the exported jipg_ symbols.
+static const Jipg_Runtime_Fn jipg_runtime_fns[] = {
+    {"Jipg_Error *", "set_parse_error", "Jipg_Error *err", "err"},
+    {"bool", "fail_at", "Lexer *l, const char *at, const char *expected, const char *found", "l, at, expected, found"},
+    {"bool", "fail", "Lexer *l, const Token *tok, const char *expected", "l, tok, expected"},
+    {"bool", "fail_key", "const char *key, size_t len", "key, len"},
+    {"bool", "fail_index", "size_t index", "index"},
+    {"Token", "next_token", "Lexer *l", "l"},
+    {"uint64_t", "hash", "Token *tok", "tok"},
+    {"bool", "parse_bool", "Lexer *l, bool *res", "l, res"},
+    {"bool", "parse_int", "Lexer *l, int64_t *res", "l, res"},
+    {"bool", "parse_float", "Lexer *l, double *res", "l, res"},
+    {"bool", "parse_number", "Lexer *l, Jipg_Number *res", "l, res"},
+    {"size_t", "decode_string", "const Token *tok, char *out", "tok, out"},
+    {"char *", "copy_string", "const Token *tok, size_t *len", "tok, len"},
+    {"bool", "parse_str", "Lexer *l, char **res", "l, res"},
+    {"bool", "merge_str", "Lexer *l, char **res", "l, res"},
+    {"bool", "skip_value", "Lexer *l", "l"},
+    {"bool", "check_bool", "Lexer *l", "l"},
+    {"bool", "check_int", "Lexer *l", "l"},
+    {"bool", "check_float", "Lexer *l", "l"},
+    {"bool", "check_number", "Lexer *l", "l"},
+    {"bool", "valid_string", "const Token *tok", "tok"},
+    {"bool", "check_str", "Lexer *l", "l"},
+    {"bool", "find_key", "Lexer *l, uint64_t key_hash, Token *res", "l, key_hash, res"},
+    {"bool", "count_members", "Lexer *l, size_t *count", "l, count"},
+    {"const char *", "intern", "const char *str, size_t len", "str, len"},
+    {"bool", "parse_interned", "Lexer *l, const char **res", "l, res"},
+    {"Jipg_Node_Pool *", "set_node_pool", "Jipg_Node_Pool *pool", "pool"},
+    {"void *", "alloc_node", "size_t size", "size"},
+    {"void", "node_pool_free", "Jipg_Node_Pool *pool", "pool"},
+};
+
+// Behind parse_<Head>_arena(); always part of the shared runtime.
+static const Jipg_Runtime_Fn jipg_runtime_arena_fns[] = {
+    {"Jipg_Arena *", "set_arena", "Jipg_Arena *a", "a"},
+    {"void *", "mem_realloc", "void *p, size_t n", "p, n"},
+    {"void", "mem_free", "void *p", "p"},
+    {"void", "arena_reset", "Jipg_Arena *a", "a"},
+    {"void", "arena_free", "Jipg_Arena *a", "a"},
+};
+
+static const char *jipg_runtime_includes[] = {
+    "<ctype.h>",
+    "<stdatomic.h>",
+    "<stdbool.h>",
+    "<stddef.h>",
+    "<stdint.h>",
+    "<stdlib.h>",
+    "<string.h>",
+};
+
+// The generated code allocates through these, so they can be replaced when it
+// is compiled. They default to what the generator was built with.
+static void jipg_emit_allocator_macros(FILE *source) {
+    fprintf(source,
+            "#ifndef JIPG_REALLOC\n"
+            "#define JIPG_REALLOC %s\n"
+            "#endif\n"
+            "#ifndef JIPG_FREE\n"
+            "#define JIPG_FREE %s\n"
+            "#endif\n",
+            STR(JIPG_REALLOC), STR(JIPG_FREE));
+}
+
+// syscall(), pread() and MAP_HUGETLB are not in strict ISO C modes.
+static void jipg_emit_gnu_source(FILE *source) {
+    fprintf(source,
+            "#ifndef _GNU_SOURCE\n"
+            "#define _GNU_SOURCE\n"
+            "#endif\n");
+}
+
+static void jipg_emit_arena_includes(FILE *source) {
+    fprintf(source,
+            "#ifdef __linux__\n"
+            "#include <linux/mempolicy.h>\n"
+            "#include <sys/mman.h>\n"
+            "#include <sys/syscall.h>\n"
+            "#include <unistd.h>\n"
+            "#endif\n");
+}
+
+static void jipg_emit_runtime_forwards(FILE *header, const Jipg_Runtime_Fn *fns, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        const Jipg_Runtime_Fn *fn = fns + i;
+        fprintf(header,
+                "%s jipg_%s(%s);\n"
+                "static inline %s %s(%s) {\n"
+                "    %sjipg_%s(%s);\n"
+                "}\n",
+                fn->ret, fn->name, fn->params,
+                fn->ret, fn->name, fn->params,
+                strcmp(fn->ret, "void") == 0 ? "" : "return ", fn->name, fn->args);
+    }
+}
+
+static void jipg_emit_runtime_header(FILE *header, char *runtime_header_name) {
+    fprintf(header, "// NOTE: This file has been auto-generated by %s\n\n", __FILE__);
+    fprintf(header, "#ifndef ");
+    jipg_emit_header_macro(header, runtime_header_name);
+    fprintf(header, "\n#define ");
+    jipg_emit_header_macro(header, runtime_header_name);
+    fprintf(header, "\n\n");
+
+    for (size_t i = 0; i < ARRAY_SIZE(jipg_runtime_includes); ++i)
+        fprintf(header, "#include %s\n", jipg_runtime_includes[i]);
+    jipg_emit_allocator_macros(header);
+    fprintf(header, "\n");
+
+    jipg_emit_error_type(header);
+    jipg_emit_number_type(header);
+    jipg_emit_node_pool_type(header);
+    jipg_emit_arena_type(header);
+    jipg_emit_lexer_types(header);
+    jipg_emit_lexer_inline(header);
+
+    jipg_emit_runtime_forwards(header, jipg_runtime_fns, ARRAY_SIZE(jipg_runtime_fns));
+    jipg_emit_runtime_forwards(header, jipg_runtime_arena_fns, ARRAY_SIZE(jipg_runtime_arena_fns));
+
+    fprintf(header, "\n#endif  // ");
+    jipg_emit_header_macro(header, runtime_header_name);
+    fprintf(header, "\n");
+}
+
+// The shared runtime carries the arena helpers whether or not this generator
+// was given --arena, as the schemas sharing it may have been. Its helpers
+// allocate with mem_realloc(), which is JIPG_REALLOC while no arena is set.
+static void jipg_emit_runtime_source(FILE *source, const char *runtime_header_name) {
+    fprintf(source, "// NOTE: This file has been auto-generated by %s\n\n", __FILE__);
+    jipg_emit_gnu_source(source);
+    fprintf(source, "#include \"%s\"\n", runtime_header_name);
+    jipg_emit_arena_includes(source);
+    fprintf(source, "\n");
+
+    bool result_arena = jipg_global_context.result_arena;
+    jipg_global_context.result_arena = true;
+    jipg_emit_lexer_impl(source, "", "jipg_");
+    jipg_emit_helpers(source, "", "jipg_");
+    jipg_global_context.result_arena = result_arena;
+}
+
+static void jipg_emit_map_helpers(FILE *source, Jipg_Value *map) {
+    const char *struct_name = map->as_map.struct_name;
+
+    fprintf(source,
+            "static inline size_t %s_slot(const %s *map, uint64_t h, const char *key, size_t key_len) {\n"
+            "    size_t mask = map->cap - 1;\n"
+            "    size_t i = h & mask;\n"
+            "    for (; map->hashes[i]; i = (i + 1) & mask) {\n"
+            "        if (map->hashes[i] == h && map->entries[i].key_len == key_len &&\n"
+            "            memcmp(map->entries[i].key, key, key_len) == 0)\n"
+            "            break;\n"
+            "    }\n"
+            "    return i;\n"
+            "}\n",
+            struct_name, struct_name);
+
+    fprintf(source,
+            "%s_Entry *%s_get(const %s *map, const char *key, size_t key_len) {\n"
+            "    if (map->cap == 0) return NULL;\n"
+            "    size_t i = %s_slot(map, hash_bytes(key, key_len), key, key_len);\n"
+            "    return map->hashes[i] ? map->entries + i : NULL;\n"
+            "}\n",
+            struct_name, struct_name, struct_name, struct_name);
+
+    fprintf(source,
+            "static inline bool %s_reserve(%s *map, size_t count) {\n"
+            "    size_t cap = map->cap ? map->cap : %d;\n"
+            "    while (cap < 2 * count) cap *= 2;\n"
+            "    if (cap == map->cap) return true;\n"
+            "    // Built aside so a failed allocation leaves map as it was.\n"
+            "    %s next = *map;\n"
+            "    next.cap = cap;\n"
+            "    next.hashes = (uint64_t *)%s(NULL, cap * sizeof(*next.hashes));\n"
+            "    next.entries = (%s_Entry *)%s(NULL, cap * sizeof(*next.entries));\n"
+            "    if (!next.hashes || !next.entries) {\n"
+            "        %s(next.hashes);\n"
+            "        %s(next.entries);\n"
+            "        return false;\n"
+            "    }\n"
+            "    memset(next.hashes, 0, cap * sizeof(*next.hashes));\n"
+            "    for (size_t i = 0; i < map->cap; ++i) {\n"
+            "        if (!map->hashes[i]) continue;\n"
+            "        size_t j = %s_slot(&next, map->hashes[i], map->entries[i].key, map->entries[i].key_len);\n"
+            "        next.hashes[j] = map->hashes[i];\n"
+            "        next.entries[j] = map->entries[i];\n"
+            "    }\n"
+            "    %s(map->hashes);\n"
+            "    %s(map->entries);\n"
+            "    *map = next;\n"
+            "    return true;\n"
+            "}\n",
+            struct_name, struct_name, JIPG_INIT_LIST_CAP, struct_name, jipg_result_realloc(), struct_name,
+            jipg_result_realloc(), jipg_result_free(), jipg_result_free(), struct_name, jipg_result_free(),
+            jipg_result_free());
+}
+
+// Enum names hash to distinct values (checked at generation time), so the
+// switch on the key hash is a perfect hash followed by one confirming memcmp.
+static void jipg_emit_enum_parser(FILE *source, Jipg_Value *e) {
+    const char *struct_name = e->as_enum.struct_name;
+    // An escaped value is decoded before it is compared, on the stack when it
+    // is short enough to spell a name (at most six bytes, "\u0061", a byte)
+    // and on the heap otherwise, like in hash().
+    size_t max_len = 1;
+    for (size_t i = 0; i < e->as_enum.count; ++i)
+        if (strlen(e->as_enum.names[i]) > max_len) max_len = strlen(e->as_enum.names[i]);
+    fprintf(source,
+            "static inline bool parse_%s(Lexer *l, %s *res) {\n"
+            "    Token tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_STRING) return fail(l, &tok, \"string\");\n"
+            "    Token name = tok;\n"
+            "    char buf[%zu];\n"
+            "    char *out = buf;\n"
+            "    if (tok.escaped) {\n"
+            "        if (tok.len > sizeof(buf)) out = (char *)JIPG_REALLOC(NULL, tok.len);\n"
+            "        size_t len = out ? decode_string(&tok, out) : SIZE_MAX;\n"
+            "        if (len != SIZE_MAX) {\n"
+            "            name.lit = out;\n"
+            "            name.len = len;\n"
+            "            name.escaped = false;\n"
+            "            name.hash = 0;\n"
+            "        }\n"
+            "    }\n"
+            "    bool found = false;\n"
+            "    switch (hash(&name)) {\n",
+            struct_name, struct_name, 6 * max_len);
+    for (size_t i = 0; i < e->as_enum.count; ++i) {
+        const char *name = e->as_enum.names[i];
+        fprintf(source,
+                "        case %lullu: {  // %s\n"
+                "            if (name.len != %zu || memcmp(name.lit, \"%s\", %zu) != 0) break;\n"
+                "            *res = %s_",
+                jipg_key_hash(name), name, strlen(name), name, strlen(name), struct_name);
+        jipg_emit_identifier(source, name);
+        fprintf(source,
+                ";\n"
+                "            found = true;\n"
+                "        } break;\n");
+    }
+    fprintf(source,
+            "        default:\n"
+            "            break;\n"
+            "    }\n"
+            "    if (out != buf) JIPG_FREE(out);\n"
+            "    return found || fail(l, &tok, \"one of");
+    for (size_t i = 0; i < e->as_enum.count; ++i)
+        fprintf(source, "%s \\\"%s\\\"", i ? "," : "", e->as_enum.names[i]);
+    fprintf(source,
+            "\");\n"
+            "}\n"
+            "static inline bool check_%s(Lexer *l) {\n"
+            "    %s value;\n"
+            "    return parse_%s(l, &value);\n"
+            "}\n",
+            struct_name, struct_name, struct_name);
+}
+
+// Enums and the map table helpers are leaves emitted ahead of parse_frames().
+static void jipg_emit_value_leaves(FILE *source, Jipg_Value *value) {
+    if (value->shared) return;
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                jipg_emit_value_leaves(source, kv->as_object_kv.value);
+        } break;
+        case JIPG_KIND_ARRAY: {
+            jipg_emit_value_leaves(source, value->as_array.internal);
+        } break;
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_emit_value_leaves(source, c->as_union_case.value);
+        } break;
+        case JIPG_KIND_MAP: {
+            jipg_emit_value_leaves(source, value->as_map.internal);
+            jipg_emit_map_helpers(source, value);
+        } break;
+        case JIPG_KIND_ENUM: {
+            jipg_emit_enum_parser(source, value);
+        } break;
+        default: {
+        }
+    }
+}
+
+
+// Object, array, union and map values are parsed by a single state machine,
+// parse_frames(), which keeps an explicit stack of frames instead of recursing.
+// Every other value is a leaf with its own parse function.
+static bool jipg_value_has_frame(const Jipg_Value *value) {
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT:
+        case JIPG_KIND_ARRAY:
+        case JIPG_KIND_UNION:
+        case JIPG_KIND_MAP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static size_t jipg_object_seen_words(const Jipg_Value *object) {
+    size_t required = 0;
+    const Jipg_Value *kv = object->as_object.kv_head;
+    for (; kv; kv = kv->as_object_kv.next)
+        required += !kv->as_object_kv.value->optional;
+    return (required + 63) / 64;
+}
+
+// Frames the value needs at most, and the largest required member bitmask of
+// the objects in it; together they size the stack of parse_frames().
+static size_t jipg_value_frame_depth(const Jipg_Value *value, size_t *seen_words) {
+    size_t depth = 0;
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            size_t words = jipg_object_seen_words(value);
+            if (words > *seen_words) *seen_words = words;
+            const Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next) {
+                size_t d = jipg_value_frame_depth(kv->as_object_kv.value, seen_words);
+                if (d > depth) depth = d;
+            }
+        } break;
+        case JIPG_KIND_ARRAY: {
+            depth = jipg_value_frame_depth(value->as_array.internal, seen_words);
+        } break;
+        case JIPG_KIND_UNION: {
+            const Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next) {
+                size_t d = jipg_value_frame_depth(c->as_union_case.value, seen_words);
+                if (d > depth) depth = d;
+            }
+        } break;
+        case JIPG_KIND_MAP: {
+            depth = jipg_value_frame_depth(value->as_map.internal, seen_words);
+        } break;
+        default:
+            return 0;
+    }
+    return depth + 1;
+}
+
+// Whether releasing a value frees anything. Interned strings are pointers too,
+// but the intern table owns them.
+static bool jipg_value_owns_memory(const Jipg_Value *value) {
+    switch (value->kind) {
+        case JIPG_KIND_STRING:
+        case JIPG_KIND_ARRAY:
+        case JIPG_KIND_MAP:
+        case JIPG_KIND_REF:
+            return true;
+        case JIPG_KIND_OBJECT: {
+            const Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                if (jipg_value_owns_memory(kv->as_object_kv.value)) return true;
+            return false;
+        }
+        case JIPG_KIND_UNION: {
+            const Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                if (jipg_value_owns_memory(c->as_union_case.value)) return true;
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+
+// release_<T>() frees what a parse allocated for a value of type T, for the
+// items of parse_<Head>_each() and the values a merge replaces. Nodes behind a
+// JIPG_REF are released recursively, interned strings are never freed.
+static void jipg_emit_release_value(FILE *source, const Jipg_Value *value, const char *lval, const char *indent) {
+    switch (value->kind) {
+        case JIPG_KIND_STRING: {
+            fprintf(source, "%s%s(%s);\n", indent, jipg_result_free(), lval);
+        } break;
+        case JIPG_KIND_OBJECT:
+        case JIPG_KIND_ARRAY:
+        case JIPG_KIND_UNION:
+        case JIPG_KIND_MAP: {
+            if (!jipg_value_owns_memory(value)) break;
+            fprintf(source, "%srelease_%s(&%s);\n", indent, jipg_value_struct_name(value), lval);
+        } break;
+        case JIPG_KIND_REF: {
+            const Jipg_Value *target = value->as_ref.target;
+            fprintf(source, "%sif (%s) {\n", indent, lval);
+            if (jipg_value_owns_memory(target))
+                fprintf(source, "%s    release_%s(%s);\n", indent, jipg_value_struct_name(target), lval);
+            fprintf(source,
+                    "%s    %s(%s);\n"
+                    "%s}\n",
+                    indent, jipg_result_free(), lval, indent);
+        } break;
+        default: {
+        }
+    }
+}
+
+static void jipg_emit_release_functions(FILE *source, Jipg_Value *value, bool define) {
+    if (value->shared) return;
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                jipg_emit_release_functions(source, kv->as_object_kv.value, define);
+        } break;
+        case JIPG_KIND_ARRAY: {
+            jipg_emit_release_functions(source, value->as_array.internal, define);
+        } break;
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_emit_release_functions(source, c->as_union_case.value, define);
+        } break;
+        case JIPG_KIND_MAP: {
+            jipg_emit_release_functions(source, value->as_map.internal, define);
+        } break;
+        default:
+            return;
+    }
+    if (!jipg_value_owns_memory(value)) return;
+
+    const char *struct_name = jipg_value_struct_name(value);
+    fprintf(source, "static inline void release_%s(%s *v)%s\n", struct_name, struct_name, define ? " {" : ";");
+    if (!define) return;
+
+    char lval[512];
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next) {
+                JIPG_FORMAT(lval, "v->%s", kv->as_object_kv.key);
+                jipg_emit_release_value(source, kv->as_object_kv.value, lval, "    ");
+            }
+        } break;
+        case JIPG_KIND_ARRAY: {
+            const Jipg_Value *internal = value->as_array.internal;
+            if (internal->kind == JIPG_KIND_REF) {
+                const Jipg_Value *target = internal->as_ref.target;
+                if (jipg_value_owns_memory(target))
+                    fprintf(source,
+                            "    for (size_t i = 0; i < v->len; ++i)\n"
+                            "        release_%s(v->items + i);\n",
+                            jipg_value_struct_name(target));
+            } else if (jipg_value_owns_memory(internal)) {
+                fprintf(source, "    for (size_t i = 0; i < v->len; ++i) {\n");
+                jipg_emit_release_value(source, internal, "v->items[i]", "        ");
+                fprintf(source, "    }\n");
+            }
+            fprintf(source, "    %s(v->items);\n", jipg_result_free());
+        } break;
+        case JIPG_KIND_UNION: {
+            fprintf(source, "    switch (v->%s) {\n", value->as_union.discriminator);
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next) {
+                if (!jipg_value_owns_memory(c->as_union_case.value)) continue;
+                const char *name = c->as_union_case.name;
+                JIPG_FORMAT(lval, "v->%s", name);
+                fprintf(source, "        case %s_%s:\n", struct_name, name);
+                jipg_emit_release_value(source, c->as_union_case.value, lval, "            ");
+                fprintf(source, "            break;\n");
+            }
+            fprintf(source,
+                    "        default:\n"
+                    "            break;\n"
+                    "    }\n");
+        } break;
+        case JIPG_KIND_MAP: {
+            fprintf(source,
+                    "    for (size_t i = 0; i < v->cap; ++i) {\n"
+                    "        if (!v->hashes[i]) continue;\n"
+                    "        %s(v->entries[i].key);\n",
+                    jipg_result_free());
+            jipg_emit_release_value(source, value->as_map.internal, "v->entries[i].value", "        ");
+            fprintf(source,
+                    "    }\n"
+                    "    %s(v->hashes);\n"
+                    "    %s(v->entries);\n",
+                    jipg_result_free(), jipg_result_free());
+        } break;
+        default:
+            UNREACHABLE();
+    }
+    fprintf(source, "}\n");
+}
+
+// Call sites are numbered as the states are emitted. The code that resumes
+// the caller when a frame is popped, and the cold code that names the site in
+// an error path, go to side buffers appended after the states.
+typedef struct {
+    FILE *resume;
+    FILE *unwind;
+    uint32_t call_count;
+    // Frames the deepest head needs, and so any value entered through a JIPG_REF.
+    size_t depth;
+    Jipg_Value **values;
+    size_t value_count;
+    // Emitting validate_frames(), whose frames hold no result.
+    bool validate;
+} Jipg_Frames;
+
+// The side buffers are tmpfile()s, the one temporary stream ISO C has; this
+// appends what was written to one to out and closes it.
+static void jipg_emit_side_buffer(FILE *out, FILE *side) {
+    rewind(side);
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), side)) > 0) fwrite(buf, 1, n, out);
+    JIPG_ASSERT(!ferror(side));
+    fclose(side);
+}
+
+// Pushes a frame for child, parsed into ptr unless validating, and jumps to
+// its entry label. unwind names the call site in error paths, with f being
+// the child's frame.
+static void jipg_emit_frame_call(FILE *source, Jipg_Frames *frames, const Jipg_Value *child, const char *entry,
+                                 const char *ptr, const char *resume, const char *unwind, const char *indent) {
+    uint32_t id = ++frames->call_count;
+    fprintf(source, "%s++f;\n", indent);
+    if (!frames->validate) fprintf(source, "%sf->res = %s;\n", indent, ptr);
+    fprintf(source,
+            "%sf->ret = %u;\n"
+            "%sgoto %s_%s;\n",
+            indent, id, indent, jipg_value_struct_name(child), entry);
+    fprintf(frames->resume,
+            "        case %u:\n"
+            "            --f;\n"
+            "            goto %s;\n",
+            id, resume);
+    if (unwind) {
+        fprintf(frames->unwind,
+                "            case %u: {\n"
+                "                %s\n"
+                "            } break;\n",
+                id, unwind);
+    }
+}
+
+// References recurse without a bound known to the generator. Before entering
+// one the stack is grown, if need be, to fit the deepest head above f. node is
+// the member pointer to allocate the node into, or NULL when ptr is in place.
+// Validation does not allocate, so there running out of frames fails instead.
+static void jipg_emit_ref_call(FILE *source, Jipg_Frames *frames, const Jipg_Value *ref, const char *node,
+                               const char *ptr, const char *resume, const char *unwind, const char *indent) {
+    if (frames->validate) {
+        fprintf(source,
+                "%sif ((size_t)(stack + sizeof(stack) / sizeof(*stack) - f) <= %zu) {\n"
+                "%s    fail_at(l, l->input + l->pos, \"nesting within %s levels\", \"deeper\");\n"
+                "%s    goto fail;\n"
+                "%s}\n",
+                indent, frames->depth, indent, STR(JIPG_VALIDATE_MAX_DEPTH), indent, indent);
+        jipg_emit_frame_call(source, frames, ref->as_ref.target, "enter", ptr, resume, unwind, indent);
+        return;
+    }
+    fprintf(source,
+            "%sif ((size_t)(stack + stack_cap - f) <= %zu) {\n"
+            "%s    Frame *grown = grow_frames(&stack, &stack_cap, f, inline_stack);\n"
+            "%s    if (!grown) {\n"
+            "%s        fail_at(l, l->input + l->pos, \"allocation\", \"out of memory\");\n"
+            "%s        goto fail;\n"
+            "%s    }\n"
+            "%s    f = grown;\n"
+            "%s}\n",
+            indent, frames->depth, indent, indent, indent, indent, indent, indent, indent);
+    if (node) {
+        fprintf(source,
+                "%sif (!%s) {\n"
+                "%s    %s = (%s *)alloc_node(sizeof(*%s));\n"
+                "%s    if (!%s) {\n"
+                "%s        fail_at(l, l->input + l->pos, \"allocation\", \"out of memory\");\n"
+                "%s        goto fail;\n"
+                "%s    }\n"
+                "%s}\n",
+                indent, node, indent, node, ref->as_ref.head, node, indent, node, indent, indent, indent, indent);
+    }
+    jipg_emit_frame_call(source, frames, ref->as_ref.target, "enter", ptr, resume, unwind, indent);
+}
+
+static void jipg_emit_stat_timer_start(FILE *source) {
+    if (jipg_global_context.instrument) fprintf(source, "    STAT_TIMER_START(f->start);\n");
+}
+
+static void jipg_emit_frame_done(FILE *source, const Jipg_Value *value) {
+    if (jipg_global_context.instrument) fprintf(source, "    STAT_TIMER_STOP(f->start, %zu);\n", value->stats_index);
+    fprintf(source, "    goto pop;\n");
+}
+
+static void jipg_emit_value_states(FILE *source, Jipg_Frames *frames, Jipg_Value *value);
+
+// With a --profile the member that most often follows another, if it does
+// more than half the time, is tried right after it: when the next key hashes
+// to it the switch is skipped and the case entered directly.
+static size_t jipg_profile_successor(const Jipg_Profile *profile, size_t from, size_t total) {
+    size_t n = profile->members, best = n;
+    for (size_t j = 0; j < n; ++j)
+        if (profile->follows[from * n + j] * 2 > total) best = j;
+    return best;
+}
+
+static void jipg_emit_key_guess(FILE *source, const char *struct_name, const Jipg_Value *object, size_t member) {
+    const Jipg_Value *kv = object->as_object.kv_head;
+    for (size_t i = 0; i < member; ++i) kv = kv->as_object_kv.next;
+    fprintf(source,
+            "    if (tok.type == TOKEN_TYPE_STRING && hash(&tok) == %lullu) {  // %s\n"
+            "        tok = next_token(l);\n"
+            "        if (tok.type != TOKEN_TYPE_COLON) {\n"
+            "            fail(l, &tok, \"':'\");\n"
+            "            goto fail;\n"
+            "        }\n"
+            "        goto %s_key%zu;\n"
+            "    }\n",
+            jipg_key_hash(kv->as_object_kv.key), kv->as_object_kv.key, struct_name, member);
+}
+
+// _start is entered with tok holding the token after '{', which is where union
+// parsers continue after having consumed the discriminator.
+static void jipg_emit_object_states(FILE *source, Jipg_Frames *frames, Jipg_Value *object) {
+    const char *struct_name = object->as_object.struct_name;
+    size_t seen_words = jipg_object_seen_words(object);
+    size_t member_count = jipg_object_member_count(object);
+
+    const Jipg_Profile *profile = jipg_value_profile_if_any(object);
+    if (profile && !profile->count) profile = NULL;
+
+    char res_decl[256];
+    JIPG_FORMAT(res_decl, "    %s *res = f->res;\n", struct_name);
+
+    fprintf(source,
+            "%s_enter: __attribute__((unused));\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_LBRACE) {\n"
+            "        fail(l, &tok, \"'{'\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    tok = next_token(l);\n"
+            "%s_start: __attribute__((unused));\n",
+            struct_name, struct_name);
+    jipg_emit_stat_timer_start(source);
+    for (size_t w = 0; w < seen_words; ++w) fprintf(source, "    f->seen[%zu] = 0;\n", w);
+    if (profile) {
+        size_t first = jipg_profile_successor(profile, member_count, profile->count);
+        if (first < member_count) jipg_emit_key_guess(source, struct_name, object, first);
+    }
+
+    // Guessed keys jump into the cases past the declarations of the member
+    // block, so when profiled each case loads res itself.
+    fprintf(source,
+            "%s_member: {\n"
+            "%s"
+            "    if (tok.type == TOKEN_TYPE_RBRACE) goto %s_done;\n"
+            "    if (tok.type != TOKEN_TYPE_STRING) {\n"
+            "        fail(l, &tok, \"string or '}'\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    uint64_t key_hash = hash(&tok);\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_COLON) {\n"
+            "        fail(l, &tok, \"':'\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    switch (key_hash) {\n",
+            struct_name, profile ? "" : res_decl, struct_name);
+
+    // merge_<Head>() records the members of the root object a patch sets.
+    bool head = false;
+    for (size_t i = 0; i < frames->value_count; ++i)
+        head |= jipg_value_struct_name(frames->values[i]) == struct_name;
+
+    // Members in schema order, with their required bit; profiled cases are
+    // emitted most frequent first.
+    Jipg_Value **members = JIPG_REALLOC(NULL, (member_count ? member_count : 1) * sizeof(*members));
+    size_t *required_bits = JIPG_REALLOC(NULL, (member_count ? member_count : 1) * sizeof(*required_bits));
+    size_t *order = JIPG_REALLOC(NULL, (member_count ? member_count : 1) * sizeof(*order));
+    JIPG_ASSERT(members && required_bits && order);
+
+    size_t required_bit = 0;
+    Jipg_Value *kv = object->as_object.kv_head;
+    for (size_t i = 0; kv; kv = kv->as_object_kv.next, ++i) {
+        members[i] = kv;
+        required_bits[i] = kv->as_object_kv.value->optional ? 0 : required_bit++;
+        order[i] = i;
+    }
+    for (size_t i = 1; profile && i < member_count; ++i) {
+        size_t m = order[i], j = i;
+        for (; j > 0 && profile->present[order[j - 1]] < profile->present[m]; --j) order[j] = order[j - 1];
+        order[j] = m;
+    }
+
+    for (size_t o = 0; o < member_count; ++o) {
+        size_t member = order[o];
+        kv = members[member];
+        const char *key = kv->as_object_kv.key;
+        const Jipg_Value *value = kv->as_object_kv.value;
+
+        char after[256], end[256];
+        JIPG_FORMAT(after, "%s_after", struct_name);
+        JIPG_FORMAT(end, "break;");
+        size_t next = profile ? jipg_profile_successor(profile, member, profile->present[member]) : member_count;
+        if (next < member_count) {
+            JIPG_FORMAT(after, "%s_after%zu", struct_name, member);
+            JIPG_FORMAT(end, "goto %s;", after);
+        }
+
+        if (profile) {
+            size_t present = profile->present[member];
+            const char *mark = present * 100 < profile->count ? ", cold" : present * 10 >= profile->count * 9 ? ", hot" : "";
+            fprintf(source,
+                    "        case %lullu: {  // %s: in %zu of %zu",
+                    jipg_key_hash(key), key, present, profile->count);
+            const Jipg_Profile *strings = jipg_value_profile_if_any(value);
+            if ((value->kind == JIPG_KIND_STRING || value->kind == JIPG_KIND_STRING_INTERNED) && strings &&
+                strings->count)
+                fprintf(source, ", 90%% within %zu bytes", jipg_profile_length_at(strings, 90));
+            fprintf(source,
+                    "\n"
+                    "        %s_key%zu: __attribute__((unused%s));\n"
+                    "            %s *res = f->res;\n",
+                    struct_name, member, mark, struct_name);
+        } else {
+            fprintf(source,
+                    "        case %lullu: {  // %s\n",
+                    jipg_key_hash(key), key);
+        }
+
+        if (jipg_global_context.instrument)
+            fprintf(source, "            STAT_INC(field_parses[%zu]);\n", kv->stats_index);
+        if (head)
+            fprintf(source, "            if (f == stack && changed) changed[%zu] |= (uint64_t)1 << %zu;\n",
+                    member / 64, member % 64);
+
+        if (!value->optional)
+            fprintf(source, "            f->seen[%zu] |= (uint64_t)1 << %zu;\n", required_bits[member] / 64,
+                    required_bits[member] % 64);
+
+        if (value->nullable) {
+            fprintf(source,
+                    "            Lexer save = *l;\n"
+                    "            if (next_token(l).type == TOKEN_TYPE_NULL) {\n"
+                    "                res->_present &= ~%s_HAS_%s;\n"
+                    "                %s\n"
+                    "            }\n"
+                    "            *l = save;\n",
+                    struct_name, key, end);
+        }
+
+        // A member parsed in its own frame is marked present before it is
+        // entered; a failure there fails the whole document anyway.
+        bool has_presence = value->optional || value->nullable;
+        if (jipg_value_has_frame(value) || value->kind == JIPG_KIND_REF) {
+            if (has_presence) fprintf(source, "            res->_present |= %s_HAS_%s;\n", struct_name, key);
+            char ptr[256], unwind[256];
+            JIPG_FORMAT(unwind, "fail_key(\"%s\", %zu);", key, strlen(key));
+            if (value->kind == JIPG_KIND_REF) {
+                JIPG_FORMAT(ptr, "res->%s", key);
+                jipg_emit_ref_call(source, frames, value, ptr, ptr, after, unwind, "            ");
+            } else {
+                JIPG_FORMAT(ptr, "&res->%s", key);
+                jipg_emit_frame_call(source, frames, value, "enter", ptr, after, unwind, "            ");
+            }
+            fprintf(source, "        }\n");
+            continue;
+        } else if (value->kind == JIPG_KIND_STRING) {
+            // Merging decodes into the string being replaced.
+            fprintf(source,
+                    "            if (!(changed ? merge_str(l, &res->%s) : parse_str(l, &res->%s))) {\n"
+                    "                fail_key(\"%s\", %zu);\n"
+                    "                goto fail;\n"
+                    "            }\n",
+                    key, key, key, strlen(key));
+        } else {
+            fprintf(source,
+                    "            if (!parse_%s(l, &res->%s)) {\n"
+                    "                fail_key(\"%s\", %zu);\n"
+                    "                goto fail;\n"
+                    "            }\n",
+                    jipg_value_name(value), key, key, strlen(key));
+        }
+        if (has_presence) fprintf(source, "            res->_present |= %s_HAS_%s;\n", struct_name, key);
+        if (next < member_count)
+            fprintf(source, "            %s\n        }\n", end);
+        else
+            fprintf(source, "        } break;\n");
+    }
+
+    fprintf(source,
+            "        default: {\n"
+            "%s"
+            "            if (!skip_value(l)) goto fail;\n"
+            "        } break;\n"
+            "    }\n"
+            "}\n"
+            "%s_after: __attribute__((unused));\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type == TOKEN_TYPE_COMMA)\n"
+            "        tok = next_token(l);\n"
+            "    goto %s_member;\n",
+            jipg_global_context.instrument ? "            STAT_INC(key_misses);\n" : "", struct_name, struct_name);
+
+    for (size_t member = 0; profile && member < member_count; ++member) {
+        size_t next = jipg_profile_successor(profile, member, profile->present[member]);
+        if (next == member_count) continue;
+        fprintf(source,
+                "%s_after%zu:\n"
+                "    tok = next_token(l);\n"
+                "    if (tok.type == TOKEN_TYPE_COMMA)\n"
+                "        tok = next_token(l);\n",
+                struct_name, member);
+        jipg_emit_key_guess(source, struct_name, object, next);
+        fprintf(source, "    goto %s_member;\n", struct_name);
+    }
+    fprintf(source, "%s_done:\n", struct_name);
+
+    JIPG_FREE(members);
+    JIPG_FREE(required_bits);
+    JIPG_FREE(order);
+
+    // All required members were seen: one mask compare per 64 members, and
+    // only when that fails a per member check to name the missing one. Patches
+    // merged into an existing value need not have them.
+    size_t required = required_bit;
+    for (size_t w = 0; w < seen_words; ++w) {
+        size_t bits = required - w * 64 < 64 ? required - w * 64 : 64;
+        uint64_t mask = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+        fprintf(source, "    if (f->seen[%zu] != %lullu && !changed) {\n", w, mask);
+
+        size_t bit = 0;
+        kv = object->as_object.kv_head;
+        for (; kv; kv = kv->as_object_kv.next) {
+            if (kv->as_object_kv.value->optional) continue;
+            if (bit / 64 == w)
+                fprintf(source,
+                        "        if (!(f->seen[%zu] & (uint64_t)1 << %zu))\n"
+                        "            fail(l, &tok, \"member \\\"%s\\\"\");\n",
+                        w, bit % 64, kv->as_object_kv.key);
+            ++bit;
+        }
+        fprintf(source,
+                "        goto fail;\n"
+                "    }\n");
+    }
+
+    jipg_emit_frame_done(source, object);
+}
+
+// When the discriminator is the first key the case members are parsed right
+// after it; otherwise the object is scanned for it and parsed again from '{'.
+static void jipg_emit_union_states(FILE *source, Jipg_Frames *frames, Jipg_Value *u) {
+    const char *struct_name = u->as_union.struct_name;
+    const char *discriminator = u->as_union.discriminator;
+
+    fprintf(source,
+            "%s_enter: {\n"
+            "    %s *res = f->res;\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_LBRACE) {\n"
+            "        fail(l, &tok, \"'{'\");\n"
+            "        goto fail;\n"
+            "    }\n",
+            struct_name, struct_name);
+    jipg_emit_stat_timer_start(source);
+    fprintf(source,
+            "    Lexer start = *l;\n"
+            "    Token tag;\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type == TOKEN_TYPE_STRING && hash(&tok) == %lullu) {  // %s\n"
+            "        tok = next_token(l);\n"
+            "        if (tok.type != TOKEN_TYPE_COLON) {\n"
+            "            fail(l, &tok, \"':'\");\n"
+            "            goto fail;\n"
+            "        }\n"
+            "        tag = next_token(l);\n"
+            "        if (tag.type != TOKEN_TYPE_STRING) {\n"
+            "            fail(l, &tag, \"string\");\n"
+            "            goto fail;\n"
+            "        }\n"
+            "        tok = next_token(l);\n"
+            "        if (tok.type == TOKEN_TYPE_COMMA)\n"
+            "            tok = next_token(l);\n"
+            "    } else {\n"
+            "        *l = start;\n"
+            "        if (!find_key(l, %lullu, &tag)) goto fail;\n"
+            "        if (tag.type != TOKEN_TYPE_STRING) {\n"
+            "            fail(l, &tag, \"string\");\n"
+            "            goto fail;\n"
+            "        }\n"
+            "        *l = start;\n"
+            "        tok = next_token(l);\n"
+            "    }\n"
+            "    switch (hash(&tag)) {\n",
+            jipg_key_hash(discriminator), discriminator, jipg_key_hash(discriminator));
+
+    char done[256];
+    JIPG_FORMAT(done, "%s_done", struct_name);
+
+    Jipg_Value *c = u->as_union.case_head;
+    for (; c; c = c->as_union_case.next) {
+        const char *tag = c->as_union_case.tag;
+        const char *name = c->as_union_case.name;
+        // A merge that switches the case releases the old one and starts the
+        // new one from zero.
+        fprintf(source,
+                "        case %lullu: {  // %s\n"
+                "            if (changed && res->%s != %s_%s) {\n",
+                jipg_key_hash(tag), tag, discriminator, struct_name, name);
+        jipg_emit_release_value(source, u, "*res", "                ");
+        fprintf(source,
+                "                memset(&res->%s, 0, sizeof(res->%s));\n"
+                "            }\n"
+                "            res->%s = %s_%s;\n",
+                name, name, discriminator, struct_name, name);
+        char ptr[256];
+        JIPG_FORMAT(ptr, "&res->%s", name);
+        jipg_emit_frame_call(source, frames, c->as_union_case.value, "start", ptr, done, NULL, "            ");
+        fprintf(source, "        }\n");
+    }
+
+    fprintf(source,
+            "        default:\n"
+            "            fail(l, &tag, \"one of");
+    c = u->as_union.case_head;
+    for (; c; c = c->as_union_case.next)
+        fprintf(source, "%s \\\"%s\\\"", c == u->as_union.case_head ? "" : ",", c->as_union_case.tag);
+    fprintf(source,
+            "\");\n"
+            "            goto fail;\n"
+            "    }\n"
+            "}\n"
+            "%s:\n",
+            done);
+
+    jipg_emit_frame_done(source, u);
+}
+
+// Merged arrays are replaced. Their items are parsed over the old ones, which
+// stay counted in len until the array ends, so that a failed merge leaves
+// nothing unreleased; leaf strings decode into the old strings.
+static void jipg_emit_array_states(FILE *source, Jipg_Frames *frames, Jipg_Value *array) {
+    const char *struct_name = array->as_array.struct_name;
+    Jipg_Value *internal = array->as_array.internal;
+
+    fprintf(source,
+            "%s_enter:\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_LBRACKET) {\n"
+            "        fail(l, &tok, \"'['\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    f->count = 0;\n",
+            struct_name);
+    jipg_emit_stat_timer_start(source);
+    fprintf(source,
+            "%s_next: {\n"
+            "    %s *res = f->res;\n"
+            "    Lexer save = *l;\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type == TOKEN_TYPE_RBRACKET) goto %s_done;\n"
+            "    if (tok.type != TOKEN_TYPE_COMMA) *l = save;\n",
+            struct_name, struct_name, struct_name);
+
+    // Items parsed in a frame are filled in member by member and start zeroed.
+    // Items behind a JIPG_REF are stored inline, like their target.
+    bool in_frame = jipg_value_has_frame(internal) || internal->kind == JIPG_KIND_REF;
+    const Jipg_Value *item = internal->kind == JIPG_KIND_REF ? internal->as_ref.target : internal;
+
+    if (array->as_array.cap) {
+        size_t cap = array->as_array.cap;
+        fprintf(source,
+                "    if (res->len == 0) {\n"
+                "        res->items = %s(res->items, %zu * sizeof(*res->items));\n"
+                "        if (res->items == NULL) {\n"
+                "            fail_at(l, l->input + l->pos, \"allocation\", \"out of memory\");\n"
+                "            goto fail;\n"
+                "        }\n",
+                jipg_result_realloc(), cap);
+        if (in_frame) fprintf(source, "        memset(res->items, 0, %zu * sizeof(*res->items));\n", cap);
+        fprintf(source,
+                "    }\n"
+                "    if (f->count == %zu) {\n"
+                "        fail_at(l, l->input + l->pos, \"at most %zu items\", \"more\");\n"
+                "        goto fail;\n"
+                "    }\n",
+                cap, cap);
+    } else {
+        int init_cap = (int)jipg_array_init_cap(array);
+        fprintf(source,
+                "    if (f->count == res->len && (res->len == 0 || (res->len >= %d && (res->len & (res->len - 1)) == 0))) {\n"
+                "        size_t new_cap = res->len ? res->len * 2 : %d;\n"
+                "        res->items = %s(res->items, new_cap * sizeof(*res->items));\n"
+                "        if (res->items == NULL) {\n"
+                "            fail_at(l, l->input + l->pos, \"allocation\", \"out of memory\");\n"
+                "            goto fail;\n"
+                "        }\n"
+                "%s"
+                "%s"
+                "    }\n",
+                init_cap, init_cap, jipg_result_realloc(),
+                in_frame ? "        memset(res->items + res->len, 0, (new_cap - res->len) * sizeof(*res->items));\n" : "",
+                jipg_global_context.instrument ? "        STAT_INC(array_reallocs);\n" : "");
+    }
+
+    char next[256];
+    JIPG_FORMAT(next, "%s_next", struct_name);
+
+    if (in_frame) {
+        // An old item is emptied, so the new one starts from zero too.
+        fprintf(source,
+                "    %s *item = res->items + f->count++;\n"
+                "    if (f->count > res->len) {\n"
+                "        res->len = f->count;\n"
+                "    } else {\n",
+                jipg_value_struct_name(item));
+        jipg_emit_release_value(source, item, "*item", "        ");
+        fprintf(source,
+                "        memset(item, 0, sizeof(*item));\n"
+                "    }\n");
+        const char *unwind = "fail_index(f[-1].count - 1);";
+        if (internal->kind == JIPG_KIND_REF)
+            jipg_emit_ref_call(source, frames, internal, NULL, "item", next, unwind, "    ");
+        else
+            jipg_emit_frame_call(source, frames, internal, "enter", "item", next, unwind, "    ");
+    } else {
+        // Leaf items are counted once parsed, so that a failed one, which
+        // may be uninitialized memory, is never released.
+        if (internal->kind == JIPG_KIND_STRING) {
+            fprintf(source,
+                    "    char **item = res->items + f->count;\n"
+                    "    if (!(f->count < res->len ? merge_str(l, item) : parse_str(l, item))) {\n");
+        } else {
+            fprintf(source, "    if (!parse_%s(l, res->items + f->count)) {\n", jipg_value_name(internal));
+        }
+        fprintf(source,
+                "        fail_index(f->count);\n"
+                "        goto fail;\n"
+                "    }\n"
+                "    if (++f->count > res->len) res->len = f->count;\n"
+                "    goto %s;\n",
+                next);
+    }
+    fprintf(source,
+            "}\n"
+            "%s_done: {\n"
+            "    %s *res = f->res;\n",
+            struct_name, struct_name);
+    if (jipg_value_owns_memory(item)) {
+        fprintf(source, "    for (size_t i = f->count; i < res->len; ++i) {\n");
+        jipg_emit_release_value(source, item, "res->items[i]", "        ");
+        fprintf(source, "    }\n");
+    }
+    // Items past len are kept zeroed for the next merge to fill in.
+    if (in_frame)
+        fprintf(source,
+                "    if (f->count < res->len)\n"
+                "        memset(res->items + f->count, 0, (res->len - f->count) * sizeof(*res->items));\n");
+    fprintf(source,
+            "    res->len = f->count;\n"
+            "}\n");
+
+    jipg_emit_frame_done(source, array);
+}
+
+// The table is sized once from a pre-count of the object's members, keeping
+// the load factor at or below one half.
+static void jipg_emit_map_states(FILE *source, Jipg_Frames *frames, Jipg_Value *map) {
+    const char *struct_name = map->as_map.struct_name;
+    Jipg_Value *internal = map->as_map.internal;
+
+    fprintf(source,
+            "%s_enter: {\n"
+            "    %s *res = f->res;\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_LBRACE) {\n"
+            "        fail(l, &tok, \"'{'\");\n"
+            "        goto fail;\n"
+            "    }\n",
+            struct_name, struct_name);
+    jipg_emit_stat_timer_start(source);
+    fprintf(source,
+            "    Lexer start = *l;\n"
+            "    size_t count = res->len;\n"
+            "    if (!count_members(l, &count)) goto fail;\n"
+            "    if (!%s_reserve(res, res->len + count)) {\n"
+            "        fail_at(l, tok.lit, \"allocation\", \"out of memory\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    *l = start;\n"
+            "    tok = next_token(l);\n"
+            "}\n"
+            "%s_member: {\n"
+            "    %s *res = f->res;\n"
+            "    if (tok.type == TOKEN_TYPE_RBRACE) goto %s_done;\n"
+            "    if (tok.type != TOKEN_TYPE_STRING) {\n"
+            "        fail(l, &tok, \"string or '}'\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    const char *key = tok.lit;\n"
+            "    size_t key_len = tok.len;\n"
+            "    char *copy = NULL;\n"
+            "    if (tok.escaped) {\n"
+            "        key = copy = copy_string(&tok, &key_len);\n"
+            "        if (!copy) {\n"
+            "            fail(l, &tok, \"valid string\");\n"
+            "            goto fail;\n"
+            "        }\n"
+            "    }\n"
+            "    uint64_t h = copy ? hash_bytes(key, key_len) : hash(&tok);\n"
+            "    size_t i = %s_slot(res, h, key, key_len);\n"
+            "    %s_Entry *entry = res->entries + i;\n"
+            "    if (!res->hashes[i]) {\n"
+            "        entry->key = copy ? copy : copy_string(&tok, &key_len);\n"
+            "        if (!entry->key) {\n"
+            "            fail_at(l, tok.lit, \"allocation\", \"out of memory\");\n"
+            "            goto fail;\n"
+            "        }\n"
+            "        entry->key_len = key_len;\n"
+            "        memset(&entry->value, 0, sizeof(entry->value));\n"
+            "        res->hashes[i] = h;\n"
+            "        ++res->len;\n"
+            "    } else {\n"
+            "        %s(copy);\n",
+            struct_name, struct_name, struct_name, struct_name, struct_name, struct_name, jipg_result_free());
+    // A repeated key, or one a merge replaces, releases the old value first;
+    // strings decode into the old one instead.
+    if (internal->kind == JIPG_KIND_REF) {
+        const Jipg_Value *target = internal->as_ref.target;
+        if (jipg_value_owns_memory(target)) {
+            fprintf(source,
+                    "        if (entry->value) {\n"
+                    "            release_%s(entry->value);\n"
+                    "            memset(entry->value, 0, sizeof(*entry->value));\n"
+                    "        }\n",
+                    jipg_value_struct_name(target));
+        } else {
+            fprintf(source, "        if (entry->value) memset(entry->value, 0, sizeof(*entry->value));\n");
+        }
+    } else if (jipg_value_has_frame(internal)) {
+        jipg_emit_release_value(source, internal, "entry->value", "        ");
+        fprintf(source, "        memset(&entry->value, 0, sizeof(entry->value));\n");
+    }
+    fprintf(source,
+            "    }\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_COLON) {\n"
+            "        fail(l, &tok, \"':'\");\n"
+            "        goto fail;\n"
+            "    }\n");
+
+    char after[256];
+    JIPG_FORMAT(after, "%s_after", struct_name);
+
+    if (jipg_value_has_frame(internal)) {
+        char unwind[256];
+        JIPG_FORMAT(unwind,
+                    "%s_Entry *e = (%s_Entry *)((char *)f->res - offsetof(%s_Entry, value));\n"
+                    "                fail_key(e->key, e->key_len);",
+                    struct_name, struct_name, struct_name);
+        jipg_emit_frame_call(source, frames, internal, "enter", "&entry->value", after, unwind, "    ");
+    } else if (internal->kind == JIPG_KIND_REF) {
+        // The frame only has the node; its entry is found by a scan, which is
+        // fine on the error path.
+        char unwind[512];
+        JIPG_FORMAT(unwind,
+                    "%s *map = f[-1].res;\n"
+                    "                for (size_t i = 0; i < map->cap; ++i) {\n"
+                    "                    if (map->hashes[i] && map->entries[i].value == f->res) {\n"
+                    "                        fail_key(map->entries[i].key, map->entries[i].key_len);\n"
+                    "                        break;\n"
+                    "                    }\n"
+                    "                }",
+                    struct_name);
+        jipg_emit_ref_call(source, frames, internal, "entry->value", "entry->value", after, unwind, "    ");
+    } else if (internal->kind == JIPG_KIND_STRING) {
+        fprintf(source,
+                "    if (!merge_str(l, &entry->value)) {\n"
+                "        fail_key(entry->key, entry->key_len);\n"
+                "        goto fail;\n"
+                "    }\n");
+    } else {
+        fprintf(source,
+                "    if (!parse_%s(l, &entry->value)) {\n"
+                "        fail_key(entry->key, entry->key_len);\n"
+                "        goto fail;\n"
+                "    }\n",
+                jipg_value_name(internal));
+    }
+    fprintf(source,
+            "}\n"
+            "%s: __attribute__((unused));\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type == TOKEN_TYPE_COMMA)\n"
+            "        tok = next_token(l);\n"
+            "    goto %s_member;\n"
+            "%s_done:\n",
+            after, struct_name, struct_name);
+
+    jipg_emit_frame_done(source, map);
+}
+
+static void jipg_emit_value_states(FILE *source, Jipg_Frames *frames, Jipg_Value *value) {
+    if (value->shared) return;
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                jipg_emit_value_states(source, frames, kv->as_object_kv.value);
+            jipg_emit_object_states(source, frames, value);
+        } break;
+        case JIPG_KIND_ARRAY: {
+            jipg_emit_value_states(source, frames, value->as_array.internal);
+            jipg_emit_array_states(source, frames, value);
+        } break;
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_emit_value_states(source, frames, c->as_union_case.value);
+            jipg_emit_union_states(source, frames, value);
+        } break;
+        case JIPG_KIND_MAP: {
+            jipg_emit_value_states(source, frames, value->as_map.internal);
+            jipg_emit_map_states(source, frames, value);
+        } break;
+        default: {
+        }
+    }
+}
+
+// Head i enters the state machine with entry i. Without references the schema
+// bounds the nesting, so the stack is a fixed array of frames. With them it
+// starts out on the native stack and moves to the heap when it runs out.
+static void jipg_emit_frames_parser(FILE *source, Jipg_Value **values, size_t value_count) {
+    size_t depth = 0, seen_words = 0;
+    bool recursive = false, arrays = false;
+    for (size_t i = 0; i < value_count; ++i) {
+        size_t d = jipg_value_frame_depth(values[i], &seen_words);
+        if (d > depth) depth = d;
+        recursive |= jipg_value_uses_kind(values[i], JIPG_KIND_REF);
+        arrays |= jipg_value_uses_kind(values[i], JIPG_KIND_ARRAY);
+    }
+    if (depth == 0) return;
+
+    fprintf(source,
+            "typedef struct {\n"
+            "    void *res;\n"
+            "    uint32_t ret;\n");
+    if (seen_words) fprintf(source, "    uint64_t seen[%zu];\n", seen_words);
+    if (arrays) {
+        fprintf(source,
+                "    // Items of the array parsed so far; while merging, len still counts\n"
+                "    // the old items past them.\n"
+                "    size_t count;\n");
+    }
+    if (jipg_global_context.instrument) {
+        fprintf(source,
+                "#ifdef JIPG_INSTRUMENT\n"
+                "    uint64_t start;\n"
+                "#endif\n");
+    }
+    fprintf(source, "} Frame;\n");
+
+    size_t inline_cap = depth < 16 ? 32 : 2 * depth;
+    if (recursive) {
+        fprintf(source,
+                "static Frame *grow_frames(Frame **stack, size_t *cap, Frame *f, Frame *inline_stack) {\n"
+                "    size_t new_cap = *cap * 2;\n"
+                "    Frame *frames = (Frame *)JIPG_REALLOC(*stack == inline_stack ? NULL : *stack, new_cap * sizeof(Frame));\n"
+                "    if (!frames) return NULL;\n"
+                "    if (*stack == inline_stack) memcpy(frames, inline_stack, *cap * sizeof(Frame));\n"
+                "    f = frames + (f - *stack);\n"
+                "    *stack = frames;\n"
+                "    *cap = new_cap;\n"
+                "    return f;\n"
+                "}\n");
+        fprintf(source,
+                "static bool parse_frames(Lexer *l, void *root, uint32_t entry, uint64_t *changed) {\n"
+                "    Frame inline_stack[%zu];\n"
+                "    Frame *stack = inline_stack;\n"
+                "    size_t stack_cap = %zu;\n",
+                inline_cap, inline_cap);
+    } else {
+        fprintf(source,
+                "static bool parse_frames(Lexer *l, void *root, uint32_t entry, uint64_t *changed) {\n"
+                "    Frame stack[%zu];\n",
+                depth);
+    }
+    fprintf(source,
+            "    Frame *f = stack;\n"
+            "    Token tok = {0};\n"
+            "    f->res = root;\n"
+            "    f->ret = 0;\n"
+            "    switch (entry) {\n");
+    for (size_t i = 0; i < value_count; ++i) {
+        if (!jipg_value_has_frame(values[i])) continue;
+        fprintf(source,
+                "        case %zu:\n"
+                "            goto %s_enter;\n",
+                i, jipg_value_struct_name(values[i]));
+    }
+    // The items of array heads, for parse_<Head>_each().
+    for (size_t i = 0; i < value_count; ++i) {
+        if (values[i]->kind != JIPG_KIND_ARRAY || !jipg_value_has_frame(values[i]->as_array.internal)) continue;
+        fprintf(source,
+                "        case %zu:\n"
+                "            goto %s_enter;\n",
+                value_count + i, jipg_value_struct_name(values[i]->as_array.internal));
+    }
+    fprintf(source,
+            "        default:\n"
+            "            return false;\n"
+            "    }\n");
+
+    Jipg_Frames frames = {.depth = depth, .values = values, .value_count = value_count};
+    frames.resume = tmpfile();
+    frames.unwind = tmpfile();
+    JIPG_ASSERT(frames.resume && frames.unwind);
+
+    for (size_t i = 0; i < value_count; ++i)
+        jipg_emit_value_states(source, &frames, values[i]);
+
+    char release[64] = "";
+    if (recursive) JIPG_FORMAT(release, "if (stack != inline_stack) JIPG_FREE(stack);\n");
+    fprintf(source,
+            "pop:\n"
+            "    switch (f->ret) {\n"
+            "        case 0:\n"
+            "%s%s"
+            "            return true;\n",
+            recursive ? "            " : "", release);
+    jipg_emit_side_buffer(source, frames.resume);
+    fprintf(source,
+            "    }\n"
+            "fail:\n"
+            "    for (; f > stack; --f) {\n"
+            "        switch (f->ret) {\n");
+    jipg_emit_side_buffer(source, frames.unwind);
+    fprintf(source,
+            "            default:\n"
+            "                break;\n"
+            "        }\n"
+            "    }\n"
+            "%s%s"
+            "    return false;\n"
+            "}\n",
+            recursive ? "    " : "", release);
+}
+
+// validate_<Head>() runs the same kind of state machine as parse_frames(), in
+// validate_frames(), but its frames only hold what checking needs: the
+// required members seen, the items of an array so far and the key of a map
+// entry, for error paths. Leaves go through the check_ helpers, and nothing
+// is allocated or written outside the stack.
+static const char *jipg_check_name(const Jipg_Value *value) {
+    return value->kind == JIPG_KIND_STRING_INTERNED ? "str" : jipg_value_name(value);
+}
+
+static void jipg_emit_object_checks(FILE *source, Jipg_Frames *frames, Jipg_Value *object) {
     const char *struct_name = object->as_object.struct_name;
+    size_t seen_words = jipg_object_seen_words(object);
+
+    fprintf(source,
+            "%s_enter: __attribute__((unused));\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_LBRACE) {\n"
+            "        fail(l, &tok, \"'{'\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    tok = next_token(l);\n"
+            "%s_start: __attribute__((unused));\n",
+            struct_name, struct_name);
+    for (size_t w = 0; w < seen_words; ++w) fprintf(source, "    f->seen[%zu] = 0;\n", w);
+    fprintf(source,
+            "%s_member: {\n"
+            "    if (tok.type == TOKEN_TYPE_RBRACE) goto %s_done;\n"
+            "    if (tok.type != TOKEN_TYPE_STRING) {\n"
+            "        fail(l, &tok, \"string or '}'\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    uint64_t key_hash = hash(&tok);\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_COLON) {\n"
+            "        fail(l, &tok, \"':'\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    switch (key_hash) {\n",
+            struct_name, struct_name);
+
+    char after[256];
+    JIPG_FORMAT(after, "%s_after", struct_name);
+
+    size_t required_bit = 0;
+    Jipg_Value *kv = object->as_object.kv_head;
+    for (; kv; kv = kv->as_object_kv.next) {
+        const char *key = kv->as_object_kv.key;
+        const Jipg_Value *value = kv->as_object_kv.value;
+        fprintf(source,
+                "        case %lullu: {  // %s\n",
+                jipg_key_hash(key), key);
+        if (!value->optional) {
+            fprintf(source, "            f->seen[%zu] |= (uint64_t)1 << %zu;\n", required_bit / 64, required_bit % 64);
+            ++required_bit;
+        }
+        if (value->nullable) {
+            fprintf(source,
+                    "            Lexer save = *l;\n"
+                    "            if (next_token(l).type == TOKEN_TYPE_NULL) break;\n"
+                    "            *l = save;\n");
+        }
+
+        char unwind[256];
+        JIPG_FORMAT(unwind, "fail_key(\"%s\", %zu);", key, strlen(key));
+        if (value->kind == JIPG_KIND_REF) {
+            jipg_emit_ref_call(source, frames, value, NULL, NULL, after, unwind, "            ");
+            fprintf(source, "        }\n");
+        } else if (jipg_value_has_frame(value)) {
+            jipg_emit_frame_call(source, frames, value, "enter", NULL, after, unwind, "            ");
+            fprintf(source, "        }\n");
+        } else {
+            fprintf(source,
+                    "            if (!check_%s(l)) {\n"
+                    "                fail_key(\"%s\", %zu);\n"
+                    "                goto fail;\n"
+                    "            }\n"
+                    "        } break;\n",
+                    jipg_check_name(value), key, strlen(key));
+        }
+    }
+
+    fprintf(source,
+            "        default: {\n"
+            "            if (!skip_value(l)) goto fail;\n"
+            "        } break;\n"
+            "    }\n"
+            "}\n"
+            "%s: __attribute__((unused));\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type == TOKEN_TYPE_COMMA)\n"
+            "        tok = next_token(l);\n"
+            "    goto %s_member;\n"
+            "%s_done:\n",
+            after, struct_name, struct_name);
+
+    for (size_t w = 0; w < seen_words; ++w) {
+        size_t bits = required_bit - w * 64 < 64 ? required_bit - w * 64 : 64;
+        uint64_t mask = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+        fprintf(source, "    if (f->seen[%zu] != %lullu) {\n", w, mask);
+
+        size_t bit = 0;
+        kv = object->as_object.kv_head;
+        for (; kv; kv = kv->as_object_kv.next) {
+            if (kv->as_object_kv.value->optional) continue;
+            if (bit / 64 == w)
+                fprintf(source,
+                        "        if (!(f->seen[%zu] & (uint64_t)1 << %zu))\n"
+                        "            fail(l, &tok, \"member \\\"%s\\\"\");\n",
+                        w, bit % 64, kv->as_object_kv.key);
+            ++bit;
+        }
+        fprintf(source,
+                "        goto fail;\n"
+                "    }\n");
+    }
+    fprintf(source, "    goto pop;\n");
+}
+
+static void jipg_emit_union_checks(FILE *source, Jipg_Frames *frames, Jipg_Value *u) {
+    const char *struct_name = u->as_union.struct_name;
+    const char *discriminator = u->as_union.discriminator;
+
+    fprintf(source,
+            "%s_enter: {\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_LBRACE) {\n"
+            "        fail(l, &tok, \"'{'\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    Lexer start = *l;\n"
+            "    Token tag;\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type == TOKEN_TYPE_STRING && hash(&tok) == %lullu) {  // %s\n"
+            "        tok = next_token(l);\n"
+            "        if (tok.type != TOKEN_TYPE_COLON) {\n"
+            "            fail(l, &tok, \"':'\");\n"
+            "            goto fail;\n"
+            "        }\n"
+            "        tag = next_token(l);\n"
+            "        if (tag.type != TOKEN_TYPE_STRING) {\n"
+            "            fail(l, &tag, \"string\");\n"
+            "            goto fail;\n"
+            "        }\n"
+            "        tok = next_token(l);\n"
+            "        if (tok.type == TOKEN_TYPE_COMMA)\n"
+            "            tok = next_token(l);\n"
+            "    } else {\n"
+            "        *l = start;\n"
+            "        if (!find_key(l, %lullu, &tag)) goto fail;\n"
+            "        if (tag.type != TOKEN_TYPE_STRING) {\n"
+            "            fail(l, &tag, \"string\");\n"
+            "            goto fail;\n"
+            "        }\n"
+            "        *l = start;\n"
+            "        tok = next_token(l);\n"
+            "    }\n"
+            "    switch (hash(&tag)) {\n",
+            struct_name, jipg_key_hash(discriminator), discriminator, jipg_key_hash(discriminator));
+
+    char done[256];
+    JIPG_FORMAT(done, "%s_done", struct_name);
+
+    Jipg_Value *c = u->as_union.case_head;
+    for (; c; c = c->as_union_case.next) {
+        fprintf(source,
+                "        case %lullu: {  // %s\n",
+                jipg_key_hash(c->as_union_case.tag), c->as_union_case.tag);
+        jipg_emit_frame_call(source, frames, c->as_union_case.value, "start", NULL, done, NULL, "            ");
+        fprintf(source, "        }\n");
+    }
+
+    fprintf(source,
+            "        default:\n"
+            "            fail(l, &tag, \"one of");
+    c = u->as_union.case_head;
+    for (; c; c = c->as_union_case.next)
+        fprintf(source, "%s \\\"%s\\\"", c == u->as_union.case_head ? "" : ",", c->as_union_case.tag);
+    fprintf(source,
+            "\");\n"
+            "            goto fail;\n"
+            "    }\n"
+            "}\n"
+            "%s:\n"
+            "    goto pop;\n",
+            done);
+}
+
+static void jipg_emit_array_checks(FILE *source, Jipg_Frames *frames, Jipg_Value *array) {
+    const char *struct_name = array->as_array.struct_name;
+    Jipg_Value *internal = array->as_array.internal;
+
+    fprintf(source,
+            "%s_enter:\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_LBRACKET) {\n"
+            "        fail(l, &tok, \"'['\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    f->len = 0;\n"
+            "%s_next: {\n"
+            "    Lexer save = *l;\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type == TOKEN_TYPE_RBRACKET) goto %s_done;\n"
+            "    if (tok.type != TOKEN_TYPE_COMMA) *l = save;\n",
+            struct_name, struct_name, struct_name);
+    if (array->as_array.cap) {
+        fprintf(source,
+                "    if (f->len == %zu) {\n"
+                "        fail_at(l, l->input + l->pos, \"at most %zu items\", \"more\");\n"
+                "        goto fail;\n"
+                "    }\n",
+                array->as_array.cap, array->as_array.cap);
+    }
+    fprintf(source, "    ++f->len;\n");
+
+    char next[256];
+    JIPG_FORMAT(next, "%s_next", struct_name);
+
+    if (internal->kind == JIPG_KIND_REF) {
+        jipg_emit_ref_call(source, frames, internal, NULL, NULL, next, "fail_index(f[-1].len - 1);", "    ");
+    } else if (jipg_value_has_frame(internal)) {
+        jipg_emit_frame_call(source, frames, internal, "enter", NULL, next, "fail_index(f[-1].len - 1);", "    ");
+    } else {
+        fprintf(source,
+                "    if (!check_%s(l)) {\n"
+                "        fail_index(f->len - 1);\n"
+                "        goto fail;\n"
+                "    }\n"
+                "    goto %s;\n",
+                jipg_check_name(internal), next);
+    }
+    fprintf(source,
+            "}\n"
+            "%s_done:\n"
+            "    goto pop;\n",
+            struct_name);
+}
+
+static void jipg_emit_map_checks(FILE *source, Jipg_Frames *frames, Jipg_Value *map) {
+    const char *struct_name = map->as_map.struct_name;
+    Jipg_Value *internal = map->as_map.internal;
+
+    fprintf(source,
+            "%s_enter:\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_LBRACE) {\n"
+            "        fail(l, &tok, \"'{'\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    tok = next_token(l);\n"
+            "%s_member: {\n"
+            "    if (tok.type == TOKEN_TYPE_RBRACE) goto %s_done;\n"
+            "    if (tok.type != TOKEN_TYPE_STRING) {\n"
+            "        fail(l, &tok, \"string or '}'\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    if (tok.escaped && !valid_string(&tok)) {\n"
+            "        fail(l, &tok, \"valid string\");\n"
+            "        goto fail;\n"
+            "    }\n"
+            "    f->key = tok.lit;\n"
+            "    f->len = tok.len;\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type != TOKEN_TYPE_COLON) {\n"
+            "        fail(l, &tok, \"':'\");\n"
+            "        goto fail;\n"
+            "    }\n",
+            struct_name, struct_name, struct_name);
+
+    char after[256];
+    JIPG_FORMAT(after, "%s_after", struct_name);
+
+    if (internal->kind == JIPG_KIND_REF) {
+        jipg_emit_ref_call(source, frames, internal, NULL, NULL, after, "fail_key(f[-1].key, f[-1].len);", "    ");
+    } else if (jipg_value_has_frame(internal)) {
+        jipg_emit_frame_call(source, frames, internal, "enter", NULL, after, "fail_key(f[-1].key, f[-1].len);",
+                             "    ");
+    } else {
+        fprintf(source,
+                "    if (!check_%s(l)) {\n"
+                "        fail_key(f->key, f->len);\n"
+                "        goto fail;\n"
+                "    }\n",
+                jipg_check_name(internal));
+    }
+    fprintf(source,
+            "}\n"
+            "%s: __attribute__((unused));\n"
+            "    tok = next_token(l);\n"
+            "    if (tok.type == TOKEN_TYPE_COMMA)\n"
+            "        tok = next_token(l);\n"
+            "    goto %s_member;\n"
+            "%s_done:\n"
+            "    goto pop;\n",
+            after, struct_name, struct_name);
+}
+
+static void jipg_emit_value_checks(FILE *source, Jipg_Frames *frames, Jipg_Value *value) {
+    if (value->shared) return;
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                jipg_emit_value_checks(source, frames, kv->as_object_kv.value);
+            jipg_emit_object_checks(source, frames, value);
+        } break;
+        case JIPG_KIND_ARRAY: {
+            jipg_emit_value_checks(source, frames, value->as_array.internal);
+            jipg_emit_array_checks(source, frames, value);
+        } break;
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_emit_value_checks(source, frames, c->as_union_case.value);
+            jipg_emit_union_checks(source, frames, value);
+        } break;
+        case JIPG_KIND_MAP: {
+            jipg_emit_value_checks(source, frames, value->as_map.internal);
+            jipg_emit_map_checks(source, frames, value);
+        } break;
+        default: {
+        }
+    }
+}
+
+// Entries are those of parse_frames(). Without references the stack is the
+// schema's depth; with them it is JIPG_VALIDATE_MAX_DEPTH frames.
+static void jipg_emit_check_frames(FILE *source, Jipg_Value **values, size_t value_count) {
+    size_t depth = 0, seen_words = 0;
+    bool recursive = false;
+    for (size_t i = 0; i < value_count; ++i) {
+        size_t d = jipg_value_frame_depth(values[i], &seen_words);
+        if (d > depth) depth = d;
+        recursive |= jipg_value_uses_kind(values[i], JIPG_KIND_REF);
+    }
+    if (depth == 0) return;
+
+    fprintf(source,
+            "typedef struct {\n"
+            "    uint32_t ret;\n"
+            "    size_t len;\n"
+            "    const char *key;\n");
+    if (seen_words) fprintf(source, "    uint64_t seen[%zu];\n", seen_words);
+    fprintf(source,
+            "} Check_Frame;\n"
+            "static bool validate_frames(Lexer *l, uint32_t entry) {\n"
+            "    Check_Frame stack[%zu];\n"
+            "    Check_Frame *f = stack;\n"
+            "    Token tok = {0};\n"
+            "    f->ret = 0;\n"
+            "    switch (entry) {\n",
+            recursive && depth < JIPG_VALIDATE_MAX_DEPTH ? (size_t)JIPG_VALIDATE_MAX_DEPTH : depth);
+    for (size_t i = 0; i < value_count; ++i) {
+        if (!jipg_value_has_frame(values[i])) continue;
+        fprintf(source,
+                "        case %zu:\n"
+                "            goto %s_enter;\n",
+                i, jipg_value_struct_name(values[i]));
+    }
+    fprintf(source,
+            "        default:\n"
+            "            return false;\n"
+            "    }\n");
+
+    Jipg_Frames frames = {.depth = depth, .values = values, .value_count = value_count, .validate = true};
+    frames.resume = tmpfile();
+    frames.unwind = tmpfile();
+    JIPG_ASSERT(frames.resume && frames.unwind);
+
+    for (size_t i = 0; i < value_count; ++i)
+        jipg_emit_value_checks(source, &frames, values[i]);
+
+    fprintf(source,
+            "pop:\n"
+            "    switch (f->ret) {\n"
+            "        case 0:\n"
+            "            return true;\n");
+    jipg_emit_side_buffer(source, frames.resume);
+    fprintf(source,
+            "    }\n"
+            "fail:\n"
+            "    for (; f > stack; --f) {\n"
+            "        switch (f->ret) {\n");
+    jipg_emit_side_buffer(source, frames.unwind);
+    fprintf(source,
+            "            default:\n"
+            "                break;\n"
+            "        }\n"
+            "    }\n"
+            "    return false;\n"
+            "}\n");
+}
+
+// Head i of values[] enters parse_frames() with entry i.
+static void jipg_emit_head_value_parser(FILE *source, Jipg_Value *value, size_t index) {
+    const char *struct_name = jipg_value_struct_name(value);
+    JIPG_ASSERT(struct_name);
+
+    int n = strlen(struct_name) - 1;
+
+    if (jipg_global_context.instrument) {
+        fprintf(source,
+                "static _Thread_local bool %s_stats_enabled;\n"
+                "static _Thread_local %s_stats %s_stats_data;\n"
+                "void %s_stats_enable(bool enable) {\n"
+                "    %s_stats_enabled = enable;\n"
+                "}\n"
+                "const %s_stats *%s_stats_get(void) {\n"
+                "    return &%s_stats_data;\n"
+                "}\n"
+                "void %s_stats_reset(void) {\n"
+                "    memset(&%s_stats_data, 0, sizeof(%s_stats_data));\n"
+                "}\n",
+                value->head, value->head, value->head, value->head, value->head, value->head, value->head,
+                value->head, value->head, value->head, value->head);
+        // Every entry point of the head, parse, validate, merge and the
+        // streaming ones alike, counts into its stats through this.
+        fprintf(source,
+                "static inline void %s_stats_attach(Lexer *l) {\n"
+                "#ifdef JIPG_INSTRUMENT\n"
+                "    stats_sink = %s_stats_enabled ? &%s_stats_data : NULL;\n"
+                "    l->tokens = stats_sink ? &stats_sink->tokens : NULL;\n"
+                "    l->whitespace_bytes = stats_sink ? &stats_sink->whitespace_bytes : NULL;\n"
+                "#else\n"
+                "    (void)l;\n"
+                "#endif\n"
+                "}\n",
+                value->head, value->head, value->head);
+    }
+
+    fprintf(source,
+            "bool parse_%s_error(const char *json, size_t json_length, %s *res, Jipg_Error *err) {\n"
+            "    Lexer l = {\n"
+            "        .input = json,\n"
+            "        .len = json_length,\n"
+            "    };\n"
+            "    set_parse_error(err);\n"
+            "    if (err) {\n"
+            "        err->expected = NULL;\n"
+            "        err->path[0] = 0;\n"
+            "    }\n",
+            value->head, value->head);
+    if (jipg_global_context.instrument) fprintf(source, "    %s_stats_attach(&l);\n", value->head);
+    fprintf(source,
+            "    read_char(&l);\n");
+    if (jipg_value_has_frame(value))
+        fprintf(source, "    return parse_frames(&l, res, %zu, NULL);\n", index);
+    else
+        fprintf(source, "    return parse_%s(&l, res);\n", struct_name);
+    fprintf(source,
+            "}\n"
+            "bool parse_%s(const char *json, size_t json_length, %s *res) {\n"
+            "    return parse_%s_error(json, json_length, res, NULL);\n"
+            "}\n",
+            value->head, value->head, value->head);
+
+    // The lexer template and the error and stats sinks are set up once for
+    // the batch. While one document is parsed the next ones are prefetched,
+    // so their first cache misses overlap with useful work.
+    fprintf(source,
+            "size_t parse_%s_batch(const char **bufs, const size_t *lens, size_t n, %s *out) {\n"
+            "    Lexer base = {0};\n"
+            "    set_parse_error(NULL);\n",
+            value->head, value->head);
+    if (jipg_global_context.instrument) fprintf(source, "    %s_stats_attach(&base);\n", value->head);
+    fprintf(source,
+            "    for (size_t i = 0; i < n; ++i) {\n"
+            "        if (i + %s < n) {\n"
+            "            const char *ahead = bufs[i + %s];\n"
+            "            size_t ahead_len = lens[i + %s] < %s ? lens[i + %s] : %s;\n"
+            "            for (size_t at = 0; at < ahead_len; at += 64) __builtin_prefetch(ahead + at, 0, 3);\n"
+            "            __builtin_prefetch(out + i + %s, 1, 3);\n"
+            "        }\n"
+            "        Lexer l = base;\n"
+            "        l.input = bufs[i];\n"
+            "        l.len = lens[i];\n"
+            "        read_char(&l);\n",
+            STR(JIPG_BATCH_PREFETCH_DISTANCE), STR(JIPG_BATCH_PREFETCH_DISTANCE), STR(JIPG_BATCH_PREFETCH_DISTANCE),
+            STR(JIPG_BATCH_PREFETCH_BYTES), STR(JIPG_BATCH_PREFETCH_DISTANCE), STR(JIPG_BATCH_PREFETCH_BYTES),
+            STR(JIPG_BATCH_PREFETCH_DISTANCE));
+    if (jipg_value_has_frame(value))
+        fprintf(source, "        if (!parse_frames(&l, out + i, %zu, NULL)) return i;\n", index);
+    else
+        fprintf(source, "        if (!parse_%s(&l, out + i)) return i;\n", struct_name);
+    fprintf(source,
+            "    }\n"
+            "    return n;\n"
+            "}\n");
+
+    fprintf(source,
+            "bool validate_%s_error(const char *json, size_t json_length, Jipg_Error *err) {\n"
+            "    Lexer l = {\n"
+            "        .input = json,\n"
+            "        .len = json_length,\n"
+            "    };\n"
+            "    set_parse_error(err);\n"
+            "    if (err) {\n"
+            "        err->expected = NULL;\n"
+            "        err->path[0] = 0;\n"
+            "    }\n",
+            value->head);
+    if (jipg_global_context.instrument) fprintf(source, "    %s_stats_attach(&l);\n", value->head);
+    fprintf(source, "    read_char(&l);\n");
+    if (jipg_value_has_frame(value))
+        fprintf(source, "    return validate_frames(&l, %zu);\n", index);
+    else
+        fprintf(source, "    return check_%s(&l);\n", jipg_check_name(value));
+    fprintf(source,
+            "}\n"
+            "bool validate_%s(const char *json, size_t json_length) {\n"
+            "    return validate_%s_error(json, json_length, NULL);\n"
+            "}\n",
+            value->head, value->head);
+
+    if (value->kind == JIPG_KIND_OBJECT) {
+        fprintf(source,
+                "bool merge_%s(const char *json, size_t json_length, %s *res, uint64_t *changed, Jipg_Error *err) {\n"
+                "    uint64_t ignored[(%s_MEMBER_COUNT + 63) / 64];\n"
+                "    if (!changed) changed = ignored;\n"
+                "    memset(changed, 0, sizeof(ignored));\n"
+                "    Lexer l = {\n"
+                "        .input = json,\n"
+                "        .len = json_length,\n"
+                "    };\n"
+                "    set_parse_error(err);\n"
+                "    if (err) {\n"
+                "        err->expected = NULL;\n"
+                "        err->path[0] = 0;\n"
+                "    }\n",
+                value->head, value->head, value->head);
+        if (jipg_global_context.instrument) fprintf(source, "    %s_stats_attach(&l);\n", value->head);
+        fprintf(source,
+                "    read_char(&l);\n"
+                "    return parse_frames(&l, res, %zu, changed);\n"
+                "}\n",
+                index);
+    }
+
+    if (jipg_value_uses_kind(value, JIPG_KIND_REF)) {
+        fprintf(source,
+                "bool parse_%s_pool(const char *json, size_t json_length, %s *res, Jipg_Node_Pool *pool,\n"
+                "    Jipg_Error *err) {\n"
+                "    Jipg_Node_Pool *old = set_node_pool(pool);\n"
+                "    bool ok = parse_%s_error(json, json_length, res, err);\n"
+                "    set_node_pool(old);\n"
+                "    return ok;\n"
+                "}\n"
+                "void %s_pool_free(Jipg_Node_Pool *pool) {\n"
+                "    node_pool_free(pool);\n"
+                "}\n",
+                value->head, value->head, value->head, value->head);
+    }
+
+    if (jipg_global_context.result_arena) {
+        fprintf(source,
+                "bool parse_%s_arena(const char *json, size_t json_length, %s *res, Jipg_Arena *arena,\n"
+                "    Jipg_Error *err) {\n"
+                "    memset(res, 0, sizeof(*res));\n"
+                "    Jipg_Arena *old = set_arena(arena);\n"
+                "    bool ok = parse_%s_error(json, json_length, res, err);\n"
+                "    set_arena(old);\n"
+                "    return ok;\n"
+                "}\n"
+                "void %s_arena_reset(Jipg_Arena *arena) {\n"
+                "    arena_reset(arena);\n"
+                "}\n"
+                "void %s_arena_free(Jipg_Arena *arena) {\n"
+                "    arena_free(arena);\n"
+                "}\n",
+                value->head, value->head, value->head, value->head, value->head);
+    }
+
+    if (jipg_value_uses_kind(value, JIPG_KIND_STRING_INTERNED)) {
+        fprintf(source,
+                "const char *%s_intern(const char *str, size_t len) {\n"
+                "    return intern(str, len);\n"
+                "}\n",
+                value->head);
+    }
+}
+
+static void jipg_emit_stats_names(FILE *source, Jipg_Value *value, bool fields) {
+    if (value->shared) return;
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next) {
+                jipg_emit_stats_names(source, kv->as_object_kv.value, fields);
+                if (fields)
+                    fprintf(source, "    [%zu] = \"%s.%s\",\n", kv->stats_index, value->as_object.struct_name,
+                            kv->as_object_kv.key);
+            }
+        } break;
+        case JIPG_KIND_ARRAY: {
+            jipg_emit_stats_names(source, value->as_array.internal, fields);
+        } break;
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_emit_stats_names(source, c->as_union_case.value, fields);
+        } break;
+        case JIPG_KIND_MAP: {
+            jipg_emit_stats_names(source, value->as_map.internal, fields);
+        } break;
+        default:
+            return;
+    }
+    if (!fields) fprintf(source, "    [%zu] = \"%s\",\n", value->stats_index, jipg_value_struct_name(value));
+}
+
+// The hooks are only live when the source is compiled with JIPG_INSTRUMENT,
+// and then only while the head's stats are enabled on the calling thread.
+static void jipg_emit_stats_hooks(FILE *source, Jipg_Value **values, size_t value_count) {
+    Jipg_Context *ctx = &jipg_global_context;
+    const char *layout = ctx->parsers[0].head_struct_name;
+
+    if (ctx->stats_field_count) {
+        fprintf(source, "const char *const %s_stats_field_names[%zu] = {\n", layout, ctx->stats_field_count);
+        for (size_t i = 0; i < value_count; ++i) jipg_emit_stats_names(source, values[i], true);
+        fprintf(source, "};\n");
+    }
+    if (ctx->stats_struct_count) {
+        fprintf(source, "const char *const %s_stats_struct_names[%zu] = {\n", layout, ctx->stats_struct_count);
+        for (size_t i = 0; i < value_count; ++i) jipg_emit_stats_names(source, values[i], false);
+        fprintf(source, "};\n");
+    }
+
+    fprintf(source,
+            "#ifdef JIPG_INSTRUMENT\n"
+            "#if defined(__x86_64__) || defined(__i386__)\n"
+            "#include <x86intrin.h>\n"
+            "static inline uint64_t stat_now(void) {\n"
+            "    return __rdtsc();\n"
+            "}\n"
+            "#else\n"
+            "#include <time.h>\n"
+            "static inline uint64_t stat_now(void) {\n"
+            "    struct timespec ts;\n"
+            "    clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+            "    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;\n"
+            "}\n"
+            "#endif\n"
+            "static _Thread_local %s_stats *stats_sink;\n"
+            "#define STAT_INC(counter) (stats_sink ? (void)++stats_sink->counter : (void)0)\n"
+            "#define STAT_TIMER_START(t) ((t) = stats_sink ? stat_now() : 0)\n"
+            "#define STAT_TIMER_STOP(t, i) \\\n"
+            "    (stats_sink ? (void)(++stats_sink->struct_calls[i], stats_sink->struct_ticks[i] += stat_now() - (t)) : (void)0)\n"
+            "#else\n"
+            "#define STAT_INC(counter) ((void)0)\n"
+            "#define STAT_TIMER_START(t) ((void)0)\n"
+            "#define STAT_TIMER_STOP(t, i) ((void)0)\n"
+            "#endif\n",
+            layout);
+}
+
+// Snapshots (--snapshot) copy a parsed value into one blob in which every
+// pointer is stored as an offset from the start of the blob. Mapping one back
+// checks each offset against the blob and turns it into a pointer in place.
+// Values are visited through a work queue rather than recursion, since values
+// behind a JIPG_REF can nest arbitrarily deep.
+static bool jipg_value_has_pointers(const Jipg_Value *value) {
+    switch (value->kind) {
+        case JIPG_KIND_STRING:
+        case JIPG_KIND_STRING_INTERNED:
+        case JIPG_KIND_ARRAY:
+        case JIPG_KIND_MAP:
+        case JIPG_KIND_REF:
+            return true;
+        case JIPG_KIND_OBJECT: {
+            const Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                if (jipg_value_has_pointers(kv->as_object_kv.value)) return true;
+            return false;
+        }
+        case JIPG_KIND_UNION: {
+            const Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                if (jipg_value_has_pointers(c->as_union_case.value)) return true;
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+
+// The value whose fixup function handles items of the given element type, or
+// NULL when the items need none or are strings handled in place.
+static const Jipg_Value *jipg_snapshot_item(const Jipg_Value *value) {
+    if (value->kind == JIPG_KIND_REF) value = value->as_ref.target;
+    if (!jipg_value_has_frame(value) || !jipg_value_has_pointers(value)) return NULL;
+    return value;
+}
+
+typedef enum {
+    JIPG_SNAPSHOT_DECLARE,
+    JIPG_SNAPSHOT_ITEM_ID,
+    JIPG_SNAPSHOT_WRITE_CASE,
+    JIPG_SNAPSHOT_MAP_CASE,
+    JIPG_SNAPSHOT_DEFINE,
+} Jipg_Snapshot_Pass;
+
+static void jipg_emit_snapshot_functions(FILE *source, Jipg_Value *value);
+
+static void jipg_emit_snapshot_pass(FILE *source, Jipg_Value *value, Jipg_Snapshot_Pass pass) {
+    if (value->shared) return;
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                jipg_emit_snapshot_pass(source, kv->as_object_kv.value, pass);
+        } break;
+        case JIPG_KIND_ARRAY: {
+            jipg_emit_snapshot_pass(source, value->as_array.internal, pass);
+        } break;
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_emit_snapshot_pass(source, c->as_union_case.value, pass);
+        } break;
+        case JIPG_KIND_MAP: {
+            jipg_emit_snapshot_pass(source, value->as_map.internal, pass);
+        } break;
+        default:
+            return;
+    }
+    if (!jipg_value_has_pointers(value)) return;
+
+    const char *struct_name = jipg_value_struct_name(value);
+    switch (pass) {
+        case JIPG_SNAPSHOT_DECLARE: {
+            fprintf(source,
+                    "static void snap_write_%s(Snap_Writer *w, size_t at, const %s *v);\n"
+                    "static bool snap_map_%s(Snap_Reader *r, %s *v);\n",
+                    struct_name, struct_name, struct_name, struct_name);
+        } break;
+        case JIPG_SNAPSHOT_ITEM_ID: {
+            fprintf(source, "    SNAP_%s,\n", struct_name);
+        } break;
+        case JIPG_SNAPSHOT_WRITE_CASE: {
+            fprintf(source,
+                    "            case SNAP_%s:\n"
+                    "                for (size_t i = 0; i < it.count; ++i)\n"
+                    "                    snap_write_%s(w, it.at + i * sizeof(%s), (const %s *)it.v + i);\n"
+                    "                break;\n",
+                    struct_name, struct_name, struct_name, struct_name);
+        } break;
+        case JIPG_SNAPSHOT_MAP_CASE: {
+            fprintf(source,
+                    "            case SNAP_%s:\n"
+                    "                for (size_t i = 0; i < it.count; ++i)\n"
+                    "                    if (!snap_map_%s(r, (%s *)it.v + i)) return false;\n"
+                    "                break;\n",
+                    struct_name, struct_name, struct_name);
+        } break;
+        case JIPG_SNAPSHOT_DEFINE: {
+            jipg_emit_snapshot_functions(source, value);
+        } break;
+    }
+}
+
+// Fixes up the copy of src at buffer offset at.
+static void jipg_emit_snapshot_write_value(FILE *source, const Jipg_Value *value, const char *at, const char *src,
+                                           const char *indent) {
+    switch (value->kind) {
+        case JIPG_KIND_STRING:
+        case JIPG_KIND_STRING_INTERNED: {
+            fprintf(source, "%ssnap_link(w, %s, snap_str(w, %s));\n", indent, at, src);
+        } break;
+        case JIPG_KIND_OBJECT:
+        case JIPG_KIND_ARRAY:
+        case JIPG_KIND_UNION:
+        case JIPG_KIND_MAP: {
+            if (!jipg_value_has_pointers(value)) break;
+            fprintf(source, "%ssnap_write_%s(w, %s, &%s);\n", indent, jipg_value_struct_name(value), at, src);
+        } break;
+        case JIPG_KIND_REF: {
+            fprintf(source,
+                    "%sif (%s) {\n"
+                    "%s    size_t node = snap_put(w, %s, sizeof(*%s));\n"
+                    "%s    snap_link(w, %s, node);\n",
+                    indent, src, indent, src, src, indent, at);
+            const Jipg_Value *item = jipg_snapshot_item(value);
+            if (item)
+                fprintf(source, "%s    snap_write_push(w, node, %s, 1, SNAP_%s);\n", indent, src,
+                        jipg_value_struct_name(item));
+            fprintf(source, "%s}\n", indent);
+        } break;
+        default: {
+        }
+    }
+}
+
+// Validates the pointer stored in lval and fixes it up in place.
+static void jipg_emit_snapshot_map_value(FILE *source, const Jipg_Value *value, const char *lval,
+                                         const char *indent) {
+    switch (value->kind) {
+        case JIPG_KIND_STRING: {
+            fprintf(source, "%sif (!snap_cstr(r, &%s)) return false;\n", indent, lval);
+        } break;
+        case JIPG_KIND_STRING_INTERNED: {
+            // Interned strings are interned again so they still compare by pointer.
+            fprintf(source,
+                    "%sif (!snap_cstr(r, &%s)) return false;\n"
+                    "%sif (%s && !(%s = intern(%s, strlen(%s)))) return false;\n",
+                    indent, lval, indent, lval, lval, lval, lval);
+        } break;
+        case JIPG_KIND_OBJECT:
+        case JIPG_KIND_ARRAY:
+        case JIPG_KIND_UNION:
+        case JIPG_KIND_MAP: {
+            if (!jipg_value_has_pointers(value)) break;
+            fprintf(source, "%sif (!snap_map_%s(r, &%s)) return false;\n", indent, jipg_value_struct_name(value),
+                    lval);
+        } break;
+        case JIPG_KIND_REF: {
+            fprintf(source, "%sif (!snap_ptr(r, &%s, sizeof(*%s), _Alignof(max_align_t), true)) return false;\n",
+                    indent, lval, lval);
+            const Jipg_Value *item = jipg_snapshot_item(value);
+            if (item)
+                fprintf(source, "%sif (%s && !snap_map_push(r, %s, 1, SNAP_%s)) return false;\n", indent, lval, lval,
+                        jipg_value_struct_name(item));
+        } break;
+        default: {
+        }
+    }
+}
+
+static void jipg_emit_snapshot_functions(FILE *source, Jipg_Value *value) {
+    const char *struct_name = jipg_value_struct_name(value);
+    char at[512], src[512];
+
+    fprintf(source, "static void snap_write_%s(Snap_Writer *w, size_t at, const %s *v) {\n", struct_name,
+            struct_name);
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next) {
+                const char *key = kv->as_object_kv.key;
+                JIPG_FORMAT(at, "at + offsetof(%s, %s)", struct_name, key);
+                JIPG_FORMAT(src, "v->%s", key);
+                jipg_emit_snapshot_write_value(source, kv->as_object_kv.value, at, src, "    ");
+            }
+        } break;
+        case JIPG_KIND_ARRAY: {
+            const Jipg_Value *internal = value->as_array.internal;
+            fprintf(source,
+                    "    if (!v->len) {\n"
+                    "        snap_link(w, at + offsetof(%s, items), 0);\n"
+                    "        return;\n"
+                    "    }\n"
+                    "    size_t items = snap_put(w, v->items, v->len * sizeof(*v->items));\n"
+                    "    snap_link(w, at + offsetof(%s, items), items);\n",
+                    struct_name, struct_name);
+            const Jipg_Value *item = jipg_snapshot_item(internal);
+            if (item) {
+                fprintf(source, "    snap_write_push(w, items, v->items, v->len, SNAP_%s);\n",
+                        jipg_value_struct_name(item));
+            } else if (internal->kind == JIPG_KIND_STRING || internal->kind == JIPG_KIND_STRING_INTERNED) {
+                fprintf(source,
+                        "    for (size_t i = 0; i < v->len; ++i)\n"
+                        "        snap_link(w, items + i * sizeof(*v->items), snap_str(w, v->items[i]));\n");
+            }
+        } break;
+        case JIPG_KIND_UNION: {
+            fprintf(source, "    switch (v->%s) {\n", value->as_union.discriminator);
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next) {
+                if (!jipg_value_has_pointers(c->as_union_case.value)) continue;
+                const char *name = c->as_union_case.name;
+                JIPG_FORMAT(at, "at + offsetof(%s, %s)", struct_name, name);
+                JIPG_FORMAT(src, "v->%s", name);
+                fprintf(source, "        case %s_%s:\n", struct_name, name);
+                jipg_emit_snapshot_write_value(source, c->as_union_case.value, at, src, "            ");
+                fprintf(source, "            break;\n");
+            }
+            fprintf(source,
+                    "        default:\n"
+                    "            break;\n"
+                    "    }\n");
+        } break;
+        case JIPG_KIND_MAP: {
+            fprintf(source,
+                    "    if (!v->cap) {\n"
+                    "        snap_link(w, at + offsetof(%s, hashes), 0);\n"
+                    "        snap_link(w, at + offsetof(%s, entries), 0);\n"
+                    "        return;\n"
+                    "    }\n"
+                    "    size_t hashes = snap_put(w, v->hashes, v->cap * sizeof(*v->hashes));\n"
+                    "    size_t entries = snap_put(w, NULL, v->cap * sizeof(*v->entries));\n"
+                    "    snap_link(w, at + offsetof(%s, hashes), hashes);\n"
+                    "    snap_link(w, at + offsetof(%s, entries), entries);\n"
+                    "    for (size_t i = 0; i < v->cap; ++i) {\n"
+                    "        if (!v->hashes[i]) continue;\n"
+                    "        const %s_Entry *e = v->entries + i;\n"
+                    "        size_t entry = entries + i * sizeof(*e);\n"
+                    "        snap_copy(w, entry, e, sizeof(*e));\n"
+                    "        snap_link(w, entry + offsetof(%s_Entry, key), snap_bytes(w, e->key, e->key_len + 1));\n",
+                    struct_name, struct_name, struct_name, struct_name, struct_name, struct_name);
+            JIPG_FORMAT(at, "entry + offsetof(%s_Entry, value)", struct_name);
+            jipg_emit_snapshot_write_value(source, value->as_map.internal, at, "e->value", "        ");
+            fprintf(source, "    }\n");
+        } break;
+        default:
+            UNREACHABLE();
+    }
+    fprintf(source, "}\n");
+
+    fprintf(source, "static bool snap_map_%s(Snap_Reader *r, %s *v) {\n", struct_name, struct_name);
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next) {
+                JIPG_FORMAT(src, "v->%s", kv->as_object_kv.key);
+                jipg_emit_snapshot_map_value(source, kv->as_object_kv.value, src, "    ");
+            }
+        } break;
+        case JIPG_KIND_ARRAY: {
+            const Jipg_Value *internal = value->as_array.internal;
+            fprintf(source,
+                    "    if (v->len > SIZE_MAX / sizeof(*v->items) ||\n"
+                    "        !snap_ptr(r, &v->items, v->len * sizeof(*v->items), _Alignof(max_align_t), v->len == 0))\n"
+                    "        return false;\n");
+            const Jipg_Value *item = jipg_snapshot_item(internal);
+            if (item) {
+                fprintf(source, "    if (v->len && !snap_map_push(r, v->items, v->len, SNAP_%s)) return false;\n",
+                        jipg_value_struct_name(item));
+            } else if (internal->kind == JIPG_KIND_STRING || internal->kind == JIPG_KIND_STRING_INTERNED) {
+                fprintf(source, "    for (size_t i = 0; i < v->len; ++i) {\n");
+                jipg_emit_snapshot_map_value(source, internal, "v->items[i]", "        ");
+                fprintf(source, "    }\n");
+            }
+        } break;
+        case JIPG_KIND_UNION: {
+            fprintf(source, "    switch (v->%s) {\n", value->as_union.discriminator);
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next) {
+                const char *name = c->as_union_case.name;
+                JIPG_FORMAT(src, "v->%s", name);
+                fprintf(source, "        case %s_%s:\n", struct_name, name);
+                jipg_emit_snapshot_map_value(source, c->as_union_case.value, src, "            ");
+                fprintf(source, "            break;\n");
+            }
+            fprintf(source,
+                    "        default:\n"
+                    "            return false;\n"
+                    "    }\n");
+        } break;
+        case JIPG_KIND_MAP: {
+            fprintf(source,
+                    "    if ((v->cap & (v->cap - 1)) || v->len > v->cap || v->cap > SIZE_MAX / sizeof(*v->entries))\n"
+                    "        return false;\n"
+                    "    if (!snap_ptr(r, &v->hashes, v->cap * sizeof(*v->hashes), _Alignof(max_align_t), v->cap == 0) ||\n"
+                    "        !snap_ptr(r, &v->entries, v->cap * sizeof(*v->entries), _Alignof(max_align_t), v->cap == 0))\n"
+                    "        return false;\n"
+                    "    for (size_t i = 0; i < v->cap; ++i) {\n"
+                    "        if (!v->hashes[i]) continue;\n"
+                    "        %s_Entry *e = v->entries + i;\n"
+                    "        if (e->key_len == SIZE_MAX || !snap_ptr(r, &e->key, e->key_len + 1, 1, false)) return false;\n",
+                    struct_name);
+            jipg_emit_snapshot_map_value(source, value->as_map.internal, "e->value", "        ");
+            fprintf(source, "    }\n");
+        } break;
+        default:
+            UNREACHABLE();
+    }
+    fprintf(source,
+            "    return true;\n"
+            "}\n");
+}
+
+// Shared by every head of the output. Blobs start with a Snap_Header, and the
+// writer places everything but strings at max_align_t boundaries, so values
+// in a blob mapped at a page boundary are suitably aligned.
+static void jipg_emit_snapshot_helpers(FILE *source, Jipg_Value **values, size_t value_count) {
+    fprintf(source,
+            "typedef struct {\n"
+            "    char magic[8];\n"
+            "    uint64_t schema;\n"
+            "    uint64_t size;\n"
+            "    uint64_t root;\n"
+            "    uint32_t pointer_size;\n"
+            "    uint32_t root_size;\n"
+            "} Snap_Header;\n"
+            "typedef struct {\n"
+            "    size_t at;\n"
+            "    void *v;\n"
+            "    size_t count;\n"
+            "    uint32_t type;\n"
+            "} Snap_Item;\n"
+            "typedef struct {\n"
+            "    Snap_Item *items;\n"
+            "    size_t len;\n"
+            "    size_t cap;\n"
+            "} Snap_Queue;\n"
+            "typedef struct {\n"
+            "    char *buf;\n"
+            "    size_t len;\n"
+            "    size_t cap;\n"
+            "    Snap_Queue queue;\n"
+            "    bool failed;\n"
+            "} Snap_Writer;\n"
+            "typedef struct {\n"
+            "    char *base;\n"
+            "    size_t size;\n"
+            "    Snap_Queue queue;\n"
+            "} Snap_Reader;\n");
+
+    fprintf(source,
+            "static bool snap_queue_push(Snap_Queue *q, size_t at, void *v, size_t count, uint32_t type) {\n"
+            "    if (q->len == q->cap) {\n"
+            "        size_t cap = q->cap ? q->cap * 2 : 64;\n"
+            "        Snap_Item *items = (Snap_Item *)JIPG_REALLOC(q->items, cap * sizeof(*items));\n"
+            "        if (!items) return false;\n"
+            "        q->items = items;\n"
+            "        q->cap = cap;\n"
+            "    }\n"
+            "    q->items[q->len++] = (Snap_Item){at, v, count, type};\n"
+            "    return true;\n"
+            "}\n");
+
+    // Writer: appends to a growing buffer and refers to it by offset only, as
+    // it moves when it grows. After a failure it keeps going without writing.
+    fprintf(source,
+            "static size_t snap_bytes_aligned(Snap_Writer *w, const void *src, size_t size, size_t align) {\n"
+            "    size_t at = (w->len + align - 1) & ~(align - 1);\n"
+            "    if (w->failed || at + size < at) goto failed;\n"
+            "    if (at + size > w->cap) {\n"
+            "        size_t cap = w->cap ? w->cap : 4096;\n"
+            "        while (cap < at + size) cap *= 2;\n"
+            "        char *buf = (char *)JIPG_REALLOC(w->buf, cap);\n"
+            "        if (!buf) goto failed;\n"
+            "        w->buf = buf;\n"
+            "        w->cap = cap;\n"
+            "    }\n"
+            "    memset(w->buf + w->len, 0, at - w->len);\n"
+            "    if (src)\n"
+            "        memcpy(w->buf + at, src, size);\n"
+            "    else\n"
+            "        memset(w->buf + at, 0, size);\n"
+            "    w->len = at + size;\n"
+            "    return at;\n"
+            "failed:\n"
+            "    w->failed = true;\n"
+            "    return 0;\n"
+            "}\n"
+            "static inline size_t snap_put(Snap_Writer *w, const void *src, size_t size) {\n"
+            "    return snap_bytes_aligned(w, src, size, _Alignof(max_align_t));\n"
+            "}\n"
+            "static inline size_t snap_bytes(Snap_Writer *w, const void *src, size_t size) {\n"
+            "    return snap_bytes_aligned(w, src, size, 1);\n"
+            "}\n"
+            "static inline size_t snap_str(Snap_Writer *w, const char *str) {\n"
+            "    return str ? snap_bytes(w, str, strlen(str) + 1) : 0;\n"
+            "}\n"
+            "static inline void snap_copy(Snap_Writer *w, size_t at, const void *src, size_t size) {\n"
+            "    if (!w->failed) memcpy(w->buf + at, src, size);\n"
+            "}\n"
+            "static inline void snap_link(Snap_Writer *w, size_t at, size_t offset) {\n"
+            "    uintptr_t stored = offset;\n"
+            "    snap_copy(w, at, &stored, sizeof(stored));\n"
+            "}\n"
+            "static inline void snap_write_push(Snap_Writer *w, size_t at, const void *v, size_t count, uint32_t type) {\n"
+            "    if (!snap_queue_push(&w->queue, at, (void *)v, count, type)) w->failed = true;\n"
+            "}\n");
+
+    // Reader: a stored offset of 0 is NULL, any other must lie in the blob.
+    fprintf(source,
+            "static bool snap_ptr(Snap_Reader *r, void *slot, size_t size, size_t align, bool nullable) {\n"
+            "    uintptr_t offset;\n"
+            "    memcpy(&offset, slot, sizeof(offset));\n"
+            "    if (!offset) return nullable;\n"
+            "    if (offset >= r->size || size > r->size - offset || offset %% align) return false;\n"
+            "    void *ptr = r->base + offset;\n"
+            "    memcpy(slot, &ptr, sizeof(ptr));\n"
+            "    return true;\n"
+            "}\n"
+            "static bool snap_cstr(Snap_Reader *r, void *slot) {\n"
+            "    uintptr_t offset;\n"
+            "    memcpy(&offset, slot, sizeof(offset));\n"
+            "    if (!offset) return true;\n"
+            "    if (offset >= r->size || !memchr(r->base + offset, 0, r->size - offset)) return false;\n"
+            "    return snap_ptr(r, slot, 1, 1, false);\n"
+            "}\n"
+            "static inline bool snap_map_push(Snap_Reader *r, void *v, size_t count, uint32_t type) {\n"
+            "    return snap_queue_push(&r->queue, 0, v, count, type);\n"
+            "}\n");
+
+    fprintf(source, "enum {\n");
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_snapshot_pass(source, values[i], JIPG_SNAPSHOT_ITEM_ID);
+    fprintf(source, "    SNAP_COUNT\n};\n");
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_snapshot_pass(source, values[i], JIPG_SNAPSHOT_DECLARE);
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_snapshot_pass(source, values[i], JIPG_SNAPSHOT_DEFINE);
+
+    fprintf(source,
+            "static bool snap_write_drain(Snap_Writer *w) {\n"
+            "    while (w->queue.len && !w->failed) {\n"
+            "        Snap_Item it = w->queue.items[--w->queue.len];\n"
+            "        switch (it.type) {\n");
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_snapshot_pass(source, values[i], JIPG_SNAPSHOT_WRITE_CASE);
+    fprintf(source,
+            "            default:\n"
+            "                break;\n"
+            "        }\n"
+            "    }\n"
+            "    return !w->failed;\n"
+            "}\n");
+
+    fprintf(source,
+            "static bool snap_map_drain(Snap_Reader *r) {\n"
+            "    while (r->queue.len) {\n"
+            "        Snap_Item it = r->queue.items[--r->queue.len];\n"
+            "        switch (it.type) {\n");
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_snapshot_pass(source, values[i], JIPG_SNAPSHOT_MAP_CASE);
+    fprintf(source,
+            "            default:\n"
+            "                return false;\n"
+            "        }\n"
+            "    }\n"
+            "    return true;\n"
+            "}\n");
+
+    fprintf(source,
+            "static bool snap_save(Snap_Writer *w, uint64_t schema, size_t root, size_t root_size, const char *path) {\n"
+            "    if (w->failed) return false;\n"
+            "    Snap_Header header = {\n"
+            "        .magic = \"JIPGSNP\",\n"
+            "        .schema = schema,\n"
+            "        .size = w->len,\n"
+            "        .root = root,\n"
+            "        .pointer_size = sizeof(void *),\n"
+            "        .root_size = root_size,\n"
+            "    };\n"
+            "    memcpy(w->buf, &header, sizeof(header));\n"
+            "    FILE *file = fopen(path, \"wb\");\n"
+            "    if (!file) return false;\n"
+            "    bool ok = fwrite(w->buf, 1, w->len, file) == w->len;\n"
+            "    return fclose(file) == 0 && ok;\n"
+            "}\n");
+
+    fprintf(source,
+            "static void *snap_open(const char *path, Jipg_Snapshot *snap, uint64_t schema, size_t root_size) {\n"
+            "    snap->base = NULL;\n"
+            "    snap->size = 0;\n"
+            "    int fd = open(path, O_RDONLY);\n"
+            "    if (fd < 0) return NULL;\n"
+            "    struct stat st;\n"
+            "    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Snap_Header)) {\n"
+            "        close(fd);\n"
+            "        return NULL;\n"
+            "    }\n"
+            "    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);\n"
+            "    close(fd);\n"
+            "    if (base == MAP_FAILED) return NULL;\n"
+            "    snap->base = base;\n"
+            "    snap->size = st.st_size;\n"
+            "    Snap_Header *header = (Snap_Header *)base;\n"
+            "    if (memcmp(header->magic, \"JIPGSNP\", 8) != 0 || header->schema != schema ||\n"
+            "        header->size != snap->size || header->pointer_size != sizeof(void *) ||\n"
+            "        header->root_size != root_size || header->root %% _Alignof(max_align_t) ||\n"
+            "        header->root < sizeof(*header) || header->root > snap->size ||\n"
+            "        root_size > snap->size - header->root) {\n"
+            "        munmap(base, snap->size);\n"
+            "        snap->base = NULL;\n"
+            "        snap->size = 0;\n"
+            "        return NULL;\n"
+            "    }\n"
+            "    return (char *)base + header->root;\n"
+            "}\n");
+}
+
+static uint64_t jipg_snapshot_schema_hash(Jipg_Value **values, size_t value_count) {
+    uint64_t h = jipg_shape_mix(0, 1);  // format version
+    for (size_t i = 0; i < value_count; ++i) {
+        h = jipg_shape_mix(h, jipg_key_hash(values[i]->head));
+        h = jipg_shape_mix(h, values[i]->shape_hash);
+    }
+    return h;
+}
+
+static void jipg_emit_head_snapshot(FILE *source, Jipg_Value *value, uint64_t schema) {
+    const char *struct_name = jipg_value_struct_name(value);
+    const char *head = value->head;
+
+    fprintf(source,
+            "bool %s_snapshot_write(const %s *res, const char *path) {\n"
+            "    Snap_Writer w = {0};\n"
+            "    snap_put(&w, NULL, sizeof(Snap_Header));\n"
+            "    size_t root = snap_put(&w, res, sizeof(*res));\n",
+            head, head);
+    if (jipg_value_has_pointers(value)) fprintf(source, "    snap_write_%s(&w, root, res);\n", struct_name);
+    fprintf(source,
+            "    bool ok = snap_write_drain(&w) && snap_save(&w, %lluull, root, sizeof(*res), path);\n"
+            "    JIPG_FREE(w.buf);\n"
+            "    JIPG_FREE(w.queue.items);\n"
+            "    return ok;\n"
+            "}\n",
+            (unsigned long long)schema);
+
+    fprintf(source,
+            "void %s_snapshot_unmap(Jipg_Snapshot *snap) {\n"
+            "    if (snap->base) munmap(snap->base, snap->size);\n"
+            "    snap->base = NULL;\n"
+            "    snap->size = 0;\n"
+            "}\n"
+            "const %s *%s_snapshot_map(const char *path, Jipg_Snapshot *snap) {\n"
+            "    %s *res = (%s *)snap_open(path, snap, %lluull, sizeof(*res));\n"
+            "    if (!res) return NULL;\n"
+            "    Snap_Reader r = {.base = (char *)snap->base, .size = snap->size};\n",
+            head, head, head, head, head, (unsigned long long)schema);
+    if (jipg_value_has_pointers(value))
+        fprintf(source, "    bool ok = snap_map_%s(&r, res) && snap_map_drain(&r);\n", struct_name);
+    else
+        fprintf(source, "    bool ok = true;\n");
+    fprintf(source,
+            "    JIPG_FREE(r.queue.items);\n"
+            "    if (!ok) {\n"
+            "        %s_snapshot_unmap(snap);\n"
+            "        return NULL;\n"
+            "    }\n"
+            "    return res;\n"
+            "}\n",
+            head);
+}
+
+// Items in a frame enter parse_frames() with entry value_count + index, or
+// that of the referenced head; other items are leaves.
+static void jipg_emit_each_item_parse(FILE *source, Jipg_Value **values, size_t value_count, size_t index,
+                                      const char *indent) {
+    Jipg_Value *internal = values[index]->as_array.internal;
+    if (internal->kind == JIPG_KIND_REF) {
+        size_t target = 0;
+        while (values[target] != internal->as_ref.target) ++target;
+        fprintf(source, "%sok = parse_frames(&l, &item, %zu, NULL);\n", indent, target);
+    } else if (jipg_value_has_frame(internal)) {
+        fprintf(source, "%sok = parse_frames(&l, &item, %zu, NULL);\n", indent, value_count + index);
+    } else {
+        fprintf(source, "%sok = parse_%s(&l, &item);\n", indent, jipg_value_name(internal));
+    }
+}
+
+static void jipg_emit_each_item_release(FILE *source, const Jipg_Value *internal, const char *indent) {
+    if (internal->kind == JIPG_KIND_REF) {
+        const Jipg_Value *target = internal->as_ref.target;
+        if (jipg_value_owns_memory(target))
+            fprintf(source, "%srelease_%s(&item);\n", indent, jipg_value_struct_name(target));
+    } else {
+        jipg_emit_release_value(source, internal, "item", indent);
+    }
+}
+
+static void jipg_emit_head_each(FILE *source, Jipg_Value **values, size_t value_count, size_t index) {
+    Jipg_Value *value = values[index];
+    Jipg_Value *internal = value->as_array.internal;
+    const char *head = value->head;
+
+    fprintf(source,
+            "bool parse_%s_each(const char *json, size_t json_length, %s_Each_Fn callback, void *ctx,\n"
+            "    Jipg_Error *err) {\n"
+            "    Lexer l = {\n"
+            "        .input = json,\n"
+            "        .len = json_length,\n"
+            "    };\n"
+            "    set_parse_error(err);\n"
+            "    if (err) {\n"
+            "        err->expected = NULL;\n"
+            "        err->path[0] = 0;\n"
+            "    }\n",
+            head, head);
+    if (jipg_global_context.instrument) fprintf(source, "    %s_stats_attach(&l);\n", head);
+    fprintf(source,
+            "    read_char(&l);\n"
+            "    Token tok = next_token(&l);\n"
+            "    if (tok.type != TOKEN_TYPE_LBRACKET) return fail(&l, &tok, \"'['\");\n");
+    // Items are freed one by one, so their nodes must not come from a pool.
+    bool nodes = jipg_value_uses_kind(value, JIPG_KIND_REF);
+    if (nodes) fprintf(source, "    Jipg_Node_Pool *pool = set_node_pool(NULL);\n");
+    fprintf(source,
+            "    bool ok = true;\n"
+            "    for (size_t i = 0;; ++i) {\n"
+            "        Lexer save = l;\n"
+            "        tok = next_token(&l);\n"
+            "        if (tok.type == TOKEN_TYPE_RBRACKET) break;\n"
+            "        if (tok.type != TOKEN_TYPE_COMMA) l = save;\n"
+            "        ");
+    jipg_emit_item_type(source, internal);
+    fprintf(source, "item;\n");
+    fprintf(source, "        memset(&item, 0, sizeof(item));\n");
+    jipg_emit_each_item_parse(source, values, value_count, index, "        ");
+    fprintf(source,
+            "        if (!ok) fail_index(i);\n"
+            "        bool more = ok && callback(&item, ctx);\n");
+    jipg_emit_each_item_release(source, internal, "        ");
+    fprintf(source,
+            "        if (!more) break;\n"
+            "    }\n");
+    if (nodes) fprintf(source, "    set_node_pool(pool);\n");
+    fprintf(source,
+            "    return ok;\n"
+            "}\n");
+}
+
+// --gzip: parse_<Head>_gzip_each() parses the items of an array head from a
+// gzip stream while a thread inflates it into a ring of blocks. Items are
+// parsed in place in their block; one that spans blocks is parsed from a
+// scratch copy of its bytes. A step that ran into the end of the bytes at hand
+// is parsed again once more have arrived; the lexer leaves read_pos past len
+// when it hits that end, on success as well as on failure.
+static void jipg_emit_gzip_helpers(FILE *source) {
+    fprintf(source,
+            "#define GZ_BLOCK " STR(JIPG_GZIP_BLOCK_SIZE) "\n"
+            "#define GZ_DEPTH " STR(JIPG_GZIP_DEPTH) "\n");
+    fprintf(source,
+            "typedef struct {\n"
+            "    int fd;\n"
+            "    pthread_t thread;\n"
+            "    // The count blocks from head on are inflated; the parser holds the one at\n"
+            "    // head until it releases it.\n"
+            "    char *blocks[GZ_DEPTH];\n"
+            "    size_t lens[GZ_DEPTH];\n"
+            "    size_t head;\n"
+            "    size_t count;\n"
+            "    bool done;\n"
+            "    bool stop;\n"
+            "    const char *error;\n"
+            "    pthread_mutex_t lock;\n"
+            "    pthread_cond_t filled;\n"
+            "    pthread_cond_t drained;\n"
+            "} Gz_Stream;\n"
+            "\n"
+            "static void gz_finish(Gz_Stream *s, const char *error) {\n"
+            "    pthread_mutex_lock(&s->lock);\n"
+            "    s->done = true;\n"
+            "    s->error = error;\n"
+            "    pthread_cond_signal(&s->filled);\n"
+            "    pthread_mutex_unlock(&s->lock);\n"
+            "}\n"
+            "\n"
+            "// Inflates the gzip members, or the zlib stream, read from s->fd.\n"
+            "static void *gz_inflate(void *arg) {\n"
+            "    Gz_Stream *s = (Gz_Stream *)arg;\n"
+            "    unsigned char in[1 << 16];\n"
+            "    z_stream z;\n"
+            "    memset(&z, 0, sizeof(z));\n"
+            "    if (inflateInit2(&z, 15 + 32) != Z_OK) {\n"
+            "        gz_finish(s, \"out of memory\");\n"
+            "        return NULL;\n"
+            "    }\n"
+            "    const char *error = NULL;\n"
+            "    bool member = false, eof = false;\n"
+            "    for (size_t tail = 0; !eof && !error; tail = (tail + 1) %% GZ_DEPTH) {\n"
+            "        pthread_mutex_lock(&s->lock);\n"
+            "        while (s->count == GZ_DEPTH && !s->stop) pthread_cond_wait(&s->drained, &s->lock);\n"
+            "        bool stop = s->stop;\n"
+            "        pthread_mutex_unlock(&s->lock);\n"
+            "        if (stop) break;\n"
+            "\n"
+            "        z.next_out = (unsigned char *)s->blocks[tail];\n"
+            "        z.avail_out = GZ_BLOCK;\n"
+            "        while (z.avail_out && !eof && !error) {\n"
+            "            if (!z.avail_in) {\n"
+            "                ssize_t got = read(s->fd, in, sizeof(in));\n"
+            "                if (got < 0 && errno == EINTR) continue;\n"
+            "                if (got <= 0) {\n"
+            "                    eof = true;\n"
+            "                    if (got < 0)\n"
+            "                        error = \"read error\";\n"
+            "                    else if (member)\n"
+            "                        error = \"truncated data\";\n"
+            "                    break;\n"
+            "                }\n"
+            "                z.next_in = in;\n"
+            "                z.avail_in = (uInt)got;\n"
+            "            }\n"
+            "            member = true;\n"
+            "            int ret = inflate(&z, Z_NO_FLUSH);\n"
+            "            if (ret == Z_STREAM_END) {\n"
+            "                // Another gzip member may follow.\n"
+            "                member = false;\n"
+            "                inflateReset(&z);\n"
+            "            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {\n"
+            "                error = \"corrupt data\";\n"
+            "            }\n"
+            "        }\n"
+            "\n"
+            "        // A NUL ends every block, as atof() in parse_int() and parse_float()\n"
+            "        // needs something other than a digit after a number.\n"
+            "        *z.next_out = 0;\n"
+            "        pthread_mutex_lock(&s->lock);\n"
+            "        s->lens[tail] = GZ_BLOCK - z.avail_out;\n"
+            "        ++s->count;\n"
+            "        pthread_cond_signal(&s->filled);\n"
+            "        pthread_mutex_unlock(&s->lock);\n"
+            "    }\n"
+            "    inflateEnd(&z);\n"
+            "    gz_finish(s, error);\n"
+            "    return NULL;\n"
+            "}\n"
+            "\n"
+            "static void gz_free(Gz_Stream *s) {\n"
+            "    for (size_t i = 0; i < GZ_DEPTH; ++i) JIPG_FREE(s->blocks[i]);\n"
+            "    pthread_mutex_destroy(&s->lock);\n"
+            "    pthread_cond_destroy(&s->filled);\n"
+            "    pthread_cond_destroy(&s->drained);\n"
+            "    JIPG_FREE(s);\n"
+            "}\n"
+            "\n"
+            "static Gz_Stream *gz_open(int fd) {\n"
+            "    Gz_Stream *s = (Gz_Stream *)JIPG_REALLOC(NULL, sizeof(Gz_Stream));\n"
+            "    if (!s) return NULL;\n"
+            "    memset(s, 0, sizeof(*s));\n"
+            "    s->fd = fd;\n"
+            "    pthread_mutex_init(&s->lock, NULL);\n"
+            "    pthread_cond_init(&s->filled, NULL);\n"
+            "    pthread_cond_init(&s->drained, NULL);\n"
+            "    bool ok = true;\n"
+            "    for (size_t i = 0; i < GZ_DEPTH; ++i) {\n"
+            "        s->blocks[i] = (char *)JIPG_REALLOC(NULL, GZ_BLOCK + 1);\n"
+            "        ok = ok && s->blocks[i];\n"
+            "    }\n"
+            "    if (!ok || pthread_create(&s->thread, NULL, gz_inflate, s) != 0) {\n"
+            "        gz_free(s);\n"
+            "        return NULL;\n"
+            "    }\n"
+            "    return s;\n"
+            "}\n"
+            "\n"
+            "// Waits for the next inflated block; false once there are no more.\n"
+            "static bool gz_take(Gz_Stream *s, const char **data, size_t *len) {\n"
+            "    pthread_mutex_lock(&s->lock);\n"
+            "    while (!s->count && !s->done) pthread_cond_wait(&s->filled, &s->lock);\n"
+            "    bool ok = s->count > 0;\n"
+            "    if (ok) {\n"
+            "        *data = s->blocks[s->head];\n"
+            "        *len = s->lens[s->head];\n"
+            "    }\n"
+            "    pthread_mutex_unlock(&s->lock);\n"
+            "    return ok;\n"
+            "}\n"
+            "\n"
+            "static void gz_release(Gz_Stream *s) {\n"
+            "    pthread_mutex_lock(&s->lock);\n"
+            "    s->head = (s->head + 1) %% GZ_DEPTH;\n"
+            "    --s->count;\n"
+            "    pthread_cond_signal(&s->drained);\n"
+            "    pthread_mutex_unlock(&s->lock);\n"
+            "}\n"
+            "\n"
+            "// Stops the inflate thread, or with drain lets it finish the stream first so\n"
+            "// its checksum is verified, and returns what was wrong with the stream.\n"
+            "static const char *gz_close(Gz_Stream *s, bool drain) {\n"
+            "    const char *data;\n"
+            "    size_t len;\n"
+            "    if (drain)\n"
+            "        while (gz_take(s, &data, &len)) gz_release(s);\n"
+            "    pthread_mutex_lock(&s->lock);\n"
+            "    s->stop = true;\n"
+            "    pthread_cond_signal(&s->drained);\n"
+            "    pthread_mutex_unlock(&s->lock);\n"
+            "    pthread_join(s->thread, NULL);\n"
+            "    const char *error = s->error;\n"
+            "    gz_free(s);\n"
+            "    return error;\n"
+            "}\n");
+
+    fprintf(source,
+            "// The bytes the parser sees, stream offsets [base, base + len): the block it\n"
+            "// holds, or a scratch copy that ends within or at the end of that block.\n"
+            "typedef struct {\n"
+            "    Gz_Stream *s;\n"
+            "    const char *data;\n"
+            "    size_t len;\n"
+            "    size_t base;\n"
+            "    const char *block;\n"
+            "    size_t block_len;\n"
+            "    size_t block_base;\n"
+            "    size_t taken;\n"
+            "    char *scratch;\n"
+            "    size_t scratch_cap;\n"
+            "    const char *expected;\n"
+            "    const char *found;\n"
+            "} Gz_Window;\n"
+            "\n"
+            "static bool gz_append(Gz_Window *w, const char *src, size_t n) {\n"
+            "    if (w->len + n >= w->scratch_cap) {\n"
+            "        size_t cap = w->scratch_cap ? w->scratch_cap : 4096;\n"
+            "        while (cap <= w->len + n) cap *= 2;\n"
+            "        char *scratch = (char *)JIPG_REALLOC(w->scratch, cap);\n"
+            "        if (!scratch) {\n"
+            "            w->expected = \"allocation\";\n"
+            "            w->found = \"out of memory\";\n"
+            "            return false;\n"
+            "        }\n"
+            "        w->scratch = scratch;\n"
+            "        w->scratch_cap = cap;\n"
+            "    }\n"
+            "    memcpy(w->scratch + w->len, src, n);\n"
+            "    w->data = w->scratch;\n"
+            "    w->len += n;\n"
+            "    w->scratch[w->len] = 0;\n"
+            "    return true;\n"
+            "}\n"
+            "\n"
+            "static void gz_in_place(Gz_Window *w) {\n"
+            "    w->data = w->block;\n"
+            "    w->len = w->block_len;\n"
+            "    w->base = w->block_base;\n"
+            "}\n"
+            "\n"
+            "// Parses in place again once the step at start is back in the held block.\n"
+            "static void gz_settle(Gz_Window *w, size_t start) {\n"
+            "    if (w->data == w->scratch && w->block && start >= w->block_base) gz_in_place(w);\n"
+            "}\n"
+            "\n"
+            "// Keeps the bytes from stream offset start on and adds more after them,\n"
+            "// copying them to scratch unless there are none to keep. Copies at least\n"
+            "// as many as are kept, so a long step is parsed again only a few times.\n"
+            "// False when the stream has no more.\n"
+            "static bool gz_more(Gz_Window *w, size_t start) {\n"
+            "    size_t keep = w->base + w->len - start;\n"
+            "    if (w->data == w->scratch) {\n"
+            "        memmove(w->scratch, w->scratch + (start - w->base), keep);\n"
+            "        w->len = keep;\n"
+            "        w->scratch[keep] = 0;\n"
+            "    } else if (keep) {\n"
+            "        const char *rest = w->data + (start - w->base);\n"
+            "        w->len = 0;\n"
+            "        if (!gz_append(w, rest, keep)) return false;\n"
+            "    } else {\n"
+            "        w->len = 0;\n"
+            "    }\n"
+            "    w->base = start;\n"
+            "    size_t step = keep > 4096 ? keep : 4096;\n"
+            "\n"
+            "    size_t used = w->block ? start + keep - w->block_base : 0;\n"
+            "    if (w->block && used < w->block_len) {\n"
+            "        if (keep) return gz_append(w, w->block + used, step < w->block_len - used ? step : w->block_len - used);\n"
+            "        gz_in_place(w);\n"
+            "        return true;\n"
+            "    }\n"
+            "    if (w->block) gz_release(w->s);\n"
+            "    w->block = NULL;\n"
+            "    if (!keep) w->data = \"\";\n"
+            "    const char *block;\n"
+            "    size_t len = 0;\n"
+            "    while (!len) {\n"
+            "        if (!gz_take(w->s, &block, &len)) {\n"
+            "            if (w->s->error) {\n"
+            "                w->expected = \"gzip stream\";\n"
+            "                w->found = w->s->error;\n"
+            "            }\n"
+            "            return false;\n"
+            "        }\n"
+            "        if (!len) gz_release(w->s);\n"
+            "    }\n"
+            "    w->block = block;\n"
+            "    w->block_len = len;\n"
+            "    w->block_base = w->taken;\n"
+            "    w->taken += len;\n"
+            "    if (keep) return gz_append(w, block, step < len ? step : len);\n"
+            "    gz_in_place(w);\n"
+            "    return true;\n"
+            "}\n"
+            "\n"
+            "// Whether the token at offset, where a step failed, runs into the end of the\n"
+            "// window, so that the failure may be for want of bytes.\n"
+            "static bool gz_cut(const Gz_Window *w, size_t offset) {\n"
+            "    Lexer l = {\n"
+            "        .input = w->data,\n"
+            "        .len = w->len,\n"
+            "        .read_pos = offset,\n"
+            "    };\n"
+            "    read_char(&l);\n"
+            "    next_token(&l);\n"
+            "    return l.read_pos > l.len;\n"
+            "}\n"
+            "\n"
+            "static bool gz_fail(Jipg_Error *err, size_t offset, const char *expected, const char *found) {\n"
+            "    if (err && !err->expected) {\n"
+            "        err->offset = offset;\n"
+            "        err->expected = expected;\n"
+            "        err->found = found;\n"
+            "    }\n"
+            "    return false;\n"
+            "}\n");
+}
+
+static void jipg_emit_head_gzip(FILE *source, Jipg_Value **values, size_t value_count, size_t index) {
+    Jipg_Value *value = values[index];
+    Jipg_Value *internal = value->as_array.internal;
+    const char *head = value->head;
+
+    fprintf(source,
+            "bool parse_%s_gzip_each(int fd, %s_Each_Fn callback, void *ctx, Jipg_Error *err) {\n"
+            "    if (err) {\n"
+            "        err->expected = NULL;\n"
+            "        err->path[0] = 0;\n"
+            "    }\n"
+            "    Gz_Stream *s = gz_open(fd);\n"
+            "    if (!s) return gz_fail(err, 0, \"allocation\", \"out of memory\");\n"
+            "    Gz_Window w = {.s = s, .data = \"\"};\n"
+            "    Jipg_Error e;\n"
+            "    set_parse_error(&e);\n",
+            head, head);
+    bool nodes = jipg_value_uses_kind(value, JIPG_KIND_REF);
+    if (nodes) fprintf(source, "    Jipg_Node_Pool *pool = set_node_pool(NULL);\n");
+    fprintf(source,
+            "    bool ok = false, open = false, done = false;\n"
+            "    // Stream offsets of the step being parsed and of the error.\n"
+            "    size_t start = 0, at = 0;\n"
+            "    for (size_t i = 0;;) {\n"
+            "        gz_settle(&w, start);\n"
+            "        Lexer l = {\n"
+            "            .input = w.data,\n"
+            "            .len = w.len,\n"
+            "            .read_pos = start - w.base,\n"
+            "        };\n");
+    // Steps retried once more of the stream is inflated count again.
+    if (jipg_global_context.instrument) fprintf(source, "        %s_stats_attach(&l);\n", head);
+    fprintf(source,
+            "        read_char(&l);\n"
+            "        e.expected = NULL;\n"
+            "        e.path[0] = 0;\n"
+            "        ");
+    jipg_emit_item_type(source, internal);
+    fprintf(source, "item;\n");
+    fprintf(source,
+            "        memset(&item, 0, sizeof(item));\n"
+            "        bool is_item = false;\n"
+            "        Lexer save = l;\n"
+            "        Token tok = next_token(&l);\n"
+            "        if (!open) {\n"
+            "            ok = tok.type == TOKEN_TYPE_LBRACKET || fail(&l, &tok, \"'['\");\n"
+            "        } else if (tok.type == TOKEN_TYPE_RBRACKET) {\n"
+            "            ok = done = true;\n"
+            "        } else {\n"
+            "            if (tok.type != TOKEN_TYPE_COMMA) l = save;\n"
+            "            is_item = true;\n");
+    jipg_emit_each_item_parse(source, values, value_count, index, "            ");
+    fprintf(source,
+            "        }\n"
+            "        bool cut = ok ? is_item && l.read_pos > l.len : gz_cut(&w, e.expected ? e.offset : l.pos);\n"
+            "        at = w.base + (e.expected ? e.offset : l.pos);\n"
+            "        size_t next = w.base + l.pos;\n"
+            "        bool retry = cut && !done && gz_more(&w, start);\n"
+            "        if (retry || !ok || w.found) {\n");
+    // A step cut short by the end of the window, which happens on valid input
+    // whenever an item spans two inflated blocks, leaves a partial item. Its
+    // arrays only count items that parsed and the rest starts zeroed, so it is
+    // released like a whole one.
+    jipg_emit_each_item_release(source, internal, "            ");
+    fprintf(source,
+            "            if (retry) continue;\n"
+            "            if (w.found) {\n"
+            "                ok = false;\n"
+            "                gz_fail(err, w.base + w.len, w.expected, w.found);\n"
+            "            } else if (is_item) {\n"
+            "                fail_index(i);\n"
+            "            }\n"
+            "            break;\n"
+            "        }\n"
+            "        if (done) break;\n"
+            "        start = next;\n"
+            "        if (!is_item) {\n"
+            "            open = true;\n"
+            "            continue;\n"
+            "        }\n"
+            "        bool more = callback(&item, ctx);\n");
+    jipg_emit_each_item_release(source, internal, "        ");
+    fprintf(source,
+            "        ++i;\n"
+            "        if (!more) break;\n"
+            "    }\n");
+    if (nodes) fprintf(source, "    set_node_pool(pool);\n");
+    fprintf(source,
+            "    set_parse_error(NULL);\n"
+            "    if (w.block) gz_release(s);\n"
+            "    JIPG_FREE(w.scratch);\n"
+            "    const char *error = gz_close(s, done);\n"
+            "    if (!ok && e.expected && err && !err->expected) {\n"
+            "        *err = e;\n"
+            "        err->offset = at;\n"
+            "    }\n"
+            "    if (done && error) ok = gz_fail(err, w.taken, \"gzip stream\", error);\n"
+            "    return ok;\n"
+            "}\n");
+}
+
+// --pipeline: parse_<Head>_files() reads whole files into pooled buffers,
+// zero padded at the end, and parses them on worker threads. On Linux the
+// calling thread drives the reads through io_uring (raw syscalls, no
+// liburing) so up to JIPG_PIPELINE_DEPTH are in flight; elsewhere, or when
+// io_uring is not available, every thread reads and parses files on its own.
+static void jipg_emit_pipeline_helpers(FILE *source) {
+    fprintf(source,
+            "#define PIPE_DEPTH " STR(JIPG_PIPELINE_DEPTH) "\n"
+            "#define PIPE_PADDING " STR(JIPG_PIPELINE_PADDING) "\n");
+    fprintf(source,
+            "typedef bool (*Pipe_Parse_Fn)(const char *json, size_t len, void *res);\n"
+            "\n"
+            "typedef struct {\n"
+            "    char *data;\n"
+            "    size_t cap;\n"
+            "    size_t len;\n"
+            "    size_t done;\n"
+            "    size_t index;\n"
+            "    int fd;\n"
+            "} Pipe_Buf;\n"
+            "\n"
+            "typedef struct {\n"
+            "    const char *const *paths;\n"
+            "    size_t n;\n"
+            "    char *out;\n"
+            "    size_t res_size;\n"
+            "    bool *ok;\n"
+            "    Pipe_Parse_Fn parse;\n"
+            "    atomic_size_t parsed;\n"
+            "\n"
+            "    Pipe_Buf bufs[PIPE_DEPTH];\n"
+            "    pthread_mutex_t lock;\n"
+            "    pthread_cond_t ready;\n"
+            "    pthread_cond_t freed;\n"
+            "    // Buffers free for reads, and read ones waiting for a parse worker.\n"
+            "    size_t free[PIPE_DEPTH];\n"
+            "    size_t free_len;\n"
+            "    size_t queue[PIPE_DEPTH];\n"
+            "    size_t queue_head;\n"
+            "    size_t queue_len;\n"
+            "    bool closed;\n"
+            "    // Fallback: workers read the files themselves.\n"
+            "    atomic_size_t next;\n"
+            "} Pipe;\n"
+            "\n"
+            "static void pipe_result(Pipe *p, size_t index, bool ok) {\n"
+            "    if (p->ok) p->ok[index] = ok;\n"
+            "    if (ok) atomic_fetch_add_explicit(&p->parsed, 1, memory_order_relaxed);\n"
+            "}\n"
+            "\n"
+            "static bool pipe_reserve(Pipe_Buf *b, size_t len) {\n"
+            "    if (len + PIPE_PADDING <= b->cap) return true;\n"
+            "    size_t cap = b->cap ? b->cap : 4096;\n"
+            "    while (cap < len + PIPE_PADDING) cap *= 2;\n"
+            "    char *data = (char *)JIPG_REALLOC(b->data, cap);\n"
+            "    if (!data) return false;\n"
+            "    b->data = data;\n"
+            "    b->cap = cap;\n"
+            "    return true;\n"
+            "}\n"
+            "\n"
+            "// Opens path and sizes b for it; the padding after the content is zeroed.\n"
+            "static bool pipe_open(Pipe_Buf *b, const char *path) {\n"
+            "    b->fd = open(path, O_RDONLY | O_CLOEXEC);\n"
+            "    if (b->fd < 0) return false;\n"
+            "    struct stat st;\n"
+            "    if (fstat(b->fd, &st) != 0 || !pipe_reserve(b, (size_t)st.st_size)) {\n"
+            "        close(b->fd);\n"
+            "        return false;\n"
+            "    }\n"
+            "    b->len = (size_t)st.st_size;\n"
+            "    b->done = 0;\n"
+            "    memset(b->data + b->len, 0, PIPE_PADDING);\n"
+            "    return true;\n"
+            "}\n"
+            "\n"
+            "static void pipe_parse(Pipe *p, Pipe_Buf *b) {\n"
+            "    pipe_result(p, b->index, p->parse(b->data, b->len, p->out + b->index * p->res_size));\n"
+            "}\n"
+            "\n"
+            "// Fallback without io_uring: every worker reads and parses whole files.\n"
+            "static void *pipe_direct_worker(void *arg) {\n"
+            "    Pipe *p = (Pipe *)arg;\n"
+            "    Pipe_Buf b = {0};\n"
+            "    for (;;) {\n"
+            "        size_t i = atomic_fetch_add_explicit(&p->next, 1, memory_order_relaxed);\n"
+            "        if (i >= p->n) break;\n"
+            "        b.index = i;\n"
+            "        if (!pipe_open(&b, p->paths[i])) {\n"
+            "            pipe_result(p, i, false);\n"
+            "            continue;\n"
+            "        }\n"
+            "        while (b.done < b.len) {\n"
+            "            ssize_t got = pread(b.fd, b.data + b.done, b.len - b.done, (off_t)b.done);\n"
+            "            if (got <= 0 && !(got < 0 && errno == EINTR)) break;\n"
+            "            if (got > 0) b.done += (size_t)got;\n"
+            "        }\n"
+            "        close(b.fd);\n"
+            "        if (b.done == b.len)\n"
+            "            pipe_parse(p, &b);\n"
+            "        else\n"
+            "            pipe_result(p, i, false);\n"
+            "    }\n"
+            "    JIPG_FREE(b.data);\n"
+            "    return NULL;\n"
+            "}\n"
+            "\n"
+            "#ifdef __linux__\n"
+            "static void pipe_release(Pipe *p, size_t slot) {\n"
+            "    pthread_mutex_lock(&p->lock);\n"
+            "    p->free[p->free_len++] = slot;\n"
+            "    pthread_cond_signal(&p->freed);\n"
+            "    pthread_mutex_unlock(&p->lock);\n"
+            "}\n"
+            "\n"
+            "static void pipe_ready(Pipe *p, size_t slot) {\n"
+            "    pthread_mutex_lock(&p->lock);\n"
+            "    p->queue[(p->queue_head + p->queue_len++) %% PIPE_DEPTH] = slot;\n"
+            "    pthread_cond_signal(&p->ready);\n"
+            "    pthread_mutex_unlock(&p->lock);\n"
+            "}\n"
+            "\n"
+            "// Blocks only when nothing else can make progress.\n"
+            "static bool pipe_take(Pipe *p, size_t *slot, bool wait) {\n"
+            "    pthread_mutex_lock(&p->lock);\n"
+            "    while (wait && !p->free_len) pthread_cond_wait(&p->freed, &p->lock);\n"
+            "    bool ok = p->free_len > 0;\n"
+            "    if (ok) *slot = p->free[--p->free_len];\n"
+            "    pthread_mutex_unlock(&p->lock);\n"
+            "    return ok;\n"
+            "}\n"
+            "\n"
+            "static void *pipe_worker(void *arg) {\n"
+            "    Pipe *p = (Pipe *)arg;\n"
+            "    pthread_mutex_lock(&p->lock);\n"
+            "    for (;;) {\n"
+            "        while (!p->queue_len && !p->closed) pthread_cond_wait(&p->ready, &p->lock);\n"
+            "        if (!p->queue_len) break;\n"
+            "        size_t slot = p->queue[p->queue_head];\n"
+            "        p->queue_head = (p->queue_head + 1) %% PIPE_DEPTH;\n"
+            "        --p->queue_len;\n"
+            "        pthread_mutex_unlock(&p->lock);\n"
+            "\n"
+            "        pipe_parse(p, p->bufs + slot);\n"
+            "\n"
+            "        pthread_mutex_lock(&p->lock);\n"
+            "        p->free[p->free_len++] = slot;\n"
+            "        pthread_cond_signal(&p->freed);\n"
+            "    }\n"
+            "    pthread_mutex_unlock(&p->lock);\n"
+            "    return NULL;\n"
+            "}\n"
+            "\n"
+            "typedef struct {\n"
+            "    int fd;\n"
+            "    unsigned *sq_tail;\n"
+            "    unsigned *sq_mask;\n"
+            "    unsigned *sq_array;\n"
+            "    unsigned *cq_head;\n"
+            "    unsigned *cq_tail;\n"
+            "    unsigned *cq_mask;\n"
+            "    struct io_uring_sqe *sqes;\n"
+            "    struct io_uring_cqe *cqes;\n"
+            "    void *sq_ptr;\n"
+            "    void *cq_ptr;\n"
+            "    size_t sq_size;\n"
+            "    size_t cq_size;\n"
+            "    size_t sqes_size;\n"
+            "    unsigned pending;\n"
+            "} Pipe_Ring;\n"
+            "\n"
+            "static void pipe_ring_free(Pipe_Ring *r) {\n"
+            "    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);\n"
+            "    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);\n"
+            "    if (r->sq_ptr && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_size);\n"
+            "    close(r->fd);\n"
+            "}\n"
+            "\n"
+            "static bool pipe_ring_init(Pipe_Ring *r) {\n"
+            "    struct io_uring_params params;\n"
+            "    memset(&params, 0, sizeof(params));\n"
+            "    memset(r, 0, sizeof(*r));\n"
+            "    r->fd = (int)syscall(__NR_io_uring_setup, PIPE_DEPTH, &params);\n"
+            "    if (r->fd < 0) return false;\n"
+            "\n"
+            "    r->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);\n"
+            "    r->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);\n"
+            "    bool single = params.features & IORING_FEAT_SINGLE_MMAP;\n"
+            "    if (single && r->cq_size > r->sq_size) r->sq_size = r->cq_size;\n"
+            "    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);\n"
+            "    r->cq_ptr = single ? r->sq_ptr\n"
+            "                       : mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,\n"
+            "                              IORING_OFF_CQ_RING);\n"
+            "    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);\n"
+            "    r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,\n"
+            "                                          r->fd, IORING_OFF_SQES);\n"
+            "    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {\n"
+            "        pipe_ring_free(r);\n"
+            "        return false;\n"
+            "    }\n"
+            "\n"
+            "    char *sq = (char *)r->sq_ptr, *cq = (char *)r->cq_ptr;\n"
+            "    r->sq_tail = (unsigned *)(sq + params.sq_off.tail);\n"
+            "    r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);\n"
+            "    r->sq_array = (unsigned *)(sq + params.sq_off.array);\n"
+            "    r->cq_head = (unsigned *)(cq + params.cq_off.head);\n"
+            "    r->cq_tail = (unsigned *)(cq + params.cq_off.tail);\n"
+            "    r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);\n"
+            "    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);\n"
+            "    return true;\n"
+            "}\n"
+            "\n"
+            "// Queues a read of the rest of slot's file. At most one read per buffer is\n"
+            "// in flight, so the PIPE_DEPTH entries of the ring never overflow.\n"
+            "static void pipe_ring_read(Pipe_Ring *r, Pipe *p, size_t slot) {\n"
+            "    Pipe_Buf *b = p->bufs + slot;\n"
+            "    unsigned tail = *r->sq_tail;\n"
+            "    unsigned idx = tail & *r->sq_mask;\n"
+            "    struct io_uring_sqe *sqe = r->sqes + idx;\n"
+            "    memset(sqe, 0, sizeof(*sqe));\n"
+            "    sqe->opcode = IORING_OP_READ;\n"
+            "    sqe->fd = b->fd;\n"
+            "    sqe->addr = (uint64_t)(uintptr_t)(b->data + b->done);\n"
+            "    sqe->len = (uint32_t)(b->len - b->done < 0x7ffff000 ? b->len - b->done : 0x7ffff000);\n"
+            "    sqe->off = b->done;\n"
+            "    sqe->user_data = slot;\n"
+            "    r->sq_array[idx] = idx;\n"
+            "    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);\n"
+            "    ++r->pending;\n"
+            "}\n"
+            "\n"
+            "// The calling thread keeps up to PIPE_DEPTH reads in flight and hands every\n"
+            "// completed buffer to the parse workers.\n"
+            "static void pipe_run_ring(Pipe *p, Pipe_Ring *ring) {\n"
+            "    Pipe_Ring r = *ring;\n"
+            "    size_t next = 0, inflight = 0;\n"
+            "    while (next < p->n || inflight) {\n"
+            "        size_t slot;\n"
+            "        while (next < p->n && pipe_take(p, &slot, !inflight)) {\n"
+            "            Pipe_Buf *b = p->bufs + slot;\n"
+            "            b->index = next;\n"
+            "            if (!pipe_open(b, p->paths[next++])) {\n"
+            "                pipe_result(p, b->index, false);\n"
+            "                pipe_release(p, slot);\n"
+            "                continue;\n"
+            "            }\n"
+            "            if (b->len == 0) {\n"
+            "                close(b->fd);\n"
+            "                b->fd = -1;\n"
+            "                pipe_ready(p, slot);\n"
+            "                continue;\n"
+            "            }\n"
+            "            pipe_ring_read(&r, p, slot);\n"
+            "            ++inflight;\n"
+            "        }\n"
+            "        if (!inflight) continue;\n"
+            "\n"
+            "        int ret = (int)syscall(__NR_io_uring_enter, r.fd, r.pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);\n"
+            "        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {\n"
+            "            // The buffers of reads still in flight are left to the kernel.\n"
+            "            for (size_t i = 0; i < PIPE_DEPTH; ++i) {\n"
+            "                Pipe_Buf *b = p->bufs + i;\n"
+            "                if (b->fd < 0 || b->done == b->len) continue;\n"
+            "                pipe_result(p, b->index, false);\n"
+            "                b->data = NULL;\n"
+            "            }\n"
+            "            for (; next < p->n; ++next) pipe_result(p, next, false);\n"
+            "            break;\n"
+            "        }\n"
+            "        if (ret > 0) r.pending -= (unsigned)ret;\n"
+            "\n"
+            "        unsigned head = *r.cq_head;\n"
+            "        unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);\n"
+            "        for (; head != tail; ++head) {\n"
+            "            struct io_uring_cqe *cqe = r.cqes + (head & *r.cq_mask);\n"
+            "            size_t slot_done = (size_t)cqe->user_data;\n"
+            "            Pipe_Buf *b = p->bufs + slot_done;\n"
+            "            if (cqe->res > 0) b->done += (size_t)cqe->res;\n"
+            "            if (cqe->res > 0 && b->done < b->len) {\n"
+            "                pipe_ring_read(&r, p, slot_done);\n"
+            "                continue;\n"
+            "            }\n"
+            "            --inflight;\n"
+            "            close(b->fd);\n"
+            "            b->fd = -1;\n"
+            "            if (b->done == b->len) {\n"
+            "                pipe_ready(p, slot_done);\n"
+            "            } else {\n"
+            "                pipe_result(p, b->index, false);\n"
+            "                pipe_release(p, slot_done);\n"
+            "            }\n"
+            "        }\n"
+            "        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);\n"
+            "    }\n"
+            "}\n"
+            "#endif\n"
+            "\n"
+            "static size_t pipe_run(const char *const *paths, size_t n, void *out, size_t res_size, bool *ok, unsigned workers,\n"
+            "                       Pipe_Parse_Fn parse) {\n"
+            "    Pipe *p = (Pipe *)JIPG_REALLOC(NULL, sizeof(Pipe));\n"
+            "    pthread_t *threads = (pthread_t *)JIPG_REALLOC(NULL, (workers ? workers : 1) * sizeof(pthread_t));\n"
+            "    if (!p || !threads) {\n"
+            "        JIPG_FREE(p);\n"
+            "        JIPG_FREE(threads);\n"
+            "        for (size_t i = 0; ok && i < n; ++i) ok[i] = false;\n"
+            "        return 0;\n"
+            "    }\n"
+            "    memset(p, 0, sizeof(*p));\n"
+            "    p->paths = paths;\n"
+            "    p->n = n;\n"
+            "    p->out = (char *)out;\n"
+            "    p->res_size = res_size;\n"
+            "    p->ok = ok;\n"
+            "    p->parse = parse;\n"
+            "    atomic_init(&p->parsed, 0);\n"
+            "    atomic_init(&p->next, 0);\n"
+            "    pthread_mutex_init(&p->lock, NULL);\n"
+            "    pthread_cond_init(&p->ready, NULL);\n"
+            "    pthread_cond_init(&p->freed, NULL);\n"
+            "    for (size_t i = 0; i < PIPE_DEPTH; ++i) {\n"
+            "        p->bufs[i].fd = -1;\n"
+            "        p->free[p->free_len++] = i;\n"
+            "    }\n"
+            "\n"
+            "    size_t spawned = 0;\n"
+            "#ifdef __linux__\n"
+            "    Pipe_Ring ring;\n"
+            "    if (pipe_ring_init(&ring)) {\n"
+            "        for (; spawned < workers; ++spawned)\n"
+            "            if (pthread_create(threads + spawned, NULL, pipe_worker, p) != 0) break;\n"
+            "        if (spawned) pipe_run_ring(p, &ring);\n"
+            "        pipe_ring_free(&ring);\n"
+            "\n"
+            "        pthread_mutex_lock(&p->lock);\n"
+            "        p->closed = true;\n"
+            "        pthread_cond_broadcast(&p->ready);\n"
+            "        pthread_mutex_unlock(&p->lock);\n"
+            "        for (size_t i = 0; i < spawned; ++i) pthread_join(threads[i], NULL);\n"
+            "    }\n"
+            "#endif\n"
+            "    // Without io_uring, or without a worker to hand buffers to, the threads\n"
+            "    // read and parse files on their own, the calling thread among them.\n"
+            "    if (!spawned) {\n"
+            "        for (; spawned + 1 < workers; ++spawned)\n"
+            "            if (pthread_create(threads + spawned, NULL, pipe_direct_worker, p) != 0) break;\n"
+            "        pipe_direct_worker(p);\n"
+            "        for (size_t i = 0; i < spawned; ++i) pthread_join(threads[i], NULL);\n"
+            "    }\n"
+            "\n"
+            "    for (size_t i = 0; i < PIPE_DEPTH; ++i) JIPG_FREE(p->bufs[i].data);\n"
+            "    pthread_mutex_destroy(&p->lock);\n"
+            "    pthread_cond_destroy(&p->ready);\n"
+            "    pthread_cond_destroy(&p->freed);\n"
+            "    size_t parsed = atomic_load(&p->parsed);\n"
+            "    JIPG_FREE(threads);\n"
+            "    JIPG_FREE(p);\n"
+            "    return parsed;\n"
+            "}\n");
+}
+
+static void jipg_emit_head_pipeline(FILE *source, Jipg_Value *value) {
+    const char *head = value->head;
+    fprintf(source,
+            "static bool pipe_parse_%s(const char *json, size_t len, void *res) {\n"
+            "    return parse_%s(json, len, (%s *)res);\n"
+            "}\n"
+            "size_t parse_%s_files(const char *const *paths, size_t n, %s *out, bool *ok, unsigned workers) {\n"
+            "    return pipe_run(paths, n, out, sizeof(*out), ok, workers, pipe_parse_%s);\n"
+            "}\n",
+            head, head, head, head, head, head);
+}
+
+// When runtime_header_name is set the lexer and helpers are not emitted; they
+// come from the shared runtime translation unit instead.
+static void jipg_emit_source(FILE *source, Jipg_Value **values, size_t value_count, const char *header_name,
+                             const char *runtime_header_name) {
+    static const char *source_includes[] = {
+        "<stdbool.h>",
+        "<stdint.h>",
+        "<stdlib.h>",
+        "<string.h>",
+        "<stddef.h>",
+        "<ctype.h>",
+        "<stdatomic.h>",
+    };
+    static const char *pipeline_includes[] = {
+        "<errno.h>",
+        "<fcntl.h>",
+        "<pthread.h>",
+        "<sys/stat.h>",
+        "<unistd.h>",
+    };
+    static const char *gzip_includes[] = {
+        "<errno.h>",
+        "<pthread.h>",
+        "<unistd.h>",
+        "<zlib.h>",
+    };
+    static const char *snapshot_includes[] = {
+        "<stdio.h>",
+        "<fcntl.h>",
+        "<sys/mman.h>",
+        "<sys/stat.h>",
+        "<unistd.h>",
+    };
+
+    // A single file header is past its includes here, so there the includer
+    // has to define _GNU_SOURCE.
+    if (jipg_global_context.pipeline || jipg_global_context.result_arena || jipg_global_context.gzip)
+        jipg_emit_gnu_source(source);
+    if (header_name)
+        fprintf(source, "#include \"%s\"\n", header_name);
+    if (runtime_header_name)
+        fprintf(source, "#include \"%s\"\n", runtime_header_name);
+
+    for (size_t i = 0; i < ARRAY_SIZE(source_includes); ++i)
+        fprintf(source, "#include %s\n", source_includes[i]);
+    if (jipg_global_context.snapshot) {
+        for (size_t i = 0; i < ARRAY_SIZE(snapshot_includes); ++i)
+            fprintf(source, "#include %s\n", snapshot_includes[i]);
+    }
+    if (jipg_global_context.pipeline) {
+        for (size_t i = 0; i < ARRAY_SIZE(pipeline_includes); ++i)
+            fprintf(source, "#include %s\n", pipeline_includes[i]);
+        fprintf(source,
+                "#ifdef __linux__\n"
+                "#include <linux/io_uring.h>\n"
+                "#include <sys/mman.h>\n"
+                "#include <sys/syscall.h>\n"
+                "#endif\n");
+    }
+    if (jipg_global_context.gzip) {
+        for (size_t i = 0; i < ARRAY_SIZE(gzip_includes); ++i)
+            fprintf(source, "#include %s\n", gzip_includes[i]);
+    }
+    if (jipg_global_context.result_arena && !runtime_header_name) jipg_emit_arena_includes(source);
+    jipg_emit_allocator_macros(source);
+    fprintf(source, "\n");
+
+    if (!runtime_header_name) {
+        jipg_emit_lexer_types(source);
+        jipg_emit_lexer_inline(source);
+        jipg_emit_lexer_impl(source, "static inline ", "");
+        jipg_emit_helpers(source, "static inline ", "");
+    }
+
+    if (jipg_global_context.instrument && value_count) jipg_emit_stats_hooks(source, values, value_count);
+
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_value_leaves(source, values[i]);
+    // Merges release the values they replace, parse_<Head>_each() its items.
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_release_functions(source, values[i], false);
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_release_functions(source, values[i], true);
+    jipg_emit_frames_parser(source, values, value_count);
+    jipg_emit_check_frames(source, values, value_count);
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_head_value_parser(source, values[i], i);
+
+    bool each = false;
+    for (size_t i = 0; i < value_count; ++i) each |= values[i]->kind == JIPG_KIND_ARRAY;
+    if (each) {
+        for (size_t i = 0; i < value_count; ++i)
+            if (values[i]->kind == JIPG_KIND_ARRAY) jipg_emit_head_each(source, values, value_count, i);
+    }
+
+    if (jipg_global_context.gzip && each) {
+        jipg_emit_gzip_helpers(source);
+        for (size_t i = 0; i < value_count; ++i)
+            if (values[i]->kind == JIPG_KIND_ARRAY) jipg_emit_head_gzip(source, values, value_count, i);
+    }
+
+    if (jipg_global_context.pipeline && value_count) {
+        jipg_emit_pipeline_helpers(source);
+        for (size_t i = 0; i < value_count; ++i) jipg_emit_head_pipeline(source, values[i]);
+    }
+
+    if (jipg_global_context.snapshot && value_count) {
+        uint64_t schema = jipg_snapshot_schema_hash(values, value_count);
+        jipg_emit_snapshot_helpers(source, values, value_count);
+        for (size_t i = 0; i < value_count; ++i) jipg_emit_head_snapshot(source, values[i], schema);
+    }
+}
+
+// --lang=c++ emits one header-only C++17 parser instead. Strings are views of
+// the input (escaped ones are decoded into a jipg::Arena), arrays are spans
+// into the arena, and every type gets a jipg::Parser<> specialization whose
+// key dispatch switches on constexpr key hashes, so the compiler can inline
+// the whole parse into parse_<Head>().
+static void jipg_emit_cpp_runtime(FILE *header) {
+    static const char *cpp_includes[] = {
+        "<charconv>",
+        "<cstddef>",
+        "<cstdint>",
+        "<cstdlib>",
+        "<memory>",
+        "<new>",
+        "<optional>",
+        "<string_view>",
+        "<system_error>",
+        "<type_traits>",
+        "<variant>",
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(cpp_includes); ++i)
+        fprintf(header, "#include %s\n", cpp_includes[i]);
+    fprintf(header, "\n");
+
+    fprintf(header,
+            "#ifndef JIPG_CPP_RUNTIME_DEFINED\n"
+            "#define JIPG_CPP_RUNTIME_DEFINED\n"
+            "#ifndef JIPG_MAX_DEPTH\n"
+            "#define JIPG_MAX_DEPTH 1024\n"
+            "#endif\n"
+            "#ifndef JIPG_REALLOC\n"
+            "#define JIPG_REALLOC std::realloc\n"
+            "#endif\n"
+            "#ifndef JIPG_FREE\n"
+            "#define JIPG_FREE std::free\n"
+            "#endif\n"
+            "\n"
+            "namespace jipg {\n"
+            "\n"
+            "enum class Errc : uint32_t {\n"
+            "    ok,\n"
+            "    syntax,\n"
+            "    unexpected_type,\n"
+            "    missing_member,\n"
+            "    unknown_tag,\n"
+            "    too_many_items,\n"
+            "    too_deep,\n"
+            "    out_of_memory,\n"
+            "};\n"
+            "\n"
+            "struct Result {\n"
+            "    Errc ec = Errc::ok;\n"
+            "    // Byte offset of the token the parse failed at.\n"
+            "    size_t offset = 0;\n"
+            "    explicit operator bool() const noexcept { return ec == Errc::ok; }\n"
+            "};\n"
+            "\n"
+            "// A JIPG_NUMBER_RAW member: the text of the number in the input, converted\n"
+            "// on each call.\n"
+            "struct Number {\n"
+            "    std::string_view text;\n"
+            "\n"
+            "    bool as_i64(int64_t &res) const noexcept {\n"
+            "        const char *end = text.data() + text.size();\n"
+            "        auto [p, ec] = std::from_chars(text.data(), end, res);\n"
+            "        return ec == std::errc() && p == end;\n"
+            "    }\n"
+            "    bool as_f64(double &res) const noexcept {\n"
+            "        const char *end = text.data() + text.size();\n"
+            "        auto [p, ec] = std::from_chars(text.data(), end, res);\n"
+            "        return ec == std::errc() && p == end;\n"
+            "    }\n"
+            "};\n"
+            "\n"
+            "// Owns what a parse allocates: items of arrays and maps, nodes behind\n"
+            "// JIPG_REF and strings that had escapes. Everything else is a view of the\n"
+            "// input, so both must outlive the parsed value.\n"
+            "class Arena {\n"
+            "  public:\n"
+            "    Arena() noexcept = default;\n"
+            "    Arena(const Arena &) = delete;\n"
+            "    Arena &operator=(const Arena &) = delete;\n"
+            "    ~Arena() { release(); }\n"
+            "\n"
+            "    void release() noexcept {\n"
+            "        while (head_) {\n"
+            "            Block *prev = head_->prev;\n"
+            "            JIPG_FREE(head_);\n"
+            "            head_ = prev;\n"
+            "        }\n"
+            "        used_ = cap_ = 0;\n"
+            "    }\n"
+            "\n"
+            "    void *allocate(size_t size, size_t align) noexcept {\n"
+            "        size_t at = (used_ + align - 1) & ~(align - 1);\n"
+            "        if (!head_ || at + size > cap_) {\n"
+            "            size_t cap = size > block_size ? size : block_size;\n"
+            "            Block *block = static_cast<Block *>(JIPG_REALLOC(nullptr, sizeof(Block) + cap));\n"
+            "            if (!block) return nullptr;\n"
+            "            block->prev = head_;\n"
+            "            head_ = block;\n"
+            "            cap_ = cap;\n"
+            "            at = 0;\n"
+            "        }\n"
+            "        used_ = at + size;\n"
+            "        return reinterpret_cast<char *>(head_ + 1) + at;\n"
+            "    }\n"
+            "\n"
+            "    template <class T>\n"
+            "    T *make(size_t n) noexcept {\n"
+            "        static_assert(std::is_trivially_destructible_v<T>, \"arena values are never destroyed\");\n"
+            "        if (n > SIZE_MAX / sizeof(T)) return nullptr;\n"
+            "        T *res = static_cast<T *>(allocate(n * sizeof(T), alignof(T)));\n"
+            "        if (res)\n"
+            "            for (size_t i = 0; i < n; ++i) new (res + i) T();\n"
+            "        return res;\n"
+            "    }\n"
+            "\n"
+            "  private:\n"
+            "    struct alignas(std::max_align_t) Block {\n"
+            "        Block *prev;\n"
+            "    };\n"
+            "    static constexpr size_t block_size = 64 * 1024;\n"
+            "    Block *head_ = nullptr;\n"
+            "    size_t used_ = 0;\n"
+            "    size_t cap_ = 0;\n"
+            "};\n"
+            "\n"
+            "// Items of a JSON array, at most Cap of them when Cap is not 0.\n"
+            "template <class T, size_t Cap = 0>\n"
+            "struct Span {\n"
+            "    T *data = nullptr;\n"
+            "    size_t size = 0;\n"
+            "\n"
+            "    T *begin() const noexcept { return data; }\n"
+            "    T *end() const noexcept { return data + size; }\n"
+            "    T &operator[](size_t i) const noexcept { return data[i]; }\n"
+            "    bool empty() const noexcept { return size == 0; }\n"
+            "};\n"
+            "\n"
+            "constexpr uint64_t key_hash_word(uint64_t h, uint64_t w) noexcept {\n"
+            "    h = (h ^ w) * " STR(JIPG_KEY_HASH_MUL) ";\n"
+            "    return h ^ (h >> 32);\n"
+            "}\n"
+            "\n"
+            "// The generator's key hash, usable in case labels.\n"
+            "constexpr uint64_t key_hash(std::string_view key) noexcept {\n"
+            "    uint64_t h = key.size() * " STR(JIPG_KEY_HASH_SEED) ";\n"
+            "    for (size_t i = 0; i < key.size(); i += 8) {\n"
+            "        uint64_t w = 0;\n"
+            "        for (size_t k = 0; k < 8 && i + k < key.size(); ++k)\n"
+            "            w |= uint64_t(static_cast<unsigned char>(key[i + k])) << (8 * k);\n"
+            "        h = key_hash_word(h, w);\n"
+            "    }\n"
+            "    h ^= h >> 29;\n"
+            "    h *= " STR(JIPG_KEY_HASH_SEED) ";\n"
+            "    h ^= h >> 32;\n"
+            "    return h ? h : 1;\n"
+            "}\n"
+            "\n"
+            "// Open addressing table of a JSON object with dynamic keys.\n"
+            "template <class T>\n"
+            "struct Map {\n"
+            "    struct Entry {\n"
+            "        std::string_view key;\n"
+            "        T value;\n"
+            "    };\n"
+            "    // hashes[i] == 0 marks an empty slot.\n"
+            "    uint64_t *hashes = nullptr;\n"
+            "    Entry *entries = nullptr;\n"
+            "    size_t size = 0;\n"
+            "    size_t cap = 0;\n"
+            "\n"
+            "    size_t slot(uint64_t h, std::string_view key) const noexcept {\n"
+            "        size_t mask = cap - 1;\n"
+            "        size_t i = h & mask;\n"
+            "        for (; hashes[i]; i = (i + 1) & mask)\n"
+            "            if (hashes[i] == h && entries[i].key == key) break;\n"
+            "        return i;\n"
+            "    }\n"
+            "\n"
+            "    const T *find(std::string_view key) const noexcept {\n"
+            "        if (!cap) return nullptr;\n"
+            "        size_t i = slot(key_hash(key), key);\n"
+            "        return hashes[i] ? &entries[i].value : nullptr;\n"
+            "    }\n"
+            "\n"
+            "    template <class F>\n"
+            "    void for_each(F &&f) const {\n"
+            "        for (size_t i = 0; i < cap; ++i)\n"
+            "            if (hashes[i]) f(entries[i].key, entries[i].value);\n"
+            "    }\n"
+            "};\n"
+            "\n"
+            "struct Token {\n"
+            "    enum Type : uint8_t {\n"
+            "        illegal,\n"
+            "        eof,\n"
+            "        lbrace,\n"
+            "        rbrace,\n"
+            "        lbracket,\n"
+            "        rbracket,\n"
+            "        colon,\n"
+            "        comma,\n"
+            "        string,\n"
+            "        number,\n"
+            "        true_,\n"
+            "        false_,\n"
+            "        null,\n"
+            "    };\n"
+            "    Type type = illegal;\n"
+            "    bool escaped = false;\n"
+            "    const char *lit = nullptr;\n"
+            "    size_t len = 0;\n"
+            "\n"
+            "    std::string_view view() const noexcept { return {lit, len}; }\n"
+            "};\n"
+            "\n"
+            "inline bool token_equals(const Token &tok, std::string_view s) noexcept;\n"
+            "\n"
+            "class Lexer {\n"
+            "  public:\n"
+            "    explicit Lexer(std::string_view json) noexcept : begin_(json.data()), p_(json.data()), end_(json.data() + json.size()) {}\n"
+            "\n"
+            "    Result result;\n"
+            "\n"
+            "    const char *pos() const noexcept { return p_; }\n"
+            "    void rewind(const char *p) noexcept { p_ = p; }\n"
+            "\n"
+            "    bool fail(Errc ec, const Token &tok) noexcept {\n"
+            "        if (result.ec == Errc::ok) {\n"
+            "            result.ec = ec;\n"
+            "            result.offset = tok.lit ? tok.lit - begin_ : p_ - begin_;\n"
+            "        }\n"
+            "        return false;\n"
+            "    }\n"
+            "    // A token of the wrong type, or one that is not valid JSON.\n"
+            "    bool fail_type(const Token &tok) noexcept {\n"
+            "        return fail(tok.type == Token::illegal ? Errc::syntax : Errc::unexpected_type, tok);\n"
+            "    }\n"
+            "\n"
+            "    bool enter(const Token &tok) noexcept { return ++depth_ <= JIPG_MAX_DEPTH || fail(Errc::too_deep, tok); }\n"
+            "    void leave() noexcept { --depth_; }\n"
+            "\n"
+            "    Token next() noexcept {\n"
+            "        while (p_ < end_ && (*p_ == ' ' || *p_ == '\\n' || *p_ == '\\r' || *p_ == '\\t')) ++p_;\n"
+            "        Token tok;\n"
+            "        tok.lit = p_;\n"
+            "        tok.len = 1;\n"
+            "        if (p_ == end_) {\n"
+            "            tok.type = Token::eof;\n"
+            "            tok.len = 0;\n"
+            "            return tok;\n"
+            "        }\n"
+            "        switch (*p_) {\n"
+            "            case '{': tok.type = Token::lbrace; break;\n"
+            "            case '}': tok.type = Token::rbrace; break;\n"
+            "            case '[': tok.type = Token::lbracket; break;\n"
+            "            case ']': tok.type = Token::rbracket; break;\n"
+            "            case ':': tok.type = Token::colon; break;\n"
+            "            case ',': tok.type = Token::comma; break;\n"
+            "            case '\"': return scan_string(tok);\n"
+            "            case 't': return word(tok, \"true\", Token::true_);\n"
+            "            case 'f': return word(tok, \"false\", Token::false_);\n"
+            "            case 'n': return word(tok, \"null\", Token::null);\n"
+            "            default: return scan_number(tok);\n"
+            "        }\n"
+            "        ++p_;\n"
+            "        return tok;\n"
+            "    }\n"
+            "\n"
+            "    bool skip_value() noexcept {\n"
+            "        size_t depth = 0;\n"
+            "        do {\n"
+            "            Token tok = next();\n"
+            "            switch (tok.type) {\n"
+            "                case Token::lbrace:\n"
+            "                case Token::lbracket:\n"
+            "                    ++depth;\n"
+            "                    break;\n"
+            "                case Token::rbrace:\n"
+            "                case Token::rbracket:\n"
+            "                    if (depth == 0) return fail(Errc::syntax, tok);\n"
+            "                    --depth;\n"
+            "                    break;\n"
+            "                case Token::illegal:\n"
+            "                case Token::eof:\n"
+            "                    return fail(Errc::syntax, tok);\n"
+            "                default:\n"
+            "                    break;\n"
+            "            }\n"
+            "        } while (depth);\n"
+            "        return true;\n"
+            "    }\n"
+            "\n"
+            "    // Scans the members of an object, positioned after its '{', for key and\n"
+            "    // returns the token of its value.\n"
+            "    bool find_key(std::string_view key, Token &res) noexcept {\n"
+            "        Token tok = next();\n"
+            "        while (tok.type == Token::string) {\n"
+            "            bool match = token_equals(tok, key);\n"
+            "            tok = next();\n"
+            "            if (tok.type != Token::colon) return fail(Errc::syntax, tok);\n"
+            "            if (match) {\n"
+            "                res = next();\n"
+            "                return true;\n"
+            "            }\n"
+            "            if (!skip_value()) return false;\n"
+            "            tok = next();\n"
+            "            if (tok.type == Token::comma) tok = next();\n"
+            "        }\n"
+            "        return fail(Errc::missing_member, tok);\n"
+            "    }\n"
+            "\n"
+            "    // Counts the members of an object, positioned after its '{'.\n"
+            "    bool count_members(size_t &count) noexcept {\n"
+            "        const char *start = p_;\n"
+            "        count = 0;\n"
+            "        Token tok = next();\n"
+            "        while (tok.type == Token::string) {\n"
+            "            ++count;\n"
+            "            tok = next();\n"
+            "            if (tok.type != Token::colon) return fail(Errc::syntax, tok);\n"
+            "            if (!skip_value()) return false;\n"
+            "            tok = next();\n"
+            "            if (tok.type == Token::comma) tok = next();\n"
+            "        }\n"
+            "        p_ = start;\n"
+            "        return tok.type == Token::rbrace || fail(Errc::syntax, tok);\n"
+            "    }\n"
+            "\n"
+            "  private:\n"
+            "    const char *begin_;\n"
+            "    const char *p_;\n"
+            "    const char *end_;\n"
+            "    uint32_t depth_ = 0;\n"
+            "\n"
+            "    Token word(Token tok, std::string_view w, Token::Type type) noexcept {\n"
+            "        if (size_t(end_ - p_) < w.size() || std::string_view(p_, w.size()) != w) return tok;\n"
+            "        tok.type = type;\n"
+            "        tok.len = w.size();\n"
+            "        p_ += w.size();\n"
+            "        return tok;\n"
+            "    }\n"
+            "\n"
+            "    static bool is_digit(char c) noexcept { return c >= '0' && c <= '9'; }\n"
+            "\n"
+            "    Token scan_number(Token tok) noexcept {\n"
+            "        const char *p = p_;\n"
+            "        if (p < end_ && *p == '-') ++p;\n"
+            "        if (p == end_ || !is_digit(*p)) return tok;\n"
+            "        while (p < end_ && is_digit(*p)) ++p;\n"
+            "        if (p < end_ && *p == '.') {\n"
+            "            if (++p == end_ || !is_digit(*p)) return tok;\n"
+            "            while (p < end_ && is_digit(*p)) ++p;\n"
+            "        }\n"
+            "        if (p < end_ && (*p == 'e' || *p == 'E')) {\n"
+            "            if (++p < end_ && (*p == '+' || *p == '-')) ++p;\n"
+            "            if (p == end_ || !is_digit(*p)) return tok;\n"
+            "            while (p < end_ && is_digit(*p)) ++p;\n"
+            "        }\n"
+            "        tok.type = Token::number;\n"
+            "        tok.len = p - p_;\n"
+            "        p_ = p;\n"
+            "        return tok;\n"
+            "    }\n"
+            "\n"
+            "    static bool is_hex(char c) noexcept { return is_digit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f'); }\n"
+            "\n"
+            "    // Length of the UTF-8 sequence at s, or 0 if it is not valid.\n"
+            "    static size_t utf8_sequence(const unsigned char *s, size_t n) noexcept {\n"
+            "        unsigned char lo = 0x80, hi = 0xBF;\n"
+            "        size_t len;\n"
+            "        if (s[0] >= 0xC2 && s[0] <= 0xDF) {\n"
+            "            len = 2;\n"
+            "        } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {\n"
+            "            len = 3;\n"
+            "            if (s[0] == 0xE0) lo = 0xA0;\n"
+            "            if (s[0] == 0xED) hi = 0x9F;\n"
+            "        } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {\n"
+            "            len = 4;\n"
+            "            if (s[0] == 0xF0) lo = 0x90;\n"
+            "            if (s[0] == 0xF4) hi = 0x8F;\n"
+            "        } else {\n"
+            "            return 0;\n"
+            "        }\n"
+            "        if (n < len || s[1] < lo || s[1] > hi) return 0;\n"
+            "        for (size_t i = 2; i < len; ++i)\n"
+            "            if ((s[i] & 0xC0) != 0x80) return 0;\n"
+            "        return len;\n"
+            "    }\n"
+            "\n"
+            "    Token scan_string(Token tok) noexcept {\n"
+            "        const char *p = p_ + 1;\n"
+            "        while (p < end_) {\n"
+            "            unsigned char c = static_cast<unsigned char>(*p);\n"
+            "            if (c == '\"') {\n"
+            "                tok.type = Token::string;\n"
+            "                tok.lit = p_ + 1;\n"
+            "                tok.len = p - tok.lit;\n"
+            "                p_ = p + 1;\n"
+            "                return tok;\n"
+            "            }\n"
+            "            if (c == '\\\\') {\n"
+            "                tok.escaped = true;\n"
+            "                if (end_ - p < 2) break;\n"
+            "                switch (p[1]) {\n"
+            "                    case '\"': case '\\\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':\n"
+            "                        p += 2;\n"
+            "                        continue;\n"
+            "                    case 'u':\n"
+            "                        if (end_ - p < 6 || !is_hex(p[2]) || !is_hex(p[3]) || !is_hex(p[4]) || !is_hex(p[5])) return tok;\n"
+            "                        p += 6;\n"
+            "                        continue;\n"
+            "                    default:\n"
+            "                        return tok;\n"
+            "                }\n"
+            "            }\n"
+            "            if (c < 0x20) return tok;\n"
+            "            if (c < 0x80) {\n"
+            "                ++p;\n"
+            "                continue;\n"
+            "            }\n"
+            "            size_t n = utf8_sequence(reinterpret_cast<const unsigned char *>(p), end_ - p);\n"
+            "            if (!n) return tok;\n"
+            "            p += n;\n"
+            "        }\n"
+            "        return tok;\n"
+            "    }\n"
+            "};\n"
+            "\n"
+            "template <class T, class = void>\n"
+            "struct Parser;\n"
+            "\n"
+            "template <>\n"
+            "struct Parser<bool> {\n"
+            "    static bool parse(Lexer &l, bool &res, Arena &) noexcept {\n"
+            "        Token tok = l.next();\n"
+            "        if (tok.type == Token::true_ || tok.type == Token::false_) {\n"
+            "            res = tok.type == Token::true_;\n"
+            "            return true;\n"
+            "        }\n"
+            "        return l.fail_type(tok);\n"
+            "    }\n"
+            "};\n"
+            "\n"
+            "template <class T>\n"
+            "struct Parser<T, std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool>>> {\n"
+            "    static bool parse(Lexer &l, T &res, Arena &) noexcept {\n"
+            "        Token tok = l.next();\n"
+            "        if (tok.type != Token::number) return l.fail_type(tok);\n"
+            "        auto [end, ec] = std::from_chars(tok.lit, tok.lit + tok.len, res);\n"
+            "        if (ec != std::errc() || end != tok.lit + tok.len) return l.fail(Errc::unexpected_type, tok);\n"
+            "        return true;\n"
+            "    }\n"
+            "};\n"
+            "\n"
+            "template <>\n"
+            "struct Parser<Number> {\n"
+            "    static bool parse(Lexer &l, Number &res, Arena &) noexcept {\n"
+            "        Token tok = l.next();\n"
+            "        if (tok.type != Token::number) return l.fail_type(tok);\n"
+            "        res.text = std::string_view(tok.lit, tok.len);\n"
+            "        return true;\n"
+            "    }\n"
+            "};\n"
+            "\n"
+            "inline uint32_t read_hex4(const char *s) noexcept {\n"
+            "    uint32_t res = 0;\n"
+            "    for (size_t i = 0; i < 4; ++i) {\n"
+            "        char c = s[i];\n"
+            "        res = res * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);\n"
+            "    }\n"
+            "    return res;\n"
+            "}\n"
+            "\n"
+            "// Decodes the escapes of a string token into out, which must hold tok.len\n"
+            "// bytes. Returns the decoded length or SIZE_MAX on an unpaired surrogate.\n"
+            "inline size_t decode_string(const Token &tok, char *out) noexcept {\n"
+            "    const char *s = tok.lit;\n"
+            "    const char *end = s + tok.len;\n"
+            "    char *o = out;\n"
+            "    while (s < end) {\n"
+            "        if (*s != '\\\\') {\n"
+            "            *o++ = *s++;\n"
+            "            continue;\n"
+            "        }\n"
+            "        char c = s[1];\n"
+            "        s += 2;\n"
+            "        switch (c) {\n"
+            "            case 'b': *o++ = '\\b'; break;\n"
+            "            case 'f': *o++ = '\\f'; break;\n"
+            "            case 'n': *o++ = '\\n'; break;\n"
+            "            case 'r': *o++ = '\\r'; break;\n"
+            "            case 't': *o++ = '\\t'; break;\n"
+            "            case 'u': {\n"
+            "                uint32_t cp = read_hex4(s);\n"
+            "                s += 4;\n"
+            "                if (cp >= 0xD800 && cp <= 0xDBFF) {\n"
+            "                    if (end - s < 6 || s[0] != '\\\\' || s[1] != 'u') return SIZE_MAX;\n"
+            "                    uint32_t lo = read_hex4(s + 2);\n"
+            "                    if (lo < 0xDC00 || lo > 0xDFFF) return SIZE_MAX;\n"
+            "                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);\n"
+            "                    s += 6;\n"
+            "                } else if (cp >= 0xDC00 && cp <= 0xDFFF) {\n"
+            "                    return SIZE_MAX;\n"
+            "                }\n"
+            "                if (cp < 0x80) {\n"
+            "                    *o++ = char(cp);\n"
+            "                } else if (cp < 0x800) {\n"
+            "                    *o++ = char(0xC0 | cp >> 6);\n"
+            "                    *o++ = char(0x80 | (cp & 0x3F));\n"
+            "                } else if (cp < 0x10000) {\n"
+            "                    *o++ = char(0xE0 | cp >> 12);\n"
+            "                    *o++ = char(0x80 | (cp >> 6 & 0x3F));\n"
+            "                    *o++ = char(0x80 | (cp & 0x3F));\n"
+            "                } else {\n"
+            "                    *o++ = char(0xF0 | cp >> 18);\n"
+            "                    *o++ = char(0x80 | (cp >> 12 & 0x3F));\n"
+            "                    *o++ = char(0x80 | (cp >> 6 & 0x3F));\n"
+            "                    *o++ = char(0x80 | (cp & 0x3F));\n"
+            "                }\n"
+            "            } break;\n"
+            "            default: *o++ = c; break;\n"
+            "        }\n"
+            "    }\n"
+            "    return o - out;\n"
+            "}\n"
+            "\n"
+            "// Whether a string token decodes to s, for the keys that are matched\n"
+            "// without being kept.\n"
+            "inline bool token_equals(const Token &tok, std::string_view s) noexcept {\n"
+            "    if (!tok.escaped) return tok.view() == s;\n"
+            "    if (tok.len < s.size()) return false;\n"
+            "    char buf[256];\n"
+            "    char *out = tok.len <= sizeof(buf) ? buf : static_cast<char *>(JIPG_REALLOC(nullptr, tok.len));\n"
+            "    if (!out) return false;\n"
+            "    size_t len = decode_string(tok, out);\n"
+            "    bool res = len != SIZE_MAX && std::string_view(out, len) == s;\n"
+            "    if (out != buf) JIPG_FREE(out);\n"
+            "    return res;\n"
+            "}\n"
+            "\n"
+            "// A view of the input unless the string has escapes, which are decoded into\n"
+            "// the arena.\n"
+            "inline bool string_value(Lexer &l, const Token &tok, std::string_view &res, Arena &arena) noexcept {\n"
+            "    if (!tok.escaped) {\n"
+            "        res = tok.view();\n"
+            "        return true;\n"
+            "    }\n"
+            "    char *out = arena.make<char>(tok.len);\n"
+            "    if (!out) return l.fail(Errc::out_of_memory, tok);\n"
+            "    size_t len = decode_string(tok, out);\n"
+            "    if (len == SIZE_MAX) return l.fail(Errc::syntax, tok);\n"
+            "    res = std::string_view(out, len);\n"
+            "    return true;\n"
+            "}\n"
+            "\n"
+            "template <>\n"
+            "struct Parser<std::string_view> {\n"
+            "    static bool parse(Lexer &l, std::string_view &res, Arena &arena) noexcept {\n"
+            "        Token tok = l.next();\n"
+            "        if (tok.type != Token::string) return l.fail_type(tok);\n"
+            "        return string_value(l, tok, res, arena);\n"
+            "    }\n"
+            "};\n"
+            "\n"
+            "// Nodes behind JIPG_REF.\n"
+            "template <class T>\n"
+            "struct Parser<T *> {\n"
+            "    static bool parse(Lexer &l, T *&res, Arena &arena) noexcept {\n"
+            "        if (!res && !(res = arena.make<T>(1))) return l.fail(Errc::out_of_memory, Token());\n"
+            "        return Parser<T>::parse(l, *res, arena);\n"
+            "    }\n"
+            "};\n"
+            "\n"
+            "// Items are collected in arena blocks that double as they fill up.\n"
+            "template <class T, size_t Cap>\n"
+            "struct Parser<Span<T, Cap>> {\n"
+            "    static bool parse(Lexer &l, Span<T, Cap> &res, Arena &arena) noexcept {\n"
+            "        Token tok = l.next();\n"
+            "        if (tok.type != Token::lbracket) return l.fail_type(tok);\n"
+            "        if (!l.enter(tok)) return false;\n"
+            "        size_t cap = 0;\n"
+            "        res = Span<T, Cap>();\n"
+            "        for (;;) {\n"
+            "            const char *save = l.pos();\n"
+            "            tok = l.next();\n"
+            "            if (tok.type == Token::rbracket) break;\n"
+            "            if (tok.type != Token::comma) l.rewind(save);\n"
+            "            if (res.size == cap) {\n"
+            "                if (Cap && cap == Cap) return l.fail(Errc::too_many_items, tok);\n"
+            "                size_t new_cap = Cap ? Cap : cap ? 2 * cap : " STR(JIPG_INIT_LIST_CAP) ";\n"
+            "                T *items = arena.make<T>(new_cap);\n"
+            "                if (!items) return l.fail(Errc::out_of_memory, tok);\n"
+            "                std::uninitialized_copy(res.data, res.data + res.size, items);\n"
+            "                res.data = items;\n"
+            "                cap = new_cap;\n"
+            "            }\n"
+            "            if (!Parser<T>::parse(l, res.data[res.size++], arena)) return false;\n"
+            "        }\n"
+            "        l.leave();\n"
+            "        return true;\n"
+            "    }\n"
+            "};\n"
+            "\n"
+            "// The table is sized once from a pre-count of the members, keeping the load\n"
+            "// factor at or below one half. Later duplicates replace earlier values.\n"
+            "template <class T>\n"
+            "struct Parser<Map<T>> {\n"
+            "    static bool parse(Lexer &l, Map<T> &res, Arena &arena) noexcept {\n"
+            "        Token tok = l.next();\n"
+            "        if (tok.type != Token::lbrace) return l.fail_type(tok);\n"
+            "        if (!l.enter(tok)) return false;\n"
+            "        size_t count;\n"
+            "        if (!l.count_members(count)) return false;\n"
+            "        res = Map<T>();\n"
+            "        if (count) {\n"
+            "            res.cap = " STR(JIPG_INIT_LIST_CAP) ";\n"
+            "            while (res.cap < 2 * count) res.cap *= 2;\n"
+            "            res.hashes = arena.make<uint64_t>(res.cap);\n"
+            "            res.entries = arena.make<typename Map<T>::Entry>(res.cap);\n"
+            "            if (!res.hashes || !res.entries) return l.fail(Errc::out_of_memory, tok);\n"
+            "        }\n"
+            "        for (tok = l.next(); tok.type != Token::rbrace;) {\n"
+            "            std::string_view key;\n"
+            "            if (tok.type != Token::string) return l.fail(Errc::syntax, tok);\n"
+            "            if (!string_value(l, tok, key, arena)) return false;\n"
+            "            tok = l.next();\n"
+            "            if (tok.type != Token::colon) return l.fail(Errc::syntax, tok);\n"
+            "            uint64_t h = key_hash(key);\n"
+            "            size_t i = res.slot(h, key);\n"
+            "            if (!res.hashes[i]) {\n"
+            "                res.hashes[i] = h;\n"
+            "                res.entries[i].key = key;\n"
+            "                ++res.size;\n"
+            "            }\n"
+            "            if (!Parser<T>::parse(l, res.entries[i].value, arena)) return false;\n"
+            "            tok = l.next();\n"
+            "            if (tok.type == Token::comma) tok = l.next();\n"
+            "        }\n"
+            "        l.leave();\n"
+            "        return true;\n"
+            "    }\n"
+            "};\n"
+            "\n"
+            "// Parses json into res. Strings refer to json, everything else res refers to\n"
+            "// lives in arena.\n"
+            "template <class T>\n"
+            "Result parse(std::string_view json, T &res, Arena &arena) noexcept {\n"
+            "    Lexer l(json);\n"
+            "    Parser<T>::parse(l, res, arena);\n"
+            "    return l.result;\n"
+            "}\n"
+            "\n"
+            "}  // namespace jipg\n"
+            "#endif\n");
+    fprintf(header, "\n");
+}
 
-    fprintf(source,
-            "static inline bool parse_%s(Lexer *l, %s *res) {\n"
-            "    Token lbrace = next_token(l);\n"
-            "    if (lbrace.type != TOKEN_TYPE_LBRACE) return false;\n"
-            "    Token tok = next_token(l);\n"
-            "    while (tok.type != TOKEN_TYPE_RBRACE) {\n"
-            "        if (tok.type != TOKEN_TYPE_STRING) return false;\n"
-            "        uint64_t key_hash = hash(&tok);\n"
-            "        tok = next_token(l);\n"
-            "        if (tok.type != TOKEN_TYPE_COLON) return false;\n"
-            "        switch (key_hash) {\n",
-            struct_name, struct_name);
+// Struct kinds are qualified inside namespace jipg.
+static void jipg_emit_cpp_type(FILE *header, const Jipg_Value *value, const char *scope) {
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT_KV:
+        case JIPG_KIND_UNION_CASE:
+        case JIPG_KIND_VALUE_COUNT:
+            UNREACHABLE();
 
-    kv = object->as_object.kv_head;
-    for (; kv; kv = kv->as_object_kv.next) {
-        const char *key = kv->as_object_kv.key;
-        uint64_t key_hash = sbox_hash(key);
-        fprintf(source,
-                "            case %lullu: {  // %s\n",
-                key_hash, key);
+        case JIPG_KIND_OBJECT:
+        case JIPG_KIND_ARRAY:
+        case JIPG_KIND_UNION:
+        case JIPG_KIND_MAP:
+        case JIPG_KIND_ENUM: {
+            fprintf(header, "%s%s", scope, jipg_value_struct_name(value));
+        } break;
+        case JIPG_KIND_REF: {
+            fprintf(header, "%s%s *", scope, value->as_ref.head);
+        } break;
+        case JIPG_KIND_STRING:
+        case JIPG_KIND_STRING_INTERNED: {
+            fprintf(header, "std::string_view");
+        } break;
+        case JIPG_KIND_INT: {
+            fprintf(header, "%s", JIPG_DEFAULT_INT_TYPE);
+        } break;
+        case JIPG_KIND_FLOAT: {
+            fprintf(header, "%s", JIPG_DEFAULT_FLOAT_TYPE);
+        } break;
+        case JIPG_KIND_BOOL: {
+            fprintf(header, "bool");
+        } break;
+        case JIPG_KIND_NUMBER_RAW: {
+            fprintf(header, "jipg::Number");
+        } break;
+    }
+}
+
+// Optional and nullable members are std::optional, except references, which
+// are null when absent.
+static void jipg_emit_cpp_member_type(FILE *header, const Jipg_Value *value, const char *scope) {
+    bool wrap = (value->optional || value->nullable) && value->kind != JIPG_KIND_REF;
+    if (wrap) fprintf(header, "std::optional<");
+    jipg_emit_cpp_type(header, value, scope);
+    if (wrap) fprintf(header, ">");
+}
+
+static void jipg_emit_cpp_item_type(FILE *header, const Jipg_Value *internal, const char *scope) {
+    if (internal->kind == JIPG_KIND_REF)
+        fprintf(header, "%s%s", scope, internal->as_ref.head);
+    else
+        jipg_emit_cpp_type(header, internal, scope);
+}
+
+static void jipg_emit_cpp_types(FILE *header, Jipg_Value *value) {
+    const char *struct_name = jipg_value_struct_name(value);
+    switch (value->shared ? JIPG_KIND_VALUE_COUNT : value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                jipg_emit_cpp_types(header, kv->as_object_kv.value);
+
+            fprintf(header, "struct %s {\n", struct_name);
+            kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next) {
+                fprintf(header, "    ");
+                jipg_emit_cpp_member_type(header, kv->as_object_kv.value, "");
+                fprintf(header, " %s%s;\n", kv->as_object_kv.key,
+                        kv->as_object_kv.value->kind == JIPG_KIND_REF ? " = nullptr" : "");
+            }
+            fprintf(header, "};\n\n");
+        } break;
+
+        // Arrays and maps are structs rather than aliases so references can
+        // declare them ahead.
+        case JIPG_KIND_ARRAY: {
+            Jipg_Value *internal = value->as_array.internal;
+            jipg_emit_cpp_types(header, internal);
+            fprintf(header, "struct %s : jipg::Span<", struct_name);
+            jipg_emit_cpp_item_type(header, internal, "");
+            fprintf(header, ", %zu> {};\n\n", value->as_array.cap);
+        } break;
+
+        case JIPG_KIND_MAP: {
+            Jipg_Value *internal = value->as_map.internal;
+            jipg_emit_cpp_types(header, internal);
+            fprintf(header, "struct %s : jipg::Map<", struct_name);
+            jipg_emit_cpp_type(header, internal, "");
+            fprintf(header, "> {};\n\n");
+        } break;
+
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_emit_cpp_types(header, c->as_union_case.value);
+
+            fprintf(header,
+                    "struct %s {\n"
+                    "    // Values of \"%s\", in the order of value's alternatives.\n"
+                    "    enum class Tag : uint32_t {\n",
+                    struct_name, value->as_union.discriminator);
+            c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next) {
+                fprintf(header, "        ");
+                fprintf(header, "%s", c->as_union_case.name);
+                fprintf(header, ",\n");
+            }
+            fprintf(header,
+                    "    };\n"
+                    "    std::variant<");
+            c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next) {
+                if (c != value->as_union.case_head) fprintf(header, ", ");
+                jipg_emit_cpp_type(header, c->as_union_case.value, "");
+            }
+            fprintf(header,
+                    "> value;\n"
+                    "\n"
+                    "    Tag tag() const noexcept { return static_cast<Tag>(value.index()); }\n"
+                    "};\n\n");
+        } break;
+
+        case JIPG_KIND_ENUM: {
+            fprintf(header, "enum class %s : uint32_t {\n", struct_name);
+            for (size_t i = 0; i < value->as_enum.count; ++i) {
+                fprintf(header, "    ");
+                jipg_emit_identifier(header, value->as_enum.names[i]);
+                fprintf(header, ",\n");
+            }
+            fprintf(header, "};\n\n");
+        } break;
+
+        default: {
+        }
+    }
+}
+
+// Declares every parser before any is defined, so parsers can call each other
+// whatever the order of their types, as references require.
+static void jipg_emit_cpp_parser_decls(FILE *header, Jipg_Value *value) {
+    if (value->shared) return;
+    const char *struct_name = jipg_value_struct_name(value);
+    switch (value->kind) {
+        case JIPG_KIND_OBJECT: {
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                jipg_emit_cpp_parser_decls(header, kv->as_object_kv.value);
+
+            fprintf(header,
+                    "template <>\n"
+                    "struct Parser<::%s> {\n"
+                    "    static constexpr std::string_view keys[] = {",
+                    struct_name);
+            kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                fprintf(header, "%s\"%s\"", kv == value->as_object.kv_head ? "" : ", ", kv->as_object_kv.key);
+            // An empty array is ill-formed.
+            if (!value->as_object.kv_head) fprintf(header, "\"\"");
+            fprintf(header,
+                    "};\n"
+                    "    static bool parse(Lexer &l, ::%s &res, Arena &arena) noexcept;\n"
+                    "    // tok follows the '{', or the discriminator of a union case.\n"
+                    "    static bool members(Lexer &l, ::%s &res, Arena &arena, Token tok) noexcept;\n"
+                    "};\n\n",
+                    struct_name, struct_name);
+        } break;
+
+        case JIPG_KIND_ARRAY: {
+            jipg_emit_cpp_parser_decls(header, value->as_array.internal);
+            fprintf(header,
+                    "template <>\n"
+                    "struct Parser<::%s> : Parser<Span<",
+                    struct_name);
+            jipg_emit_cpp_item_type(header, value->as_array.internal, "::");
+            fprintf(header, ", %zu>> {};\n\n", value->as_array.cap);
+        } break;
+
+        case JIPG_KIND_MAP: {
+            jipg_emit_cpp_parser_decls(header, value->as_map.internal);
+            fprintf(header,
+                    "template <>\n"
+                    "struct Parser<::%s> : Parser<Map<",
+                    struct_name);
+            jipg_emit_cpp_type(header, value->as_map.internal, "::");
+            fprintf(header, ">> {};\n\n");
+        } break;
 
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_emit_cpp_parser_decls(header, c->as_union_case.value);
+
+            fprintf(header,
+                    "template <>\n"
+                    "struct Parser<::%s> {\n"
+                    "    static constexpr std::string_view discriminator = \"%s\";\n"
+                    "    static constexpr std::string_view tags[] = {",
+                    struct_name, value->as_union.discriminator);
+            c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                fprintf(header, "%s\"%s\"", c == value->as_union.case_head ? "" : ", ", c->as_union_case.tag);
+            fprintf(header,
+                    "};\n"
+                    "    static bool parse(Lexer &l, ::%s &res, Arena &arena) noexcept;\n"
+                    "};\n\n",
+                    struct_name);
+        } break;
+
+        case JIPG_KIND_ENUM: {
+            fprintf(header,
+                    "template <>\n"
+                    "struct Parser<::%s> {\n"
+                    "    static constexpr std::string_view names[] = {",
+                    struct_name);
+            for (size_t i = 0; i < value->as_enum.count; ++i)
+                fprintf(header, "%s\"%s\"", i ? ", " : "", value->as_enum.names[i]);
+            fprintf(header,
+                    "};\n"
+                    "    static bool parse(Lexer &l, ::%s &res, Arena &arena) noexcept;\n"
+                    "};\n\n",
+                    struct_name);
+        } break;
+
+        default: {
+        }
+    }
+}
+
+static void jipg_emit_cpp_object_parser(FILE *header, Jipg_Value *object) {
+    const char *struct_name = object->as_object.struct_name;
+    size_t seen_words = jipg_object_seen_words(object);
+
+    fprintf(header,
+            "inline bool Parser<::%s>::parse(Lexer &l, ::%s &res, Arena &arena) noexcept {\n"
+            "    Token tok = l.next();\n"
+            "    if (tok.type != Token::lbrace) return l.fail_type(tok);\n"
+            "    return members(l, res, arena, l.next());\n"
+            "}\n\n"
+            "inline bool Parser<::%s>::members(Lexer &l, ::%s &res, Arena &arena, Token tok) noexcept {\n"
+            "    if (!l.enter(tok)) return false;\n",
+            struct_name, struct_name, struct_name, struct_name);
+    if (seen_words) fprintf(header, "    uint64_t seen[%zu] = {};\n", seen_words);
+    fprintf(header,
+            "    while (tok.type != Token::rbrace) {\n"
+            "        if (tok.type != Token::string) return l.fail(Errc::syntax, tok);\n"
+            "        std::string_view key;\n"
+            "        if (!string_value(l, tok, key, arena)) return false;\n"
+            "        tok = l.next();\n"
+            "        if (tok.type != Token::colon) return l.fail(Errc::syntax, tok);\n"
+            "        switch (key_hash(key)) {\n");
+
+    size_t required_bit = 0, member = 0;
+    Jipg_Value *kv = object->as_object.kv_head;
+    for (; kv; kv = kv->as_object_kv.next, ++member) {
+        const char *key = kv->as_object_kv.key;
         const Jipg_Value *value = kv->as_object_kv.value;
 
-        fprintf(source,
-                "                if (!parse_%s(l, &res->%s))\n"
-                "                    return false;\n",
-                jipg_value_name(value), key);
+        fprintf(header,
+                "            case key_hash(keys[%zu]): {\n"
+                "                if (key != keys[%zu]) goto unknown;\n",
+                member, member);
+        if (!value->optional) {
+            fprintf(header, "                seen[%zu] |= uint64_t(1) << %zu;\n", required_bit / 64,
+                    required_bit % 64);
+            ++required_bit;
+        }
 
-        fprintf(source,
-                "            } break;\n");
+        if (value->nullable) {
+            fprintf(header,
+                    "                const char *save = l.pos();\n"
+                    "                if (l.next().type == Token::null) {\n"
+                    "                    res.%s = {};\n"
+                    "                    break;\n"
+                    "                }\n"
+                    "                l.rewind(save);\n",
+                    key);
+        }
+
+        fprintf(header, "                if (!Parser<");
+        jipg_emit_cpp_type(header, value, "::");
+        if ((value->optional || value->nullable) && value->kind != JIPG_KIND_REF)
+            fprintf(header, ">::parse(l, res.%s.emplace(), arena)) return false;\n", key);
+        else
+            fprintf(header, ">::parse(l, res.%s, arena)) return false;\n", key);
+        fprintf(header, "            } break;\n");
     }
 
-    fprintf(source,
+    fprintf(header,
+            "            default:\n"
+            "%s"
+            "                if (!l.skip_value()) return false;\n"
             "        }\n"
-            "        tok = next_token(l);\n"
-            "        if (tok.type == TOKEN_TYPE_COMMA)\n"
-            "            tok = next_token(l);\n"
+            "        tok = l.next();\n"
+            "        if (tok.type == Token::comma) tok = l.next();\n"
             "    }\n"
+            "    l.leave();\n",
+            object->as_object.kv_head ? "            unknown:\n" : "");
+
+    for (size_t w = 0; w < seen_words; ++w) {
+        size_t bits = required_bit - w * 64 < 64 ? required_bit - w * 64 : 64;
+        uint64_t mask = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+        fprintf(header, "    if (seen[%zu] != %lluu) return l.fail(Errc::missing_member, tok);\n", w,
+                (unsigned long long)mask);
+    }
+    fprintf(header,
             "    return true;\n"
-            "}\n");
+            "}\n\n");
 }
 
-static void jipg_emit_array_parser(FILE *source, Jipg_Value *array) {
-    const char *struct_name = array->as_array.struct_name;
-    Jipg_Value *internal = array->as_array.internal;
-    jipg_emit_value_parser(source, internal);
-    fprintf(source,
-            "static inline bool parse_%s(Lexer *l, %s *res) {\n"
-            "    Token lbracket = next_token(l);\n"
-            "    if (lbracket.type != TOKEN_TYPE_LBRACKET) return false;\n"
-            "    for (;;) {\n"
-            "        Lexer save = *l;\n"
-            "        Token tok = next_token(l);\n"
-            "        if (tok.type == TOKEN_TYPE_RBRACKET) break;\n"
-            "        if (tok.type != TOKEN_TYPE_COMMA) *l = save;\n",
+static void jipg_emit_cpp_union_parser(FILE *header, Jipg_Value *u) {
+    const char *struct_name = u->as_union.struct_name;
+
+    fprintf(header,
+            "inline bool Parser<::%s>::parse(Lexer &l, ::%s &res, Arena &arena) noexcept {\n"
+            "    Token tok = l.next();\n"
+            "    if (tok.type != Token::lbrace) return l.fail_type(tok);\n"
+            "    const char *start = l.pos();\n"
+            "    Token tag;\n"
+            "    tok = l.next();\n"
+            "    if (tok.type == Token::string && token_equals(tok, discriminator)) {\n"
+            "        tok = l.next();\n"
+            "        if (tok.type != Token::colon) return l.fail(Errc::syntax, tok);\n"
+            "        tag = l.next();\n"
+            "        tok = l.next();\n"
+            "        if (tok.type == Token::comma) tok = l.next();\n"
+            "    } else {\n"
+            "        l.rewind(start);\n"
+            "        if (!l.find_key(discriminator, tag)) return false;\n"
+            "        l.rewind(start);\n"
+            "        tok = l.next();\n"
+            "    }\n"
+            "    if (tag.type != Token::string) return l.fail_type(tag);\n"
+            "    std::string_view name;\n"
+            "    if (!string_value(l, tag, name, arena)) return false;\n"
+            "    switch (key_hash(name)) {\n",
             struct_name, struct_name);
 
-    if (array->as_array.cap) {
-        size_t cap = array->as_array.cap;
-        fprintf(source,
-                "        if (res->len == 0) {\n"
-                "            res->items = %s(NULL, %zu * sizeof(*res->items));\n"
-                "            if (res->items == NULL) return false;\n"
-                "        }\n"
-                "        if (res->len == %zu) return false;\n",
-                STR(JIPG_REALLOC), cap, cap);
-    } else {
-        fprintf(source,
-                "        if (res->len == 0 || (res->len > %d && (res->len & (res->len - 1)) == 0)) {\n"
-                "            size_t new_cap = res->len ? res->len * 2 : %d;\n"
-                "            res->items = %s(res->items, new_cap * sizeof(*res->items));\n"
-                "            if (res->items == NULL) return false;\n"
-                "        }\n",
-                JIPG_INIT_LIST_CAP, JIPG_INIT_LIST_CAP, STR(JIPG_REALLOC));
+    size_t i = 0;
+    Jipg_Value *c = u->as_union.case_head;
+    for (; c; c = c->as_union_case.next, ++i) {
+        fprintf(header,
+                "        case key_hash(tags[%zu]):\n"
+                "            if (name != tags[%zu]) break;\n"
+                "            return Parser<::%s>::members(l, res.value.emplace<%zu>(), arena, tok);\n",
+                i, i, jipg_value_struct_name(c->as_union_case.value), i);
     }
+    fprintf(header,
+            "    }\n"
+            "    return l.fail(Errc::unknown_tag, tag);\n"
+            "}\n\n");
+}
 
-    fprintf(source,
-            "        if (!parse_%s(l, res->items + res->len++))\n"
-            "            return false;\n"
+static void jipg_emit_cpp_enum_parser(FILE *header, Jipg_Value *e) {
+    const char *struct_name = e->as_enum.struct_name;
+
+    fprintf(header,
+            "inline bool Parser<::%s>::parse(Lexer &l, ::%s &res, Arena &arena) noexcept {\n"
+            "    Token tok = l.next();\n"
+            "    if (tok.type != Token::string) return l.fail_type(tok);\n"
+            "    std::string_view name;\n"
+            "    if (!string_value(l, tok, name, arena)) return false;\n"
+            "    switch (key_hash(name)) {\n",
+            struct_name, struct_name);
+    for (size_t i = 0; i < e->as_enum.count; ++i) {
+        fprintf(header,
+                "        case key_hash(names[%zu]):\n"
+                "            if (name != names[%zu]) break;\n"
+                "            res = ::%s::",
+                i, i, struct_name);
+        jipg_emit_identifier(header, e->as_enum.names[i]);
+        fprintf(header,
+                ";\n"
+                "            return true;\n");
+    }
+    fprintf(header,
             "    }\n"
-            "    return true;\n"
-            "}\n",
-            jipg_value_name(internal));
+            "    return l.fail(Errc::unknown_tag, tok);\n"
+            "}\n\n");
 }
 
-static void jipg_emit_value_parser(FILE *source, Jipg_Value *value) {
+static void jipg_emit_cpp_parsers(FILE *header, Jipg_Value *value) {
+    if (value->shared) return;
     switch (value->kind) {
         case JIPG_KIND_OBJECT: {
-            jipg_emit_object_parser(source, value);
+            Jipg_Value *kv = value->as_object.kv_head;
+            for (; kv; kv = kv->as_object_kv.next)
+                jipg_emit_cpp_parsers(header, kv->as_object_kv.value);
+            jipg_emit_cpp_object_parser(header, value);
         } break;
         case JIPG_KIND_ARRAY: {
-            jipg_emit_array_parser(source, value);
+            jipg_emit_cpp_parsers(header, value->as_array.internal);
+        } break;
+        case JIPG_KIND_MAP: {
+            jipg_emit_cpp_parsers(header, value->as_map.internal);
+        } break;
+        case JIPG_KIND_UNION: {
+            Jipg_Value *c = value->as_union.case_head;
+            for (; c; c = c->as_union_case.next)
+                jipg_emit_cpp_parsers(header, c->as_union_case.value);
+            jipg_emit_cpp_union_parser(header, value);
+        } break;
+        case JIPG_KIND_ENUM: {
+            jipg_emit_cpp_enum_parser(header, value);
         } break;
         default: {
         }
     }
 }
 
-static void jipg_emit_head_value_parser(FILE *source, Jipg_Value *value) {
-    jipg_emit_value_parser(source, value);
+static void jipg_emit_cpp_header(FILE *header, Jipg_Value **values, size_t value_count, char *header_name) {
+    fprintf(header, "// NOTE: This file has been auto-generated by %s\n\n", __FILE__);
+    fprintf(header, "#ifndef ");
+    jipg_emit_cpp_header_macro(header, header_name);
+    fprintf(header, "\n#define ");
+    jipg_emit_cpp_header_macro(header, header_name);
+    fprintf(header, "\n\n");
 
-    const char *struct_name = jipg_value_struct_name(value);
-    JIPG_ASSERT(struct_name);
+    jipg_emit_cpp_runtime(header);
 
-    int n = strlen(struct_name) - 1;
+    // Every head is declared up front so references can point to it.
+    for (size_t i = 0; i < value_count; ++i) {
+        const char *struct_name = jipg_value_struct_name(values[i]);
+        JIPG_ASSERT(struct_name);
+        if (values[i]->kind == JIPG_KIND_ENUM) continue;
+        fprintf(header,
+                "struct %s;\n"
+                "using %s = %s;\n",
+                struct_name, values[i]->head, struct_name);
+    }
+    fprintf(header, "\n");
 
-    fprintf(source,
-            "bool parse_%s(const char *json, size_t json_length, %s *res) {\n"
-            "    Lexer l = {\n"
-            "        .input = json,\n"
-            "        .len = json_length,\n"
-            "    };\n"
-            "    read_char(&l);\n"
-            "    return parse_%s(&l, res);\n"
-            "}\n",
-            value->head, value->head, struct_name);
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_cpp_types(header, values[i]);
+    for (size_t i = 0; i < value_count; ++i) {
+        if (values[i]->kind == JIPG_KIND_ENUM)
+            fprintf(header, "using %s = %s;\n\n", values[i]->head, jipg_value_struct_name(values[i]));
+    }
+
+    fprintf(header, "namespace jipg {\n\n");
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_cpp_parser_decls(header, values[i]);
+    for (size_t i = 0; i < value_count; ++i) jipg_emit_cpp_parsers(header, values[i]);
+    fprintf(header, "}  // namespace jipg\n\n");
+
+    for (size_t i = 0; i < value_count; ++i) {
+        const char *name = values[i]->head;
+        fprintf(header,
+                "// Parses json into res. Strings in res point into json and everything else\n"
+                "// into arena, so both must outlive it.\n"
+                "inline jipg::Result parse_%s(std::string_view json, %s &res, jipg::Arena &arena) noexcept {\n"
+                "    return jipg::parse(json, res, arena);\n"
+                "}\n\n",
+                name, name);
+    }
+
+    fprintf(header, "#endif  // ");
+    jipg_emit_cpp_header_macro(header, header_name);
 }
 
-static void jipg_emit_source(FILE *source, Jipg_Value **values, size_t value_count, const char *header_name) {
-    static const char *source_includes[] = {
-        "<stdbool.h>",
-        "<stdint.h>",
-        "<stdlib.h>",
-        "<string.h>",
-        "<ctype.h>",
-    };
+typedef struct {
+    const char *path;
+    char *tmp_path;
+    FILE *file;
+} Jipg_Output;
+
+// Outputs are written to <path>.tmp and only moved over <path> when their
+// content changed, so regenerating an unchanged schema keeps the mtimes of
+// its outputs and nothing depending on them is rebuilt.
+static bool jipg_open_output(Jipg_Output *out, const char *path) {
+    int n = snprintf(NULL, 0, "%s.tmp", path);
+    out->path = path;
+    out->tmp_path = JIPG_REALLOC(NULL, n + 1);
+    JIPG_ASSERT(out->tmp_path);
+    snprintf(out->tmp_path, n + 1, "%s.tmp", path);
+
+    out->file = fopen(out->tmp_path, "w+b");
+    if (out->file == NULL) {
+        fprintf(stderr, "Unable to open %s\n", out->tmp_path);
+        return false;
+    }
+    return true;
+}
 
-    if (header_name)
-        fprintf(source, "#include \"%s\"\n", header_name);
+static bool jipg_output_unchanged(FILE *tmp, const char *path) {
+    FILE *old = fopen(path, "rb");
+    if (old == NULL) return false;
+
+    bool same = true;
+    rewind(tmp);
+    char a[4096], b[4096];
+    for (;;) {
+        size_t na = fread(a, 1, sizeof(a), tmp);
+        size_t nb = fread(b, 1, sizeof(b), old);
+        if (na != nb || memcmp(a, b, na) != 0) {
+            same = false;
+            break;
+        }
+        if (na == 0) break;
+    }
 
-    for (size_t i = 0; i < ARRAY_SIZE(source_includes); ++i)
-        fprintf(source, "#include %s\n", source_includes[i]);
-    fprintf(source, "\n");
+    fclose(old);
+    return same;
+}
 
-    jipg_emit_lexer_impl(source);
-    jipg_emit_helpers(source);
+static bool jipg_close_output(Jipg_Output *out) {
+    bool ok = fflush(out->file) == 0 && !ferror(out->file);
+    bool same = ok && jipg_output_unchanged(out->file, out->path);
+    fclose(out->file);
 
-    for (size_t i = 0; i < value_count; ++i) {
-        Jipg_Value *value = values[i];
-        jipg_emit_head_value_parser(source, value);
+    if (ok && !same && rename(out->tmp_path, out->path) != 0) {
+        fprintf(stderr, "Unable to write %s\n", out->path);
+        ok = false;
+    }
+    if (!ok || same) remove(out->tmp_path);
+
+    JIPG_FREE(out->tmp_path);
+    return ok;
+}
+
+static void jipg_discard_output(Jipg_Output *out) {
+    fclose(out->file);
+    remove(out->tmp_path);
+    JIPG_FREE(out->tmp_path);
+}
+
+static void jipg_emit_dep_path(FILE *dep, const char *path) {
+    for (; *path; ++path) {
+        if (*path == ' ' || *path == '#' || *path == '\\') fputc('\\', dep);
+        if (*path == '$') fputc('$', dep);
+        fputc(*path, dep);
+    }
+}
+
+// Appends the prerequisites of the make style depfile at path, e.g. the one
+// `cc -MD` wrote for the generator itself, which also lists the headers the
+// schema sources include. Targets, and the empty rules -MP adds, are skipped.
+// The paths are unescaped into the returned buffer.
+static char *jipg_read_dep_prereqs(const char *path, const char ***deps, size_t *dep_count) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return NULL;
+    }
+    size_t len = 0, cap = 1 << 12;
+    char *text = JIPG_REALLOC(NULL, cap + 1);
+    JIPG_ASSERT(text);
+    for (size_t n; (n = fread(text + len, 1, cap - len, file)) > 0;) {
+        len += n;
+        if (len == cap) {
+            text = JIPG_REALLOC(text, (cap *= 2) + 1);
+            JIPG_ASSERT(text);
+        }
+    }
+    fclose(file);
+    text[len] = '\0';
+
+    // Words only shrink when unescaped, so they fit next to their NULs.
+    char *words = JIPG_REALLOC(NULL, 2 * len + 1);
+    JIPG_ASSERT(words);
+    bool prereqs = false;
+    char *p = text, *out = words;
+    while (*p) {
+        if (*p == '\n') {
+            prereqs = false;
+            ++p;
+            continue;
+        }
+        if (*p == ' ' || *p == '\t' || *p == '\r' || (p[0] == '\\' && (p[1] == '\n' || p[1] == '\r'))) {
+            p += *p == '\\' ? 2 : 1;
+            continue;
+        }
+        char *word = out;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+            if (p[0] == '\\' && (p[1] == '\n' || p[1] == '\r')) break;
+            if (p[0] == '\\' && (p[1] == ' ' || p[1] == '#' || p[1] == '\\')) ++p;
+            else if (p[0] == '$' && p[1] == '$') ++p;
+            *out++ = *p++;
+        }
+        bool target = !prereqs && out > word && out[-1] == ':';
+        *out++ = '\0';
+        if (target || (!prereqs && strcmp(word, ":") == 0)) {
+            prereqs = true;
+        } else if (prereqs) {
+            *deps = JIPG_REALLOC(*deps, (*dep_count + 1) * sizeof(**deps));
+            JIPG_ASSERT(*deps);
+            (*deps)[(*dep_count)++] = word;
+        }
+    }
+    JIPG_FREE(text);
+    return words;
+}
+
+// Make/ninja style depfile: every output depends on the schema sources that
+// registered parsers, the --profile samples, jipg.h itself and the
+// prerequisites of merge_path, if given.
+static bool jipg_emit_depfile(FILE *dep, const char **outputs, size_t output_count, const char *merge_path) {
+    const char **deps = NULL;
+    size_t dep_count = 0;
+    for (size_t i = 0; i < jipg_global_context.parser_count; ++i) {
+        deps = JIPG_REALLOC(deps, (dep_count + 1) * sizeof(*deps));
+        JIPG_ASSERT(deps);
+        deps[dep_count++] = jipg_global_context.parsers[i].schema_file;
+    }
+    for (size_t i = 0; i < jipg_global_context.profile_count; ++i) {
+        deps = JIPG_REALLOC(deps, (dep_count + 1) * sizeof(*deps));
+        JIPG_ASSERT(deps);
+        deps[dep_count++] = jipg_global_context.profiles[i];
+    }
+    deps = JIPG_REALLOC(deps, (dep_count + 1) * sizeof(*deps));
+    JIPG_ASSERT(deps);
+    deps[dep_count++] = __FILE__;
+    char *merged = NULL;
+    if (merge_path && !(merged = jipg_read_dep_prereqs(merge_path, &deps, &dep_count))) {
+        JIPG_FREE(deps);
+        return false;
     }
+
+    for (size_t i = 0; i < output_count; ++i) {
+        if (i) fputc(' ', dep);
+        jipg_emit_dep_path(dep, outputs[i]);
+    }
+    fputc(':', dep);
+    for (size_t i = 0; i < dep_count; ++i) {
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; ++j) seen = strcmp(deps[j], deps[i]) == 0;
+        if (seen) continue;
+        fputc(' ', dep);
+        jipg_emit_dep_path(dep, deps[i]);
+    }
+    fprintf(dep, "\n");
+
+    JIPG_FREE(merged);
+    JIPG_FREE(deps);
+    return true;
 }
 
 static int jipg_main(int argc, char *argv[]) {
     size_t value_count = jipg_global_context.parser_count;
-    static Jipg_Value *values[JIPG_PARSER_CAP];
+    Jipg_Value **values = JIPG_REALLOC(NULL, (value_count ? value_count : 1) * sizeof(*values));
+    JIPG_ASSERT(values);
     for (size_t i = 0; i < value_count; ++i) {
         Jipg_Parser *parser = jipg_global_context.parsers + i;
         values[i] = parser->value_gen();
@@ -1089,16 +7813,34 @@ static int jipg_main(int argc, char *argv[]) {
             values[i],
             parser->head_struct_name);
     }
+    for (size_t i = 0; i < value_count; ++i)
+        jipg_resolve_refs(values[i], values, value_count);
 
     char *header_name = "jsonparser.h";
     char *source_name = "jsonparser.c";
+    char *runtime_header_name = NULL;
+    char *runtime_source_name = NULL;
+    char *depfile_name = NULL;
+    char *depfile_merge_name = NULL;
     bool single_file = false;
+    bool cpp = false;
 
     for (size_t idx = 1; idx < (size_t)argc; ++idx) {
         const char help_str[] = "--help";
         const char header_str[] = "--header=";
         const char source_str[] = "--source=";
         const char single_file_str[] = "--single-file";
+        const char runtime_header_str[] = "--runtime-header=";
+        const char runtime_source_str[] = "--runtime-source=";
+        const char depfile_str[] = "--depfile=";
+        const char depfile_merge_str[] = "--depfile-merge=";
+        const char instrument_str[] = "--instrument";
+        const char snapshot_str[] = "--snapshot";
+        const char lang_str[] = "--lang=";
+        const char pipeline_str[] = "--pipeline";
+        const char profile_str[] = "--profile=";
+        const char arena_str[] = "--arena";
+        const char gzip_str[] = "--gzip";
 
         if (strncmp(argv[idx], help_str, strlen(help_str)) == 0) {
             printf(
@@ -1107,7 +7849,31 @@ static int jipg_main(int argc, char *argv[]) {
                 "  --help                  Show this message and exit.\n"
                 "  --header=<header-file>  Path of generated header file.\n"
                 "  --source=<source-file>  Path of generated source file.\n"
-                "  --single-file           Generates single STB style header file.\n");
+                "  --single-file           Generates single STB style header file.\n"
+                "  --runtime-header=<file> Use the shared runtime (lexer and helpers) declared in\n"
+                "                          <file> instead of embedding it in the generated source.\n"
+                "  --runtime-source=<file> Also emit the shared runtime header and source. Only one\n"
+                "                          generator in a build needs to do this.\n"
+                "  --depfile=<file>        Write a make/ninja depfile listing the schema sources the\n"
+                "                          outputs depend on. Headers those include are only listed\n"
+                "                          when merged in with --depfile-merge.\n"
+                "  --depfile-merge=<file>  Add the prerequisites of a depfile written when compiling\n"
+                "                          the generator (cc -MD) to the --depfile.\n"
+                "  --instrument            Emit parse counters and timers into <head>_stats. They\n"
+                "                          compile to nothing unless JIPG_INSTRUMENT is defined.\n"
+                "  --snapshot              Emit <head>_snapshot_write() and <head>_snapshot_map() to\n"
+                "                          save parse results to files that load with mmap.\n"
+                "  --pipeline              Emit parse_<head>_files() to read and parse many files\n"
+                "                          with io_uring and worker threads.\n"
+                "  --arena                 Emit parse_<head>_arena() to allocate results from per\n"
+                "                          thread, NUMA local huge page arenas.\n"
+                "  --gzip                  Emit parse_<head>_gzip_each() for array heads to parse\n"
+                "                          gzip streams while they are inflated on another thread.\n"
+                "  --lang=<c|c++>          Language of the generated parser. c++ emits only the\n"
+                "                          header, a header-only C++17 parser.\n"
+                "  --profile=<a.json,...>  Sample documents whose key order and lengths steer\n"
+                "                          dispatch order, array capacities and hot/cold marks.\n"
+                "Outputs whose content did not change are left untouched.\n");
             return 0;
         } else if (strncmp(argv[idx], header_str, strlen(header_str)) == 0) {
             header_name = argv[idx] + strlen(header_str);
@@ -1115,40 +7881,119 @@ static int jipg_main(int argc, char *argv[]) {
             source_name = argv[idx] + strlen(source_str);
         } else if (strncmp(argv[idx], single_file_str, strlen(single_file_str)) == 0) {
             single_file = true;
+        } else if (strncmp(argv[idx], runtime_header_str, strlen(runtime_header_str)) == 0) {
+            runtime_header_name = argv[idx] + strlen(runtime_header_str);
+        } else if (strncmp(argv[idx], runtime_source_str, strlen(runtime_source_str)) == 0) {
+            runtime_source_name = argv[idx] + strlen(runtime_source_str);
+        } else if (strncmp(argv[idx], depfile_str, strlen(depfile_str)) == 0) {
+            depfile_name = argv[idx] + strlen(depfile_str);
+        } else if (strncmp(argv[idx], depfile_merge_str, strlen(depfile_merge_str)) == 0) {
+            depfile_merge_name = argv[idx] + strlen(depfile_merge_str);
+        } else if (strncmp(argv[idx], instrument_str, strlen(instrument_str)) == 0) {
+            jipg_global_context.instrument = true;
+        } else if (strncmp(argv[idx], snapshot_str, strlen(snapshot_str)) == 0) {
+            jipg_global_context.snapshot = true;
+        } else if (strncmp(argv[idx], pipeline_str, strlen(pipeline_str)) == 0) {
+            jipg_global_context.pipeline = true;
+        } else if (strncmp(argv[idx], arena_str, strlen(arena_str)) == 0) {
+            jipg_global_context.result_arena = true;
+        } else if (strncmp(argv[idx], gzip_str, strlen(gzip_str)) == 0) {
+            jipg_global_context.gzip = true;
+        } else if (strncmp(argv[idx], profile_str, strlen(profile_str)) == 0) {
+            Jipg_Context *ctx = &jipg_global_context;
+            for (char *path = argv[idx] + strlen(profile_str); *path;) {
+                char *comma = strchr(path, ',');
+                if (comma) *comma = '\0';
+                ctx->profiles = JIPG_REALLOC(ctx->profiles, (ctx->profile_count + 1) * sizeof(*ctx->profiles));
+                JIPG_ASSERT(ctx->profiles);
+                ctx->profiles[ctx->profile_count++] = path;
+                path = comma ? comma + 1 : path + strlen(path);
+            }
+        } else if (strncmp(argv[idx], lang_str, strlen(lang_str)) == 0) {
+            const char *lang = argv[idx] + strlen(lang_str);
+            if (strcmp(lang, "c++") == 0) {
+                cpp = true;
+            } else if (strcmp(lang, "c") != 0) {
+                fprintf(stderr, "Unknown language %s\n", lang);
+                return 1;
+            }
         }
     }
 
-    FILE *header = fopen(header_name, "w");
-    if (header == NULL) {
-        fprintf(stderr, "Unable to open %s\n", header_name);
-        return 1;
+    if (jipg_global_context.instrument) {
+        for (size_t i = 0; i < value_count; ++i)
+            jipg_assign_stats_indices(values[i]);
     }
 
-    jipg_emit_header(header, values, value_count, header_name);
+    for (size_t i = 0; i < jipg_global_context.profile_count; ++i)
+        if (!jipg_profile_sample(jipg_global_context.profiles[i], values, value_count)) return 1;
 
-    FILE *source;
-    if (single_file) {
-        source = header;
+    const char *outputs[4];
+    size_t output_count = 0;
 
-        fprintf(source, "\n\n#ifdef ");
-        jipg_emit_header_impl_macro(header, header_name);
-        fprintf(source, "\n\n");
-    } else {
-        source = fopen(source_name, "w");
-        if (source == NULL) {
-            fprintf(stderr, "Unable to open %s\n", header_name);
+    if (runtime_source_name) {
+        if (!runtime_header_name) {
+            fprintf(stderr, "--runtime-source requires --runtime-header\n");
             return 1;
         }
+
+        Jipg_Output runtime_header;
+        if (!jipg_open_output(&runtime_header, runtime_header_name)) return 1;
+        jipg_emit_runtime_header(runtime_header.file, runtime_header_name);
+        if (!jipg_close_output(&runtime_header)) return 1;
+
+        Jipg_Output runtime_source;
+        if (!jipg_open_output(&runtime_source, runtime_source_name)) return 1;
+        jipg_emit_runtime_source(runtime_source.file, runtime_header_name);
+        if (!jipg_close_output(&runtime_source)) return 1;
+
+        outputs[output_count++] = runtime_header_name;
+        outputs[output_count++] = runtime_source_name;
     }
 
-    jipg_emit_source(source, values, value_count, single_file ? NULL : header_name);
+    Jipg_Output header;
+    if (!jipg_open_output(&header, header_name)) return 1;
+    outputs[output_count++] = header_name;
+
+    if (cpp) {
+        // The C++ parser is header-only.
+        jipg_emit_cpp_header(header.file, values, value_count, header_name);
+    } else {
+        jipg_emit_header(header.file, values, value_count, header_name);
+
+        Jipg_Output source;
+        if (single_file) {
+            source = header;
+
+            fprintf(source.file, "\n\n#ifdef ");
+            jipg_emit_header_impl_macro(header.file, header_name);
+            fprintf(source.file, "\n\n");
+        } else {
+            if (!jipg_open_output(&source, source_name)) return 1;
+            outputs[output_count++] = source_name;
+        }
+
+        jipg_emit_source(source.file, values, value_count, single_file ? NULL : header_name, runtime_header_name);
+
+        if (single_file) {
+            fprintf(source.file, "\n#endif  // ");
+            jipg_emit_header_impl_macro(header.file, header_name);
+        } else if (!jipg_close_output(&source)) {
+            return 1;
+        }
+    }
+    if (!jipg_close_output(&header)) return 1;
 
-    if (single_file) {
-        fprintf(source, "\n#endif  // ");
-        jipg_emit_header_impl_macro(header, header_name);
+    if (depfile_name) {
+        Jipg_Output depfile;
+        if (!jipg_open_output(&depfile, depfile_name)) return 1;
+        if (!jipg_emit_depfile(depfile.file, outputs, output_count, depfile_merge_name)) {
+            jipg_discard_output(&depfile);
+            return 1;
+        }
+        if (!jipg_close_output(&depfile)) return 1;
     }
 
-    fclose(header);
     return 0;
 }
 
@@ -1158,12 +8003,19 @@ static int jipg_main(int argc, char *argv[]) {
     }
 
 
-static inline uint64_t sbox_hash(const char *key) {
-    uint64_t res = 0;
-    for (; *key; ++key) {
-        res = (res + sbox_lut[*key]) * 3;
+static inline uint64_t jipg_key_hash(const char *key) {
+    size_t len = strlen(key);
+    uint64_t h = len * JIPG_KEY_HASH_SEED;
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t w = 0;
+        for (size_t k = 0; k < 8 && i + k < len; ++k) w |= (uint64_t)(unsigned char)key[i + k] << (8 * k);
+        h = (h ^ w) * JIPG_KEY_HASH_MUL;
+        h ^= h >> 32;
     }
-    return res;
+    h ^= h >> 29;
+    h *= JIPG_KEY_HASH_SEED;
+    h ^= h >> 32;
+    return h ? h : 1;
 }
 
 #endif  // JIPG_H